@@ -93,6 +93,8 @@ PRODUCT_COPY_FILES += \
 PRODUCT_PACKAGES += \
     nfc.grouper \
     libpn544_fw \
+    pn544_fw.bin \
+    libpn544_fw_loader \
     Nfc \
     Tag
 
@@ -17,8 +17,14 @@ ifneq (,$(filter grouper tilapia, $(TARGET_DEVICE)))
 
 # This is a nasty hack. keystore.grouper is Open Source, but it
 # links against a non-Open library, so we can only build it
-# when that library is present.
+# when that library is present. A build may name another library
+# implementing the same PKCS#11 interface, such as a software token,
+# in KEYMASTER_GROUPER_TOKEN_LIBRARY instead.
 ifeq ($(BOARD_HAS_TF_CRYPTO_SST),true)
+KEYMASTER_GROUPER_TOKEN_LIBRARY ?= libtf_crypto_sst
+endif
+
+ifneq ($(KEYMASTER_GROUPER_TOKEN_LIBRARY),)
 
 LOCAL_PATH := $(call my-dir)
 
@@ -37,7 +43,7 @@ LOCAL_C_INCLUDES := \
 
 LOCAL_CFLAGS := -fvisibility=hidden -Wall -Werror
 
-LOCAL_SHARED_LIBRARIES := libcutils liblog libcrypto libtf_crypto_sst
+LOCAL_SHARED_LIBRARIES := libcutils liblog libcrypto $(KEYMASTER_GROUPER_TOKEN_LIBRARY)
 
 LOCAL_MODULE_TAGS := optional
 
@@ -46,3 +52,64 @@ include $(BUILD_SHARED_LIBRARY)
 endif
 endif
 endif
+
+# Host benchmark: runs the HAL against the in-memory PKCS#11 token in
+# fake_token.cpp and reports throughput and TEE calls per operation.
+ifeq ($(HOST_OS),linux)
+
+LOCAL_PATH := $(call my-dir)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := keymaster_grouper_benchmark
+
+LOCAL_SRC_FILES := \
+	keymaster_grouper.cpp \
+	fake_token.cpp \
+	keymaster_benchmark.cpp
+
+LOCAL_C_INCLUDES := \
+	libcore/include \
+	external/boringssl/include \
+	$(LOCAL_PATH)/../security/tf_sdk/include
+
+# s_type.h only takes its fixed-width types from <stdint.h> when ANDROID is
+# defined.
+LOCAL_CFLAGS := -DANDROID -DLOG_NDEBUG=1 -fvisibility=hidden -Wall -Werror
+
+LOCAL_STATIC_LIBRARIES := libcutils liblog
+LOCAL_SHARED_LIBRARIES := libcrypto-host
+
+LOCAL_LDLIBS := -lpthread -ldl
+
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_EXECUTABLE)
+
+# Host stress test for the key handle cache; builds keymaster_grouper.cpp
+# into itself.
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := keymaster_grouper_test
+
+LOCAL_SRC_FILES := \
+	fake_token.cpp \
+	keymaster_test.cpp
+
+LOCAL_C_INCLUDES := \
+	libcore/include \
+	external/boringssl/include \
+	$(LOCAL_PATH)/../security/tf_sdk/include
+
+LOCAL_CFLAGS := -DANDROID -DLOG_NDEBUG=1 -fvisibility=hidden -Wall -Werror
+
+LOCAL_STATIC_LIBRARIES := libcutils liblog
+LOCAL_SHARED_LIBRARIES := libcrypto-host
+
+LOCAL_LDLIBS := -lpthread -ldl
+
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_EXECUTABLE)
+
+endif
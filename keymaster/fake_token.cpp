@@ -0,0 +1,1606 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * In-memory PKCS#11 token for running keymaster_grouper.cpp on the host.
+ * It implements the calls, mechanisms and attributes the HAL uses, the way
+ * the TF token behaves: every lookup returns a new object handle that is
+ * closed with C_CloseObjectHandle, subsessions hang off a primary session,
+ * and the private parts of keys can't be read back. The crypto is done
+ * with OpenSSL.
+ *
+ * The secure world runs on one core, so calls are serialized here, and
+ * each keeps the token busy for its configured latency on top of its own
+ * work.
+ */
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <openssl/bn.h>
+#include <openssl/crypto.h>
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/objects.h>
+#include <openssl/rand.h>
+#include <openssl/rsa.h>
+#include <openssl/sha.h>
+
+#define CRYPTOKI_EXPORTS
+#include <cryptoki.h>
+#include <pkcs11.h>
+
+#include <UniquePtr.h>
+
+#include "fake_token.h"
+
+/** Most objects, open object handles and sessions at once. */
+#define FAKE_MAX_OBJECTS 4096
+#define FAKE_MAX_HANDLES 0xffff
+#define FAKE_MAX_SESSIONS 32
+
+/** Attributes one object can carry. */
+#define FAKE_MAX_ATTRIBUTES 20
+
+#define AES_BLOCK_BYTES 16
+
+/* As in keymaster_grouper.cpp; the TF SDK header leaves these out. */
+#ifndef CKM_EC_KEY_PAIR_GEN
+#define CKM_EC_KEY_PAIR_GEN 0x00001040
+#endif
+#ifndef CKM_ECDSA
+#define CKM_ECDSA 0x00001041
+#endif
+#ifndef CKA_EC_PARAMS
+#define CKA_EC_PARAMS 0x00000180
+#endif
+#ifndef CKA_EC_POINT
+#define CKA_EC_POINT 0x00000181
+#endif
+
+/** DER OID of P-256, the only curve the token knows. */
+static const uint8_t P256_EC_PARAMS[] = {
+        0x06, 0x08, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x03, 0x01, 0x07,
+};
+#define EC_FIELD_BYTES 32
+#define EC_POINT_LENGTH (1 + 2 * EC_FIELD_BYTES)
+
+#define FAKE_FUNCTIONS(X) \
+        X(C_Initialize) \
+        X(C_Finalize) \
+        X(C_GetInfo) \
+        X(C_OpenSession) \
+        X(C_CloseSession) \
+        X(C_CreateObject) \
+        X(C_CopyObject) \
+        X(C_DestroyObject) \
+        X(C_CloseObjectHandle) \
+        X(C_GetAttributeValue) \
+        X(C_FindObjectsInit) \
+        X(C_FindObjects) \
+        X(C_FindObjectsFinal) \
+        X(C_GenerateKey) \
+        X(C_GenerateKeyPair) \
+        X(C_EncryptInit) \
+        X(C_Encrypt) \
+        X(C_DecryptInit) \
+        X(C_Decrypt) \
+        X(C_SignInit) \
+        X(C_Sign) \
+        X(C_VerifyInit) \
+        X(C_Verify)
+
+enum FakeFunction {
+#define FAKE_FUNCTION_ENUM(fn) FAKE_FN_##fn,
+    FAKE_FUNCTIONS(FAKE_FUNCTION_ENUM)
+#undef FAKE_FUNCTION_ENUM
+    FAKE_FN_COUNT
+};
+
+static const char* const FAKE_FUNCTION_NAMES[] = {
+#define FAKE_FUNCTION_NAME(fn) #fn,
+    FAKE_FUNCTIONS(FAKE_FUNCTION_NAME)
+#undef FAKE_FUNCTION_NAME
+};
+
+struct FakeAttribute {
+    CK_ATTRIBUTE_TYPE type;
+    uint8_t* value;
+    CK_ULONG length;
+};
+
+/**
+ * A token object, which is just its attributes. Key objects also keep the
+ * OpenSSL key built from them on first use. Destroying an object only
+ * unlinks it; it is freed once its last handle is closed.
+ */
+struct FakeObject {
+    FakeAttribute attributes[FAKE_MAX_ATTRIBUTES];
+    size_t attributeCount;
+    RSA* rsa;
+    EC_KEY* ec;
+    size_t handles;
+    bool destroyed;
+};
+
+struct FakeHandle {
+    bool open;
+    uint16_t generation;
+    FakeObject* object;
+};
+
+enum FakeOperation {
+    FAKE_OP_NONE,
+    FAKE_OP_SIGN,
+    FAKE_OP_VERIFY,
+    FAKE_OP_ENCRYPT,
+    FAKE_OP_DECRYPT,
+};
+
+struct FakeSession {
+    bool open;
+    CK_SESSION_HANDLE primary;      // itself for a primary session
+
+    FakeObject* findTemplate;       // non-NULL while a search is active
+    size_t findNext;
+
+    FakeOperation operation;
+    CK_MECHANISM_TYPE mechanism;
+    CK_OBJECT_HANDLE key;
+    CK_ULONG saltLength;
+    uint8_t iv[AES_BLOCK_BYTES];
+};
+
+static pthread_mutex_t sLock = PTHREAD_MUTEX_INITIALIZER;
+static bool sInitialized;
+static bool sEcSupported = true;
+static uint64_t sLatencyNs[FAKE_FN_COUNT];
+static uint64_t sCalls;
+
+static FakeObject* sObjects[FAKE_MAX_OBJECTS];
+static size_t sObjectsUsed;
+static FakeHandle sHandles[FAKE_MAX_HANDLES];
+static size_t sNextHandle;
+static FakeSession sSessions[FAKE_MAX_SESSIONS];
+
+/**
+ * Holds the token for one call, then keeps it busy for the call's latency.
+ * OpenSSL errors the call ran into are dropped, so the HAL doesn't log
+ * them as its own.
+ */
+class FakeCall {
+public:
+    FakeCall(FakeFunction fn) :
+            mFunction(fn) {
+        pthread_mutex_lock(&sLock);
+        sCalls++;
+    }
+
+    ~FakeCall() {
+        ERR_clear_error();
+        uint64_t ns = sLatencyNs[mFunction];
+        if (ns != 0) {
+            struct timespec ts = { static_cast<time_t>(ns / 1000000000), static_cast<long>(
+                    ns % 1000000000) };
+            while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+            }
+        }
+        pthread_mutex_unlock(&sLock);
+    }
+
+private:
+    FakeFunction mFunction;
+};
+
+#define FAKE_CALL(fn) FakeCall fakeCall(FAKE_FN_##fn)
+
+struct BIGNUM_Delete {
+    void operator()(BIGNUM* p) const {
+        BN_free(p);
+    }
+};
+typedef UniquePtr<BIGNUM, BIGNUM_Delete> Unique_BIGNUM;
+
+struct RSA_Delete {
+    void operator()(RSA* p) const {
+        RSA_free(p);
+    }
+};
+typedef UniquePtr<RSA, RSA_Delete> Unique_RSA;
+
+struct EC_KEY_Delete {
+    void operator()(EC_KEY* p) const {
+        EC_KEY_free(p);
+    }
+};
+typedef UniquePtr<EC_KEY, EC_KEY_Delete> Unique_EC_KEY;
+
+struct ECDSA_SIG_Delete {
+    void operator()(ECDSA_SIG* p) const {
+        ECDSA_SIG_free(p);
+    }
+};
+typedef UniquePtr<ECDSA_SIG, ECDSA_SIG_Delete> Unique_ECDSA_SIG;
+
+struct EVP_CIPHER_CTX_Delete {
+    void operator()(EVP_CIPHER_CTX* p) const {
+        EVP_CIPHER_CTX_free(p);
+    }
+};
+typedef UniquePtr<EVP_CIPHER_CTX, EVP_CIPHER_CTX_Delete> Unique_EVP_CIPHER_CTX;
+
+/*
+ * Objects
+ */
+
+static void object_free(FakeObject* object) {
+    for (size_t i = 0; i < object->attributeCount; i++) {
+        OPENSSL_cleanse(object->attributes[i].value, object->attributes[i].length);
+        free(object->attributes[i].value);
+    }
+    RSA_free(object->rsa);
+    EC_KEY_free(object->ec);
+    delete object;
+}
+
+struct FakeObject_Delete {
+    void operator()(FakeObject* p) const {
+        object_free(p);
+    }
+};
+typedef UniquePtr<FakeObject, FakeObject_Delete> Unique_FakeObject;
+
+static FakeObject* object_new() {
+    FakeObject* object = new FakeObject;
+    memset(object, 0, sizeof(*object));
+    return object;
+}
+
+static FakeAttribute* object_find(const FakeObject* object, CK_ATTRIBUTE_TYPE type) {
+    for (size_t i = 0; i < object->attributeCount; i++) {
+        if (object->attributes[i].type == type) {
+            return const_cast<FakeAttribute*>(&object->attributes[i]);
+        }
+    }
+    return NULL;
+}
+
+/** Sets an attribute, replacing any earlier value. */
+static CK_RV object_set(FakeObject* object, CK_ATTRIBUTE_TYPE type, const void* value,
+        CK_ULONG length) {
+    FakeAttribute* attribute = object_find(object, type);
+    if (attribute == NULL) {
+        if (object->attributeCount == FAKE_MAX_ATTRIBUTES) {
+            return CKR_TEMPLATE_INCONSISTENT;
+        }
+        attribute = &object->attributes[object->attributeCount++];
+        attribute->type = type;
+    } else {
+        OPENSSL_cleanse(attribute->value, attribute->length);
+        free(attribute->value);
+    }
+
+    attribute->value = static_cast<uint8_t*>(malloc(length > 0 ? length : 1));
+    attribute->length = attribute->value != NULL ? length : 0;
+    if (attribute->value == NULL) {
+        return CKR_DEVICE_MEMORY;
+    }
+    if (length > 0) {
+        memcpy(attribute->value, value, length);
+    }
+    return CKR_OK;
+}
+
+static CK_RV object_set_ulong(FakeObject* object, CK_ATTRIBUTE_TYPE type, CK_ULONG value) {
+    return object_set(object, type, &value, sizeof(value));
+}
+
+static CK_RV object_set_bignum(FakeObject* object, CK_ATTRIBUTE_TYPE type, const BIGNUM* bn) {
+    size_t length = BN_num_bytes(bn);
+    UniquePtr<uint8_t[]> value(new uint8_t[length > 0 ? length : 1]);
+    BN_bn2bin(bn, value.get());
+    CK_RV rv = object_set(object, type, value.get(), length);
+    OPENSSL_cleanse(value.get(), length);
+    return rv;
+}
+
+static CK_RV object_set_template(FakeObject* object, const CK_ATTRIBUTE* attributes,
+        CK_ULONG count) {
+    if (count != 0 && attributes == NULL) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    for (CK_ULONG i = 0; i < count; i++) {
+        CK_RV rv = object_set(object, attributes[i].type, attributes[i].pValue,
+                attributes[i].ulValueLen);
+        if (rv != CKR_OK) {
+            return rv;
+        }
+    }
+    return CKR_OK;
+}
+
+static bool object_ulong(const FakeObject* object, CK_ATTRIBUTE_TYPE type, CK_ULONG* value) {
+    FakeAttribute* attribute = object_find(object, type);
+    if (attribute == NULL || attribute->length != sizeof(CK_ULONG)) {
+        return false;
+    }
+    memcpy(value, attribute->value, sizeof(CK_ULONG));
+    return true;
+}
+
+static bool object_is(const FakeObject* object, CK_OBJECT_CLASS objClass, CK_KEY_TYPE keyType) {
+    CK_ULONG actualClass, actualType;
+    return object_ulong(object, CKA_CLASS, &actualClass) && actualClass == objClass
+            && object_ulong(object, CKA_KEY_TYPE, &actualType) && actualType == keyType;
+}
+
+static bool object_matches(const FakeObject* object, const FakeObject* pattern) {
+    for (size_t i = 0; i < pattern->attributeCount; i++) {
+        const FakeAttribute* wanted = &pattern->attributes[i];
+        const FakeAttribute* actual = object_find(object, wanted->type);
+        if (actual == NULL || actual->length != wanted->length
+                || memcmp(actual->value, wanted->value, wanted->length) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/** Whether an attribute may not be read back, as for any key material. */
+static bool object_sensitive(const FakeObject* object, CK_ATTRIBUTE_TYPE type) {
+    CK_ULONG objClass;
+    if (!object_ulong(object, CKA_CLASS, &objClass)
+            || (objClass != CKO_PRIVATE_KEY && objClass != CKO_SECRET_KEY)) {
+        return false;
+    }
+    switch (type) {
+    case CKA_VALUE:
+    case CKA_PRIVATE_EXPONENT:
+    case CKA_PRIME_1:
+    case CKA_PRIME_2:
+    case CKA_EXPONENT_1:
+    case CKA_EXPONENT_2:
+    case CKA_COEFFICIENT:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/** Writes bn big-endian into exactly length bytes. */
+static bool bignum_to_padded(const BIGNUM* bn, uint8_t* out, size_t length) {
+    size_t bnLength = BN_num_bytes(bn);
+    if (bnLength > length) {
+        return false;
+    }
+    memset(out, 0, length - bnLength);
+    BN_bn2bin(bn, out + length - bnLength);
+    return true;
+}
+
+static BIGNUM* object_bignum(const FakeObject* object, CK_ATTRIBUTE_TYPE type) {
+    FakeAttribute* attribute = object_find(object, type);
+    return attribute != NULL ? BN_bin2bn(attribute->value, attribute->length, NULL) : NULL;
+}
+
+/** The OpenSSL form of an RSA key object, built on first use. */
+static RSA* object_rsa(FakeObject* object) {
+    if (object->rsa != NULL) {
+        return object->rsa;
+    }
+
+    Unique_RSA rsa(RSA_new());
+    if (rsa.get() == NULL) {
+        return NULL;
+    }
+    rsa->n = object_bignum(object, CKA_MODULUS);
+    rsa->e = object_bignum(object, CKA_PUBLIC_EXPONENT);
+    if (rsa->n == NULL || rsa->e == NULL) {
+        return NULL;
+    }
+    rsa->d = object_bignum(object, CKA_PRIVATE_EXPONENT);
+    rsa->p = object_bignum(object, CKA_PRIME_1);
+    rsa->q = object_bignum(object, CKA_PRIME_2);
+    rsa->dmp1 = object_bignum(object, CKA_EXPONENT_1);
+    rsa->dmq1 = object_bignum(object, CKA_EXPONENT_2);
+    rsa->iqmp = object_bignum(object, CKA_COEFFICIENT);
+
+    object->rsa = rsa.release();
+    return object->rsa;
+}
+
+/** The OpenSSL form of a P-256 key object, built on first use. */
+static EC_KEY* object_ec(FakeObject* object) {
+    if (object->ec != NULL) {
+        return object->ec;
+    }
+
+    Unique_EC_KEY key(EC_KEY_new_by_curve_name(NID_X9_62_prime256v1));
+    if (key.get() == NULL) {
+        return NULL;
+    }
+    const EC_GROUP* group = EC_KEY_get0_group(key.get());
+
+    Unique_BIGNUM value(object_bignum(object, CKA_VALUE));
+    if (value.get() != NULL && EC_KEY_set_private_key(key.get(), value.get()) != 1) {
+        return NULL;
+    }
+
+    FakeAttribute* point = object_find(object, CKA_EC_POINT);
+    if (point != NULL) {
+        const uint8_t* octets = point->value;
+        size_t length = point->length;
+        if (length == EC_POINT_LENGTH + 2 && octets[0] == 0x04 && octets[1] == EC_POINT_LENGTH) {
+            octets += 2;
+            length -= 2;
+        }
+        EC_POINT* publicPoint = EC_POINT_new(group);
+        bool ok = publicPoint != NULL
+                && EC_POINT_oct2point(group, publicPoint, octets, length, NULL) == 1
+                && EC_KEY_set_public_key(key.get(), publicPoint) == 1;
+        EC_POINT_free(publicPoint);
+        if (!ok) {
+            return NULL;
+        }
+    } else if (value.get() == NULL) {
+        return NULL;
+    }
+
+    object->ec = key.release();
+    return object->ec;
+}
+
+/** Checks a key template names P-256 and that the token has it. */
+static CK_RV check_ec_params(const FakeObject* object) {
+    if (!sEcSupported) {
+        return CKR_ATTRIBUTE_VALUE_INVALID;
+    }
+    FakeAttribute* params = object_find(object, CKA_EC_PARAMS);
+    if (params == NULL) {
+        return CKR_TEMPLATE_INCOMPLETE;
+    }
+    if (params->length != sizeof(P256_EC_PARAMS)
+            || memcmp(params->value, P256_EC_PARAMS, sizeof(P256_EC_PARAMS)) != 0) {
+        return CKR_ATTRIBUTE_VALUE_INVALID;
+    }
+    return CKR_OK;
+}
+
+/*
+ * Handles and sessions
+ */
+
+static FakeHandle* handle_get(CK_OBJECT_HANDLE handle) {
+    size_t index = (handle & 0xffff) - 1;
+    if (!sInitialized || index >= FAKE_MAX_HANDLES || !sHandles[index].open
+            || sHandles[index].generation != handle >> 16) {
+        return NULL;
+    }
+    return &sHandles[index];
+}
+
+/** The object a handle refers to, or NULL if it is closed or the object destroyed. */
+static FakeObject* handle_object(CK_OBJECT_HANDLE handle) {
+    FakeHandle* entry = handle_get(handle);
+    return entry != NULL && !entry->object->destroyed ? entry->object : NULL;
+}
+
+static CK_OBJECT_HANDLE handle_open(FakeObject* object) {
+    for (size_t i = 0; i < FAKE_MAX_HANDLES; i++) {
+        size_t index = (sNextHandle + i) % FAKE_MAX_HANDLES;
+        FakeHandle* entry = &sHandles[index];
+        if (entry->open) {
+            continue;
+        }
+        entry->open = true;
+        entry->object = object;
+        if (++entry->generation == 0) {
+            entry->generation = 1;
+        }
+        object->handles++;
+        sNextHandle = index + 1;
+        return (static_cast<CK_OBJECT_HANDLE>(entry->generation) << 16) | (index + 1);
+    }
+    return CK_INVALID_HANDLE;
+}
+
+static void handle_close(FakeHandle* entry) {
+    FakeObject* object = entry->object;
+    entry->open = false;
+    entry->object = NULL;
+    if (--object->handles == 0 && object->destroyed) {
+        object_free(object);
+    }
+}
+
+static void object_unlink(FakeObject* object) {
+    for (size_t i = 0; i < sObjectsUsed; i++) {
+        if (sObjects[i] == object) {
+            sObjects[i] = NULL;
+            break;
+        }
+    }
+    object->destroyed = true;
+    if (object->handles == 0) {
+        object_free(object);
+    }
+}
+
+/**
+ * Stores a new object and opens a handle to it. The token owns the object
+ * from then on, even if this fails.
+ */
+static CK_RV object_store(FakeObject* object, CK_OBJECT_HANDLE* handle) {
+    size_t slot = 0;
+    while (slot < sObjectsUsed && sObjects[slot] != NULL) {
+        slot++;
+    }
+    if (slot == FAKE_MAX_OBJECTS) {
+        object_free(object);
+        return CKR_DEVICE_MEMORY;
+    }
+    sObjects[slot] = object;
+    if (slot == sObjectsUsed) {
+        sObjectsUsed++;
+    }
+
+    *handle = handle_open(object);
+    if (*handle == CK_INVALID_HANDLE) {
+        object_unlink(object);
+        return CKR_DEVICE_MEMORY;
+    }
+    return CKR_OK;
+}
+
+/** Stores both halves of a new keypair, or neither. */
+static CK_RV object_store_pair(FakeObject* publicKey, FakeObject* privateKey,
+        CK_OBJECT_HANDLE* phPublicKey, CK_OBJECT_HANDLE* phPrivateKey) {
+    CK_RV rv = object_store(publicKey, phPublicKey);
+    if (rv != CKR_OK) {
+        object_free(privateKey);
+        return rv;
+    }
+    rv = object_store(privateKey, phPrivateKey);
+    if (rv != CKR_OK) {
+        FakeHandle* entry = handle_get(*phPublicKey);
+        object_unlink(publicKey);
+        handle_close(entry);
+        return rv;
+    }
+    return CKR_OK;
+}
+
+static FakeSession* session_get(CK_SESSION_HANDLE handle) {
+    if (!sInitialized || handle == CK_INVALID_HANDLE || handle > FAKE_MAX_SESSIONS
+            || !sSessions[handle - 1].open) {
+        return NULL;
+    }
+    return &sSessions[handle - 1];
+}
+
+static void session_end_find(FakeSession* session) {
+    if (session->findTemplate != NULL) {
+        object_free(session->findTemplate);
+        session->findTemplate = NULL;
+    }
+}
+
+static void session_close(FakeSession* session) {
+    session_end_find(session);
+    memset(session, 0, sizeof(*session));
+}
+
+/*
+ * Controls
+ */
+
+int fake_token_set_latency(const char* spec) {
+    uint64_t latencyNs[FAKE_FN_COUNT];
+    pthread_mutex_lock(&sLock);
+    memcpy(latencyNs, sLatencyNs, sizeof(latencyNs));
+    pthread_mutex_unlock(&sLock);
+
+    const char* entry = spec;
+    while (*entry != '\0') {
+        size_t length = strcspn(entry, ",");
+        const char* equals = static_cast<const char*>(memchr(entry, '=', length));
+        const char* number = equals != NULL ? equals + 1 : entry;
+        char* end;
+        if (!isdigit(*number)) {
+            return -1;
+        }
+        uint64_t ns = strtoull(number, &end, 10) * 1000;
+        if (end != entry + length) {
+            return -1;
+        }
+
+        if (equals == NULL) {
+            for (size_t fn = 0; fn < FAKE_FN_COUNT; fn++) {
+                latencyNs[fn] = ns;
+            }
+        } else {
+            size_t nameLength = equals - entry;
+            size_t fn = 0;
+            while (fn < FAKE_FN_COUNT && (strlen(FAKE_FUNCTION_NAMES[fn]) != nameLength
+                    || strncmp(FAKE_FUNCTION_NAMES[fn], entry, nameLength) != 0)) {
+                fn++;
+            }
+            if (fn == FAKE_FN_COUNT) {
+                return -1;
+            }
+            latencyNs[fn] = ns;
+        }
+
+        entry += length;
+        if (*entry == ',') {
+            entry++;
+        }
+    }
+
+    pthread_mutex_lock(&sLock);
+    memcpy(sLatencyNs, latencyNs, sizeof(sLatencyNs));
+    pthread_mutex_unlock(&sLock);
+    return 0;
+}
+
+void fake_token_set_ec_supported(bool supported) {
+    pthread_mutex_lock(&sLock);
+    sEcSupported = supported;
+    pthread_mutex_unlock(&sLock);
+}
+
+uint64_t fake_token_calls() {
+    pthread_mutex_lock(&sLock);
+    uint64_t calls = sCalls;
+    pthread_mutex_unlock(&sLock);
+    return calls;
+}
+
+size_t fake_token_open_handles() {
+    pthread_mutex_lock(&sLock);
+    size_t open = 0;
+    for (size_t i = 0; i < FAKE_MAX_HANDLES; i++) {
+        open += sHandles[i].open ? 1 : 0;
+    }
+    pthread_mutex_unlock(&sLock);
+    return open;
+}
+
+/*
+ * General purpose and sessions
+ */
+
+CK_RV C_Initialize(void* /* pInitArgs */) {
+    FAKE_CALL(C_Initialize);
+    if (sInitialized) {
+        return CKR_CRYPTOKI_ALREADY_INITIALIZED;
+    }
+    sInitialized = true;
+    return CKR_OK;
+}
+
+/** Closes every session and handle. Token objects stay for the next C_Initialize. */
+CK_RV C_Finalize(void* /* pReserved */) {
+    FAKE_CALL(C_Finalize);
+    if (!sInitialized) {
+        return CKR_CRYPTOKI_NOT_INITIALIZED;
+    }
+    for (size_t i = 0; i < FAKE_MAX_SESSIONS; i++) {
+        if (sSessions[i].open) {
+            session_close(&sSessions[i]);
+        }
+    }
+    for (size_t i = 0; i < FAKE_MAX_HANDLES; i++) {
+        if (sHandles[i].open) {
+            handle_close(&sHandles[i]);
+        }
+    }
+    sInitialized = false;
+    return CKR_OK;
+}
+
+CK_RV C_GetInfo(CK_INFO* pInfo) {
+    FAKE_CALL(C_GetInfo);
+    if (!sInitialized) {
+        return CKR_CRYPTOKI_NOT_INITIALIZED;
+    }
+    if (pInfo == NULL) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    memset(pInfo, 0, sizeof(*pInfo));
+    pInfo->cryptokiVersion.major = 2;
+    pInfo->cryptokiVersion.minor = 20;
+    strncpy(reinterpret_cast<char*>(pInfo->manufacturerID), "Android",
+            sizeof(pInfo->manufacturerID) - 1);
+    strncpy(reinterpret_cast<char*>(pInfo->libraryDescription), "Fake in-memory token",
+            sizeof(pInfo->libraryDescription) - 1);
+    pInfo->libraryVersion.major = 1;
+    return CKR_OK;
+}
+
+/**
+ * Opens a primary session, or with CKVF_OPEN_SUB_SESSION a subsession of
+ * the primary session passed in *phSession.
+ */
+CK_RV C_OpenSession(CK_SLOT_ID /* slotID */, CK_FLAGS flags, void* /* pApplication */,
+        CK_NOTIFY /* Notify */, CK_SESSION_HANDLE* phSession) {
+    FAKE_CALL(C_OpenSession);
+    if (!sInitialized) {
+        return CKR_CRYPTOKI_NOT_INITIALIZED;
+    }
+    if (phSession == NULL) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    CK_SESSION_HANDLE primary = CK_INVALID_HANDLE;
+    if (flags & CKVF_OPEN_SUB_SESSION) {
+        FakeSession* parent = session_get(*phSession);
+        if (parent == NULL || parent->primary != *phSession) {
+            return CKR_SESSION_HANDLE_INVALID;
+        }
+        primary = *phSession;
+    }
+
+    for (size_t i = 0; i < FAKE_MAX_SESSIONS; i++) {
+        if (!sSessions[i].open) {
+            CK_SESSION_HANDLE handle = i + 1;
+            memset(&sSessions[i], 0, sizeof(sSessions[i]));
+            sSessions[i].open = true;
+            sSessions[i].primary = primary != CK_INVALID_HANDLE ? primary : handle;
+            *phSession = handle;
+            return CKR_OK;
+        }
+    }
+    return CKR_SESSION_COUNT;
+}
+
+/** Closing a primary session closes its subsessions with it. */
+CK_RV C_CloseSession(CK_SESSION_HANDLE hSession) {
+    FAKE_CALL(C_CloseSession);
+    FakeSession* session = session_get(hSession);
+    if (session == NULL) {
+        return CKR_SESSION_HANDLE_INVALID;
+    }
+    if (session->primary == hSession) {
+        for (size_t i = 0; i < FAKE_MAX_SESSIONS; i++) {
+            if (sSessions[i].open && sSessions[i].primary == hSession) {
+                session_close(&sSessions[i]);
+            }
+        }
+    } else {
+        session_close(session);
+    }
+    return CKR_OK;
+}
+
+/*
+ * Objects
+ */
+
+CK_RV C_CreateObject(CK_SESSION_HANDLE hSession, const CK_ATTRIBUTE* pTemplate,
+        CK_ULONG ulCount, CK_OBJECT_HANDLE* phObject) {
+    FAKE_CALL(C_CreateObject);
+    if (session_get(hSession) == NULL) {
+        return CKR_SESSION_HANDLE_INVALID;
+    }
+    if (phObject == NULL) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    Unique_FakeObject object(object_new());
+    CK_RV rv = object_set_template(object.get(), pTemplate, ulCount);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    CK_ULONG objClass;
+    if (!object_ulong(object.get(), CKA_CLASS, &objClass)) {
+        return CKR_TEMPLATE_INCOMPLETE;
+    }
+    if (objClass == CKO_PUBLIC_KEY || objClass == CKO_PRIVATE_KEY) {
+        if (object_is(object.get(), objClass, CKK_EC)) {
+            rv = check_ec_params(object.get());
+            if (rv != CKR_OK) {
+                return rv;
+            }
+            if (object_ec(object.get()) == NULL) {
+                return CKR_ATTRIBUTE_VALUE_INVALID;
+            }
+        } else if (object_is(object.get(), objClass, CKK_RSA)) {
+            if (object_rsa(object.get()) == NULL
+                    || (objClass == CKO_PRIVATE_KEY && object.get()->rsa->d == NULL)) {
+                return CKR_TEMPLATE_INCOMPLETE;
+            }
+        } else {
+            return CKR_ATTRIBUTE_VALUE_INVALID;
+        }
+    }
+
+    return object_store(object.release(), phObject);
+}
+
+CK_RV C_CopyObject(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject,
+        const CK_ATTRIBUTE* pTemplate, CK_ULONG ulAttributeCount,
+        CK_OBJECT_HANDLE* phNewObject) {
+    FAKE_CALL(C_CopyObject);
+    if (session_get(hSession) == NULL) {
+        return CKR_SESSION_HANDLE_INVALID;
+    }
+    FakeObject* original = handle_object(hObject);
+    if (original == NULL) {
+        return CKR_OBJECT_HANDLE_INVALID;
+    }
+    if (phNewObject == NULL) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    Unique_FakeObject object(object_new());
+    for (size_t i = 0; i < original->attributeCount; i++) {
+        const FakeAttribute* attribute = &original->attributes[i];
+        CK_RV rv = object_set(object.get(), attribute->type, attribute->value,
+                attribute->length);
+        if (rv != CKR_OK) {
+            return rv;
+        }
+    }
+    CK_RV rv = object_set_template(object.get(), pTemplate, ulAttributeCount);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    return object_store(object.release(), phNewObject);
+}
+
+/** Removes the object from the token; the handle stays open until closed. */
+CK_RV C_DestroyObject(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject) {
+    FAKE_CALL(C_DestroyObject);
+    if (session_get(hSession) == NULL) {
+        return CKR_SESSION_HANDLE_INVALID;
+    }
+    FakeObject* object = handle_object(hObject);
+    if (object == NULL) {
+        return CKR_OBJECT_HANDLE_INVALID;
+    }
+    object_unlink(object);
+    return CKR_OK;
+}
+
+CK_RV C_CloseObjectHandle(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject) {
+    FAKE_CALL(C_CloseObjectHandle);
+    if (session_get(hSession) == NULL) {
+        return CKR_SESSION_HANDLE_INVALID;
+    }
+    FakeHandle* entry = handle_get(hObject);
+    if (entry == NULL) {
+        return CKR_OBJECT_HANDLE_INVALID;
+    }
+    handle_close(entry);
+    return CKR_OK;
+}
+
+CK_RV C_GetAttributeValue(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject,
+        CK_ATTRIBUTE* pTemplate, CK_ULONG ulCount) {
+    FAKE_CALL(C_GetAttributeValue);
+    if (session_get(hSession) == NULL) {
+        return CKR_SESSION_HANDLE_INVALID;
+    }
+    FakeObject* object = handle_object(hObject);
+    if (object == NULL) {
+        return CKR_OBJECT_HANDLE_INVALID;
+    }
+    if (ulCount != 0 && pTemplate == NULL) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    CK_RV rv = CKR_OK;
+    for (CK_ULONG i = 0; i < ulCount; i++) {
+        CK_ATTRIBUTE* wanted = &pTemplate[i];
+        const FakeAttribute* attribute = object_find(object, wanted->type);
+        if (attribute == NULL) {
+            wanted->ulValueLen = static_cast<CK_ULONG>(-1);
+            rv = CKR_ATTRIBUTE_TYPE_INVALID;
+        } else if (object_sensitive(object, wanted->type)) {
+            wanted->ulValueLen = static_cast<CK_ULONG>(-1);
+            rv = CKR_ATTRIBUTE_SENSITIVE;
+        } else if (wanted->pValue == NULL) {
+            wanted->ulValueLen = attribute->length;
+        } else if (wanted->ulValueLen < attribute->length) {
+            wanted->ulValueLen = static_cast<CK_ULONG>(-1);
+            rv = CKR_BUFFER_TOO_SMALL;
+        } else {
+            memcpy(wanted->pValue, attribute->value, attribute->length);
+            wanted->ulValueLen = attribute->length;
+        }
+    }
+    return rv;
+}
+
+CK_RV C_FindObjectsInit(CK_SESSION_HANDLE hSession, const CK_ATTRIBUTE* pTemplate,
+        CK_ULONG ulCount) {
+    FAKE_CALL(C_FindObjectsInit);
+    FakeSession* session = session_get(hSession);
+    if (session == NULL) {
+        return CKR_SESSION_HANDLE_INVALID;
+    }
+    if (session->findTemplate != NULL) {
+        return CKR_OPERATION_ACTIVE;
+    }
+
+    Unique_FakeObject pattern(object_new());
+    CK_RV rv = object_set_template(pattern.get(), pTemplate, ulCount);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    session->findTemplate = pattern.release();
+    session->findNext = 0;
+    return CKR_OK;
+}
+
+/** Every object found comes with a new handle, which the caller closes. */
+CK_RV C_FindObjects(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE* phObject,
+        CK_ULONG ulMaxObjectCount, CK_ULONG* pulObjectCount) {
+    FAKE_CALL(C_FindObjects);
+    FakeSession* session = session_get(hSession);
+    if (session == NULL) {
+        return CKR_SESSION_HANDLE_INVALID;
+    }
+    if (session->findTemplate == NULL) {
+        return CKR_OPERATION_NOT_INITIALIZED;
+    }
+    if (phObject == NULL || pulObjectCount == NULL) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    CK_ULONG found = 0;
+    while (found < ulMaxObjectCount && session->findNext < sObjectsUsed) {
+        FakeObject* object = sObjects[session->findNext++];
+        if (object == NULL || !object_matches(object, session->findTemplate)) {
+            continue;
+        }
+        CK_OBJECT_HANDLE handle = handle_open(object);
+        if (handle == CK_INVALID_HANDLE) {
+            session->findNext--;
+            break;
+        }
+        phObject[found++] = handle;
+    }
+    *pulObjectCount = found;
+    return CKR_OK;
+}
+
+CK_RV C_FindObjectsFinal(CK_SESSION_HANDLE hSession) {
+    FAKE_CALL(C_FindObjectsFinal);
+    FakeSession* session = session_get(hSession);
+    if (session == NULL) {
+        return CKR_SESSION_HANDLE_INVALID;
+    }
+    if (session->findTemplate == NULL) {
+        return CKR_OPERATION_NOT_INITIALIZED;
+    }
+    session_end_find(session);
+    return CKR_OK;
+}
+
+/*
+ * Key generation
+ */
+
+CK_RV C_GenerateKey(CK_SESSION_HANDLE hSession, const CK_MECHANISM* pMechanism,
+        const CK_ATTRIBUTE* pTemplate, CK_ULONG ulCount, CK_OBJECT_HANDLE* phKey) {
+    FAKE_CALL(C_GenerateKey);
+    if (session_get(hSession) == NULL) {
+        return CKR_SESSION_HANDLE_INVALID;
+    }
+    if (pMechanism == NULL || phKey == NULL) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    bool aes = pMechanism->mechanism == CKM_AES_KEY_GEN;
+    if (!aes && pMechanism->mechanism != CKM_GENERIC_SECRET_KEY_GEN) {
+        return CKR_MECHANISM_INVALID;
+    }
+
+    Unique_FakeObject key(object_new());
+    CK_RV rv = object_set_template(key.get(), pTemplate, ulCount);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    CK_ULONG length;
+    if (!object_ulong(key.get(), CKA_VALUE_LEN, &length)) {
+        return CKR_TEMPLATE_INCOMPLETE;
+    }
+    if (aes ? length != 16 && length != 24 && length != 32 : length == 0 || length > 64) {
+        return CKR_KEY_SIZE_RANGE;
+    }
+
+    uint8_t value[64];
+    if (RAND_bytes(value, length) != 1) {
+        return CKR_GENERAL_ERROR;
+    }
+    rv = object_set(key.get(), CKA_VALUE, value, length);
+    OPENSSL_cleanse(value, sizeof(value));
+    if (rv == CKR_OK) {
+        rv = object_set_ulong(key.get(), CKA_CLASS, CKO_SECRET_KEY);
+    }
+    if (rv == CKR_OK) {
+        rv = object_set_ulong(key.get(), CKA_KEY_TYPE, aes ? CKK_AES : CKK_GENERIC_SECRET);
+    }
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    return object_store(key.release(), phKey);
+}
+
+static CK_RV generate_rsa(FakeObject* publicKey, FakeObject* privateKey) {
+    CK_ULONG modulusBits;
+    if (!object_ulong(publicKey, CKA_MODULUS_BITS, &modulusBits)) {
+        return CKR_TEMPLATE_INCOMPLETE;
+    }
+    if (modulusBits < 512 || modulusBits > 4096) {
+        return CKR_KEY_SIZE_RANGE;
+    }
+
+    Unique_BIGNUM exponent(object_bignum(publicKey, CKA_PUBLIC_EXPONENT));
+    if (exponent.get() == NULL) {
+        exponent.reset(BN_new());
+        if (exponent.get() == NULL || BN_set_word(exponent.get(), RSA_F4) != 1) {
+            return CKR_DEVICE_MEMORY;
+        }
+    }
+
+    Unique_RSA rsa(RSA_new());
+    if (rsa.get() == NULL
+            || RSA_generate_key_ex(rsa.get(), modulusBits, exponent.get(), NULL) != 1) {
+        return CKR_GENERAL_ERROR;
+    }
+
+    CK_RV rv = CKR_OK;
+    FakeObject* both[] = { publicKey, privateKey };
+    for (size_t i = 0; i < 2 && rv == CKR_OK; i++) {
+        rv = object_set_ulong(both[i], CKA_KEY_TYPE, CKK_RSA);
+        if (rv == CKR_OK) {
+            rv = object_set_bignum(both[i], CKA_MODULUS, rsa->n);
+        }
+        if (rv == CKR_OK) {
+            rv = object_set_bignum(both[i], CKA_PUBLIC_EXPONENT, rsa->e);
+        }
+    }
+    const struct {
+        CK_ATTRIBUTE_TYPE type;
+        const BIGNUM* bn;
+    } privateParts[] = {
+        { CKA_PRIVATE_EXPONENT, rsa->d },
+        { CKA_PRIME_1, rsa->p },
+        { CKA_PRIME_2, rsa->q },
+        { CKA_EXPONENT_1, rsa->dmp1 },
+        { CKA_EXPONENT_2, rsa->dmq1 },
+        { CKA_COEFFICIENT, rsa->iqmp },
+    };
+    for (size_t i = 0; i < sizeof(privateParts) / sizeof(privateParts[0]) && rv == CKR_OK;
+            i++) {
+        rv = object_set_bignum(privateKey, privateParts[i].type, privateParts[i].bn);
+    }
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    privateKey->rsa = rsa.release();
+    return CKR_OK;
+}
+
+static CK_RV generate_ec(FakeObject* publicKey, FakeObject* privateKey) {
+    // A TEE without P-256 turns the mechanism down outright.
+    if (!sEcSupported) {
+        return CKR_MECHANISM_INVALID;
+    }
+    CK_RV rv = check_ec_params(publicKey);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    Unique_EC_KEY key(EC_KEY_new_by_curve_name(NID_X9_62_prime256v1));
+    if (key.get() == NULL || EC_KEY_generate_key(key.get()) != 1) {
+        return CKR_GENERAL_ERROR;
+    }
+
+    // CKA_EC_POINT is the DER OCTET STRING of the uncompressed point.
+    uint8_t point[EC_POINT_LENGTH + 2] = { 0x04, EC_POINT_LENGTH };
+    if (EC_POINT_point2oct(EC_KEY_get0_group(key.get()), EC_KEY_get0_public_key(key.get()),
+            POINT_CONVERSION_UNCOMPRESSED, point + 2, EC_POINT_LENGTH, NULL)
+            != EC_POINT_LENGTH) {
+        return CKR_GENERAL_ERROR;
+    }
+
+    uint8_t value[EC_FIELD_BYTES];
+    if (!bignum_to_padded(EC_KEY_get0_private_key(key.get()), value, sizeof(value))) {
+        return CKR_GENERAL_ERROR;
+    }
+
+    rv = object_set_ulong(publicKey, CKA_KEY_TYPE, CKK_EC);
+    if (rv == CKR_OK) {
+        rv = object_set(publicKey, CKA_EC_POINT, point, sizeof(point));
+    }
+    if (rv == CKR_OK) {
+        rv = object_set_ulong(privateKey, CKA_KEY_TYPE, CKK_EC);
+    }
+    if (rv == CKR_OK) {
+        rv = object_set(privateKey, CKA_EC_PARAMS, P256_EC_PARAMS, sizeof(P256_EC_PARAMS));
+    }
+    if (rv == CKR_OK) {
+        rv = object_set(privateKey, CKA_VALUE, value, sizeof(value));
+    }
+    OPENSSL_cleanse(value, sizeof(value));
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    privateKey->ec = key.release();
+    return CKR_OK;
+}
+
+CK_RV C_GenerateKeyPair(CK_SESSION_HANDLE hSession, const CK_MECHANISM* pMechanism,
+        const CK_ATTRIBUTE* pPublicKeyTemplate, CK_ULONG ulPublicKeyAttributeCount,
+        const CK_ATTRIBUTE* pPrivateKeyTemplate, CK_ULONG ulPrivateKeyAttributeCount,
+        CK_OBJECT_HANDLE* phPublicKey, CK_OBJECT_HANDLE* phPrivateKey) {
+    FAKE_CALL(C_GenerateKeyPair);
+    if (session_get(hSession) == NULL) {
+        return CKR_SESSION_HANDLE_INVALID;
+    }
+    if (pMechanism == NULL || phPublicKey == NULL || phPrivateKey == NULL) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    Unique_FakeObject publicKey(object_new());
+    Unique_FakeObject privateKey(object_new());
+    CK_RV rv = object_set_template(publicKey.get(), pPublicKeyTemplate,
+            ulPublicKeyAttributeCount);
+    if (rv == CKR_OK) {
+        rv = object_set_template(privateKey.get(), pPrivateKeyTemplate,
+                ulPrivateKeyAttributeCount);
+    }
+    if (rv == CKR_OK) {
+        rv = object_set_ulong(publicKey.get(), CKA_CLASS, CKO_PUBLIC_KEY);
+    }
+    if (rv == CKR_OK) {
+        rv = object_set_ulong(privateKey.get(), CKA_CLASS, CKO_PRIVATE_KEY);
+    }
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    switch (pMechanism->mechanism) {
+    case CKM_RSA_PKCS_KEY_PAIR_GEN:
+        rv = generate_rsa(publicKey.get(), privateKey.get());
+        break;
+    case CKM_EC_KEY_PAIR_GEN:
+        rv = generate_ec(publicKey.get(), privateKey.get());
+        break;
+    default:
+        rv = CKR_MECHANISM_INVALID;
+        break;
+    }
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    return object_store_pair(publicKey.release(), privateKey.release(), phPublicKey,
+            phPrivateKey);
+}
+
+/*
+ * Cryptographic operations
+ */
+
+/**
+ * Checks a mechanism and key for an operation and makes it the session's
+ * current one.
+ */
+static CK_RV operation_init(CK_SESSION_HANDLE hSession, FakeOperation operation,
+        const CK_MECHANISM* pMechanism, CK_OBJECT_HANDLE hKey) {
+    FakeSession* session = session_get(hSession);
+    if (session == NULL) {
+        return CKR_SESSION_HANDLE_INVALID;
+    }
+    if (session->operation != FAKE_OP_NONE) {
+        return CKR_OPERATION_ACTIVE;
+    }
+    if (pMechanism == NULL) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    FakeObject* key = handle_object(hKey);
+    if (key == NULL) {
+        return CKR_KEY_HANDLE_INVALID;
+    }
+
+    bool signing = operation == FAKE_OP_SIGN || operation == FAKE_OP_VERIFY;
+    CK_OBJECT_CLASS keyClass = operation == FAKE_OP_SIGN ? CKO_PRIVATE_KEY
+            : operation == FAKE_OP_VERIFY ? CKO_PUBLIC_KEY : CKO_SECRET_KEY;
+    CK_ULONG saltLength = 0;
+
+    switch (pMechanism->mechanism) {
+    case CKM_RSA_X_509:
+    case CKM_RSA_PKCS:
+        if (!signing || !object_is(key, keyClass, CKK_RSA)) {
+            return CKR_KEY_TYPE_INCONSISTENT;
+        }
+        break;
+    case CKM_RSA_PKCS_PSS: {
+        if (!signing || !object_is(key, keyClass, CKK_RSA)) {
+            return CKR_KEY_TYPE_INCONSISTENT;
+        }
+        const CK_RSA_PKCS_PSS_PARAMS* params =
+                static_cast<const CK_RSA_PKCS_PSS_PARAMS*>(pMechanism->pParameter);
+        if (params == NULL || pMechanism->ulParameterLen != sizeof(*params)
+                || params->hashAlg != CKM_SHA256 || params->mgf != CKG_MGF1_SHA256) {
+            return CKR_MECHANISM_PARAM_INVALID;
+        }
+        saltLength = params->sLen;
+        break;
+    }
+    case CKM_ECDSA:
+        if (!signing || !object_is(key, keyClass, CKK_EC)) {
+            return CKR_KEY_TYPE_INCONSISTENT;
+        }
+        break;
+    case CKM_AES_CBC:
+        if (signing || !object_is(key, keyClass, CKK_AES)) {
+            return CKR_KEY_TYPE_INCONSISTENT;
+        }
+        if (pMechanism->pParameter == NULL || pMechanism->ulParameterLen != AES_BLOCK_BYTES) {
+            return CKR_MECHANISM_PARAM_INVALID;
+        }
+        memcpy(session->iv, pMechanism->pParameter, AES_BLOCK_BYTES);
+        break;
+    case CKM_SHA256_HMAC:
+        if (!signing || !object_is(key, CKO_SECRET_KEY, CKK_GENERIC_SECRET)
+                || object_find(key, CKA_VALUE) == NULL) {
+            return CKR_KEY_TYPE_INCONSISTENT;
+        }
+        break;
+    default:
+        return CKR_MECHANISM_INVALID;
+    }
+
+    // Build the OpenSSL key now, so the operation itself can rely on it.
+    if (pMechanism->mechanism == CKM_ECDSA) {
+        if (object_ec(key) == NULL) {
+            return CKR_KEY_HANDLE_INVALID;
+        }
+    } else if (signing && pMechanism->mechanism != CKM_SHA256_HMAC && object_rsa(key) == NULL) {
+        return CKR_KEY_HANDLE_INVALID;
+    }
+
+    session->operation = operation;
+    session->mechanism = pMechanism->mechanism;
+    session->key = hKey;
+    session->saltLength = saltLength;
+    return CKR_OK;
+}
+
+/** Looks up the session's current operation and its key. */
+static CK_RV operation_current(CK_SESSION_HANDLE hSession, FakeOperation operation,
+        FakeSession** pSession, FakeObject** pKey) {
+    FakeSession* session = session_get(hSession);
+    if (session == NULL) {
+        return CKR_SESSION_HANDLE_INVALID;
+    }
+    if (session->operation != operation) {
+        return CKR_OPERATION_NOT_INITIALIZED;
+    }
+
+    FakeObject* key = handle_object(session->key);
+    if (key == NULL) {
+        session->operation = FAKE_OP_NONE;
+        return CKR_KEY_HANDLE_INVALID;
+    }
+
+    *pSession = session;
+    *pKey = key;
+    return CKR_OK;
+}
+
+static CK_ULONG output_length(const FakeSession* session, const FakeObject* key,
+        CK_ULONG inputLength) {
+    switch (session->mechanism) {
+    case CKM_AES_CBC:
+        return inputLength;
+    case CKM_ECDSA:
+        return 2 * EC_FIELD_BYTES;
+    case CKM_SHA256_HMAC:
+        return SHA256_DIGEST_LENGTH;
+    default:
+        return RSA_size(key->rsa);
+    }
+}
+
+/**
+ * Hands back the length of an operation's output. Without a buffer the
+ * caller is only asking, and with one too small it may try again; either
+ * way the operation goes on. Otherwise it ends with this call.
+ */
+static CK_RV operation_output(FakeSession* session, CK_ULONG length, const CK_BYTE* output,
+        CK_ULONG* outputLength) {
+    CK_ULONG capacity = *outputLength;
+    *outputLength = length;
+    if (output == NULL) {
+        return CKR_OK;
+    }
+    if (capacity < length) {
+        return CKR_BUFFER_TOO_SMALL;
+    }
+    session->operation = FAKE_OP_NONE;
+    return CKR_OK;
+}
+
+/** HMAC-SHA256 of data under a generic secret key, into SHA256_DIGEST_LENGTH bytes of mac. */
+static bool hmac_sha256(FakeObject* key, const CK_BYTE* data, CK_ULONG dataLength, CK_BYTE* mac) {
+    const FakeAttribute* value = object_find(key, CKA_VALUE);
+    unsigned int macLength = 0;
+    return HMAC(EVP_sha256(), value->value, value->length, data, dataLength, mac, &macLength)
+            != NULL && macLength == SHA256_DIGEST_LENGTH;
+}
+
+CK_RV C_SignInit(CK_SESSION_HANDLE hSession, const CK_MECHANISM* pMechanism,
+        CK_OBJECT_HANDLE hKey) {
+    FAKE_CALL(C_SignInit);
+    return operation_init(hSession, FAKE_OP_SIGN, pMechanism, hKey);
+}
+
+CK_RV C_Sign(CK_SESSION_HANDLE hSession, const CK_BYTE* pData, CK_ULONG ulDataLen,
+        CK_BYTE* pSignature, CK_ULONG* pulSignatureLen) {
+    FAKE_CALL(C_Sign);
+    if (pData == NULL || pulSignatureLen == NULL) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    FakeSession* session;
+    FakeObject* key;
+    CK_RV rv = operation_current(hSession, FAKE_OP_SIGN, &session, &key);
+    if (rv == CKR_OK) {
+        rv = operation_output(session, output_length(session, key, ulDataLen), pSignature,
+                pulSignatureLen);
+    }
+    if (rv != CKR_OK || pSignature == NULL) {
+        return rv;
+    }
+
+    if (session->mechanism == CKM_SHA256_HMAC) {
+        return hmac_sha256(key, pData, ulDataLen, pSignature) ? CKR_OK : CKR_GENERAL_ERROR;
+    }
+
+    if (session->mechanism == CKM_ECDSA) {
+        Unique_ECDSA_SIG sig(ECDSA_do_sign(pData, ulDataLen, key->ec));
+        if (sig.get() == NULL || !bignum_to_padded(sig->r, pSignature, EC_FIELD_BYTES)
+                || !bignum_to_padded(sig->s, pSignature + EC_FIELD_BYTES, EC_FIELD_BYTES)) {
+            return CKR_GENERAL_ERROR;
+        }
+        return CKR_OK;
+    }
+
+    RSA* rsa = key->rsa;
+    size_t modulusLength = RSA_size(rsa);
+    UniquePtr<uint8_t[]> block(new uint8_t[modulusLength]);
+    int padding = RSA_NO_PADDING;
+    const uint8_t* input = block.get();
+    CK_ULONG inputLength = modulusLength;
+
+    switch (session->mechanism) {
+    case CKM_RSA_X_509:
+        // Shorter input is taken as left-padded with zeros.
+        if (ulDataLen > modulusLength) {
+            return CKR_DATA_LEN_RANGE;
+        }
+        memset(block.get(), 0, modulusLength - ulDataLen);
+        memcpy(block.get() + modulusLength - ulDataLen, pData, ulDataLen);
+        break;
+    case CKM_RSA_PKCS:
+        if (ulDataLen > modulusLength - 11) {
+            return CKR_DATA_LEN_RANGE;
+        }
+        padding = RSA_PKCS1_PADDING;
+        input = pData;
+        inputLength = ulDataLen;
+        break;
+    case CKM_RSA_PKCS_PSS:
+        if (ulDataLen != SHA256_DIGEST_LENGTH) {
+            return CKR_DATA_LEN_RANGE;
+        }
+        if (RSA_padding_add_PKCS1_PSS(rsa, block.get(), pData, EVP_sha256(),
+                session->saltLength) != 1) {
+            return CKR_GENERAL_ERROR;
+        }
+        break;
+    }
+
+    if (RSA_private_encrypt(inputLength, input, pSignature, rsa, padding)
+            != static_cast<int>(modulusLength)) {
+        return CKR_DATA_INVALID;
+    }
+    return CKR_OK;
+}
+
+CK_RV C_VerifyInit(CK_SESSION_HANDLE hSession, const CK_MECHANISM* pMechanism,
+        CK_OBJECT_HANDLE hKey) {
+    FAKE_CALL(C_VerifyInit);
+    return operation_init(hSession, FAKE_OP_VERIFY, pMechanism, hKey);
+}
+
+CK_RV C_Verify(CK_SESSION_HANDLE hSession, const CK_BYTE* pData, CK_ULONG ulDataLen,
+        CK_BYTE* pSignature, CK_ULONG ulSignatureLen) {
+    FAKE_CALL(C_Verify);
+    if (pData == NULL || pSignature == NULL) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    FakeSession* session;
+    FakeObject* key;
+    CK_RV rv = operation_current(hSession, FAKE_OP_VERIFY, &session, &key);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    session->operation = FAKE_OP_NONE;
+
+    if (session->mechanism == CKM_SHA256_HMAC) {
+        if (ulSignatureLen != SHA256_DIGEST_LENGTH) {
+            return CKR_SIGNATURE_LEN_RANGE;
+        }
+        uint8_t mac[SHA256_DIGEST_LENGTH];
+        if (!hmac_sha256(key, pData, ulDataLen, mac)) {
+            return CKR_GENERAL_ERROR;
+        }
+        return CRYPTO_memcmp(mac, pSignature, sizeof(mac)) == 0 ? CKR_OK : CKR_SIGNATURE_INVALID;
+    }
+
+    if (session->mechanism == CKM_ECDSA) {
+        if (ulSignatureLen != 2 * EC_FIELD_BYTES) {
+            return CKR_SIGNATURE_LEN_RANGE;
+        }
+        Unique_ECDSA_SIG sig(ECDSA_SIG_new());
+        if (sig.get() == NULL || BN_bin2bn(pSignature, EC_FIELD_BYTES, sig->r) == NULL
+                || BN_bin2bn(pSignature + EC_FIELD_BYTES, EC_FIELD_BYTES, sig->s) == NULL) {
+            return CKR_DEVICE_MEMORY;
+        }
+        return ECDSA_do_verify(pData, ulDataLen, sig.get(), key->ec) == 1
+                ? CKR_OK : CKR_SIGNATURE_INVALID;
+    }
+
+    RSA* rsa = key->rsa;
+    size_t modulusLength = RSA_size(rsa);
+    if (ulSignatureLen != modulusLength) {
+        return CKR_SIGNATURE_LEN_RANGE;
+    }
+
+    UniquePtr<uint8_t[]> recovered(new uint8_t[modulusLength]);
+    int padding = session->mechanism == CKM_RSA_PKCS ? RSA_PKCS1_PADDING : RSA_NO_PADDING;
+    int recoveredLength = RSA_public_decrypt(ulSignatureLen, pSignature, recovered.get(), rsa,
+            padding);
+    if (recoveredLength < 0) {
+        return CKR_SIGNATURE_INVALID;
+    }
+
+    switch (session->mechanism) {
+    case CKM_RSA_X_509: {
+        if (ulDataLen > modulusLength) {
+            return CKR_DATA_LEN_RANGE;
+        }
+        size_t zeros = modulusLength - ulDataLen;
+        for (size_t i = 0; i < zeros; i++) {
+            if (recovered[i] != 0) {
+                return CKR_SIGNATURE_INVALID;
+            }
+        }
+        return memcmp(recovered.get() + zeros, pData, ulDataLen) == 0
+                ? CKR_OK : CKR_SIGNATURE_INVALID;
+    }
+    case CKM_RSA_PKCS:
+        return static_cast<CK_ULONG>(recoveredLength) == ulDataLen
+                && memcmp(recovered.get(), pData, ulDataLen) == 0
+                ? CKR_OK : CKR_SIGNATURE_INVALID;
+    case CKM_RSA_PKCS_PSS:
+        if (ulDataLen != SHA256_DIGEST_LENGTH) {
+            return CKR_DATA_LEN_RANGE;
+        }
+        return RSA_verify_PKCS1_PSS(rsa, pData, EVP_sha256(), recovered.get(),
+                session->saltLength) == 1 ? CKR_OK : CKR_SIGNATURE_INVALID;
+    }
+    return CKR_GENERAL_ERROR;
+}
+
+/** AES-CBC without padding, as the TEE does it: input must be whole blocks. */
+static CK_RV aes_cbc(const FakeSession* session, FakeObject* key, bool encrypt,
+        const CK_BYTE* input, CK_ULONG inputLength, CK_BYTE* output) {
+    const FakeAttribute* value = object_find(key, CKA_VALUE);
+    const EVP_CIPHER* cipher = value == NULL ? NULL
+            : value->length == 16 ? EVP_aes_128_cbc()
+            : value->length == 24 ? EVP_aes_192_cbc()
+            : value->length == 32 ? EVP_aes_256_cbc() : NULL;
+    if (cipher == NULL) {
+        return CKR_KEY_HANDLE_INVALID;
+    }
+
+    Unique_EVP_CIPHER_CTX ctx(EVP_CIPHER_CTX_new());
+    int outLength = 0;
+    int finalLength = 0;
+    if (ctx.get() == NULL
+            || EVP_CipherInit_ex(ctx.get(), cipher, NULL, value->value, session->iv,
+                    encrypt ? 1 : 0) != 1
+            || EVP_CIPHER_CTX_set_padding(ctx.get(), 0) != 1
+            || EVP_CipherUpdate(ctx.get(), output, &outLength, input, inputLength) != 1
+            || EVP_CipherFinal_ex(ctx.get(), output + outLength, &finalLength) != 1
+            || static_cast<CK_ULONG>(outLength + finalLength) != inputLength) {
+        return CKR_GENERAL_ERROR;
+    }
+    return CKR_OK;
+}
+
+CK_RV C_EncryptInit(CK_SESSION_HANDLE hSession, const CK_MECHANISM* pMechanism,
+        CK_OBJECT_HANDLE hKey) {
+    FAKE_CALL(C_EncryptInit);
+    return operation_init(hSession, FAKE_OP_ENCRYPT, pMechanism, hKey);
+}
+
+CK_RV C_Encrypt(CK_SESSION_HANDLE hSession, const CK_BYTE* pData, CK_ULONG ulDataLen,
+        CK_BYTE* pEncryptedData, CK_ULONG* pulEncryptedDataLen) {
+    FAKE_CALL(C_Encrypt);
+    if (pData == NULL || pulEncryptedDataLen == NULL) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    FakeSession* session;
+    FakeObject* key;
+    CK_RV rv = operation_current(hSession, FAKE_OP_ENCRYPT, &session, &key);
+    if (rv == CKR_OK) {
+        rv = operation_output(session, ulDataLen, pEncryptedData, pulEncryptedDataLen);
+    }
+    if (rv != CKR_OK || pEncryptedData == NULL) {
+        return rv;
+    }
+    if (ulDataLen % AES_BLOCK_BYTES != 0) {
+        return CKR_DATA_LEN_RANGE;
+    }
+    return aes_cbc(session, key, true, pData, ulDataLen, pEncryptedData);
+}
+
+CK_RV C_DecryptInit(CK_SESSION_HANDLE hSession, const CK_MECHANISM* pMechanism,
+        CK_OBJECT_HANDLE hKey) {
+    FAKE_CALL(C_DecryptInit);
+    return operation_init(hSession, FAKE_OP_DECRYPT, pMechanism, hKey);
+}
+
+CK_RV C_Decrypt(CK_SESSION_HANDLE hSession, const CK_BYTE* pEncryptedData,
+        CK_ULONG ulEncryptedDataLen, CK_BYTE* pData, CK_ULONG* pulDataLen) {
+    FAKE_CALL(C_Decrypt);
+    if (pEncryptedData == NULL || pulDataLen == NULL) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    FakeSession* session;
+    FakeObject* key;
+    CK_RV rv = operation_current(hSession, FAKE_OP_DECRYPT, &session, &key);
+    if (rv == CKR_OK) {
+        rv = operation_output(session, ulEncryptedDataLen, pData, pulDataLen);
+    }
+    if (rv != CKR_OK || pData == NULL) {
+        return rv;
+    }
+    if (ulEncryptedDataLen % AES_BLOCK_BYTES != 0) {
+        return CKR_ENCRYPTED_DATA_LEN_RANGE;
+    }
+    return aes_cbc(session, key, false, pEncryptedData, ulEncryptedDataLen, pData);
+}
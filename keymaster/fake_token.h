@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FAKE_TOKEN_H
+#define FAKE_TOKEN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Controls for the in-memory PKCS#11 token in fake_token.cpp, which stands
+ * in for the TEE when keymaster_grouper.cpp is built for the host.
+ */
+
+/**
+ * Sets how long calls take, from a comma-separated list of entries that
+ * are either a number of microseconds for every call or "C_Name=us" for
+ * one function, e.g. "150,C_GenerateKeyPair=900000". Later entries win.
+ * Returns 0, or -1 if spec doesn't parse.
+ */
+int fake_token_set_latency(const char* spec);
+
+/** Whether the token has P-256 keys; without them it behaves as a TEE lacking them. */
+void fake_token_set_ec_supported(bool supported);
+
+/** PKCS#11 calls made so far, of all functions. */
+uint64_t fake_token_calls();
+
+/** Object handles currently open, across all sessions. */
+size_t fake_token_open_handles();
+
+#endif // FAKE_TOKEN_H
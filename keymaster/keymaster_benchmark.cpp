@@ -0,0 +1,347 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host benchmark for keystore.grouper on top of the fake token in
+ * fake_token.cpp. It opens the HAL as keystore does and runs each
+ * keymaster0 operation a number of times, reporting for each the rate, the
+ * mean time and the PKCS#11 calls made per operation. The HAL's own
+ * latency histograms and per-operation call counts follow.
+ *
+ * Every signature made is verified and every call has to succeed, so a
+ * broken path fails the run instead of looking fast.
+ *
+ * usage: keymaster_grouper_benchmark [-n iterations] [-g keygens] [-l latency] [-w]
+ *   -n  iterations of each fast operation (default 200)
+ *   -g  RSA keys generated (default 10)
+ *   -l  token latencies, as fake_token_set_latency() takes them
+ *   -w  token without P-256 keys, so EC keys are software-wrapped
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <hardware/hardware.h>
+#include <hardware/keymaster0.h>
+#include <hardware/keymaster_defs.h>
+
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/objects.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+
+#include "fake_token.h"
+
+extern struct keystore_module HAL_MODULE_INFO_SYM;
+extern "C" void keymaster_grouper_dump(const keymaster0_device_t* dev, int fd);
+
+struct KeyBlob {
+    uint8_t* data;
+    size_t length;
+};
+
+static uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+/** Times a run of one operation and counts the token calls it makes. */
+class Phase {
+public:
+    Phase(const char* name) :
+            mName(name), mCalls(fake_token_calls()), mStart(monotonic_ns()) {
+    }
+
+    void report(size_t operations) const {
+        uint64_t ns = monotonic_ns() - mStart;
+        uint64_t calls = fake_token_calls() - mCalls;
+        if (operations == 0) {
+            return;
+        }
+        printf("  %-20s %6zu ops %10.1f ops/s mean %8llu us %6.2f calls/op\n", mName,
+                operations, ns != 0 ? operations * 1e9 / ns : 0.0,
+                (unsigned long long) (ns / operations / 1000),
+                static_cast<double>(calls) / operations);
+    }
+
+private:
+    const char* mName;
+    uint64_t mCalls;
+    uint64_t mStart;
+};
+
+static void check(int result, const char* what, size_t i) {
+    if (result != 0) {
+        fprintf(stderr, "%s failed at iteration %zu\n", what, i);
+        exit(1);
+    }
+}
+
+/** A PKCS#8 PrivateKeyInfo for import, freshly generated. */
+static bool make_pkcs8(bool ec, uint8_t** der, size_t* derLength) {
+    EVP_PKEY* pkey = EVP_PKEY_new();
+    bool ok = pkey != NULL;
+    if (ok && ec) {
+        EC_KEY* key = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+        ok = key != NULL && EC_KEY_generate_key(key) == 1 && EVP_PKEY_assign_EC_KEY(pkey, key);
+        if (!ok) {
+            EC_KEY_free(key);
+        }
+    } else if (ok) {
+        RSA* rsa = RSA_new();
+        BIGNUM* e = BN_new();
+        ok = rsa != NULL && e != NULL && BN_set_word(e, RSA_F4) == 1
+                && RSA_generate_key_ex(rsa, 2048, e, NULL) == 1
+                && EVP_PKEY_assign_RSA(pkey, rsa);
+        BN_free(e);
+        if (!ok) {
+            RSA_free(rsa);
+        }
+    }
+
+    PKCS8_PRIV_KEY_INFO* pkcs8 = ok ? EVP_PKEY2PKCS8(pkey) : NULL;
+    int length = pkcs8 != NULL ? i2d_PKCS8_PRIV_KEY_INFO(pkcs8, NULL) : -1;
+    ok = length > 0;
+    if (ok) {
+        *der = static_cast<uint8_t*>(malloc(length));
+        uint8_t* p = *der;
+        ok = *der != NULL && i2d_PKCS8_PRIV_KEY_INFO(pkcs8, &p) == length;
+        *derLength = length;
+    }
+    PKCS8_PRIV_KEY_INFO_free(pkcs8);
+    EVP_PKEY_free(pkey);
+    return ok;
+}
+
+static void usage(const char* name) {
+    fprintf(stderr, "usage: %s [-n iterations] [-g keygens] [-l latency] [-w]\n", name);
+    exit(2);
+}
+
+int main(int argc, char** argv) {
+    size_t iterations = 200;
+    size_t keygens = 10;
+    bool wrapped = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:g:l:w")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = strtoul(optarg, NULL, 10);
+            break;
+        case 'g':
+            keygens = strtoul(optarg, NULL, 10);
+            break;
+        case 'l':
+            if (fake_token_set_latency(optarg)) {
+                fprintf(stderr, "bad latency list: %s\n", optarg);
+                usage(argv[0]);
+            }
+            break;
+        case 'w':
+            fake_token_set_ec_supported(false);
+            wrapped = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (iterations == 0 || keygens == 0) {
+        usage(argv[0]);
+    }
+
+    uint8_t* rsaPkcs8;
+    size_t rsaPkcs8Length;
+    uint8_t* ecPkcs8;
+    size_t ecPkcs8Length;
+    if (!make_pkcs8(false, &rsaPkcs8, &rsaPkcs8Length)
+            || !make_pkcs8(true, &ecPkcs8, &ecPkcs8Length)) {
+        fprintf(stderr, "couldn't make keys to import\n");
+        return 1;
+    }
+
+    const hw_module_t* module = &HAL_MODULE_INFO_SYM.common;
+    hw_device_t* device;
+    int rc = module->methods->open(module, KEYSTORE_KEYMASTER, &device);
+    if (rc != 0) {
+        fprintf(stderr, "couldn't open %s: %d\n", module->name, rc);
+        return 1;
+    }
+    keymaster0_device_t* dev = reinterpret_cast<keymaster0_device_t*>(device);
+
+    // EC keys are only hardware-backed, and may only be claimed so, in the token.
+    if (((dev->flags & KEYMASTER_SUPPORTS_EC) != 0) == wrapped) {
+        fprintf(stderr, "device %s KEYMASTER_SUPPORTS_EC\n", wrapped ? "claims" : "lacks");
+        return 1;
+    }
+
+    // Every key made is deleted at the end.
+    size_t blobCapacity = keygens + 3 * iterations;
+    KeyBlob* blobs = static_cast<KeyBlob*>(calloc(blobCapacity, sizeof(KeyBlob)));
+    size_t blobCount = 0;
+    if (blobs == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    printf("%zu iterations, %zu RSA keygens, EC keys %s\n", iterations, keygens,
+            wrapped ? "software-wrapped" : "in the token");
+
+    keymaster_rsa_keygen_params_t rsaParams;
+    rsaParams.modulus_size = 2048;
+    rsaParams.public_exponent = RSA_F4;
+    Phase generateRsa("generate_rsa2048");
+    for (size_t i = 0; i < keygens; i++) {
+        KeyBlob* blob = &blobs[blobCount++];
+        check(dev->generate_keypair(dev, TYPE_RSA, &rsaParams, &blob->data, &blob->length),
+                "generate RSA", i);
+    }
+    generateRsa.report(keygens);
+
+    keymaster_ec_keygen_params_t ecParams;
+    ecParams.field_size = 256;
+    Phase generateEc("generate_ec");
+    for (size_t i = 0; i < iterations; i++) {
+        KeyBlob* blob = &blobs[blobCount++];
+        check(dev->generate_keypair(dev, TYPE_EC, &ecParams, &blob->data, &blob->length),
+                "generate EC", i);
+    }
+    generateEc.report(iterations);
+    const KeyBlob* ecKey = &blobs[keygens];
+
+    Phase importRsa("import_rsa2048");
+    for (size_t i = 0; i < iterations; i++) {
+        KeyBlob* blob = &blobs[blobCount++];
+        check(dev->import_keypair(dev, rsaPkcs8, rsaPkcs8Length, &blob->data, &blob->length),
+                "import RSA", i);
+    }
+    importRsa.report(iterations);
+    const KeyBlob* importedRsa = &blobs[keygens + iterations];
+
+    Phase importEc("import_ec");
+    for (size_t i = 0; i < iterations; i++) {
+        KeyBlob* blob = &blobs[blobCount++];
+        check(dev->import_keypair(dev, ecPkcs8, ecPkcs8Length, &blob->data, &blob->length),
+                "import EC", i);
+    }
+    importEc.report(iterations);
+
+    Phase getPublic("get_public");
+    for (size_t i = 0; i < iterations; i++) {
+        const KeyBlob* blob = &blobs[i % blobCount];
+        uint8_t* x509;
+        size_t x509Length;
+        check(dev->get_keypair_public(dev, blob->data, blob->length, &x509, &x509Length),
+                "get public key", i);
+        free(x509);
+    }
+    getPublic.report(iterations);
+
+    // Raw RSA takes a block below the modulus; a leading zero keeps it there.
+    uint8_t data[256];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = i;
+    }
+
+    const struct {
+        const char* name;
+        const KeyBlob* key;
+        int digest;
+        int padding;
+    } signings[] = {
+        { "sign_rsa_raw", &blobs[0], KM_DIGEST_NONE, PADDING_NONE },
+        { "sign_rsa_pkcs1", &blobs[0], KM_DIGEST_SHA_2_256, KM_PAD_RSA_PKCS1_1_5_SIGN },
+        { "sign_rsa_pss", importedRsa, KM_DIGEST_SHA_2_256, KM_PAD_RSA_PSS },
+        { "sign_ec", ecKey, KM_DIGEST_SHA_2_256, 0 },
+    };
+
+    for (size_t s = 0; s < sizeof(signings) / sizeof(signings[0]); s++) {
+        keymaster_rsa_sign_params_t rsaSign;
+        rsaSign.digest_type = static_cast<keymaster_digest_algorithm_t>(signings[s].digest);
+        rsaSign.padding_type = static_cast<keymaster_rsa_padding_t>(signings[s].padding);
+        keymaster_ec_sign_params_t ecSign;
+        ecSign.digest_type = static_cast<keymaster_digest_algorithm_t>(signings[s].digest);
+        const void* params = signings[s].key == ecKey ? static_cast<const void*>(&ecSign)
+                : static_cast<const void*>(&rsaSign);
+        const KeyBlob* key = signings[s].key;
+
+        uint8_t* signature = NULL;
+        size_t signatureLength = 0;
+        Phase sign(signings[s].name);
+        for (size_t i = 0; i < iterations; i++) {
+            free(signature);
+            check(dev->sign_data(dev, params, key->data, key->length, data, sizeof(data),
+                    &signature, &signatureLength), signings[s].name, i);
+        }
+        sign.report(iterations);
+
+        char verifyName[32];
+        snprintf(verifyName, sizeof(verifyName), "verify%s", signings[s].name + 4);
+        Phase verify(verifyName);
+        for (size_t i = 0; i < iterations; i++) {
+            check(dev->verify_data(dev, params, key->data, key->length, data, sizeof(data),
+                    signature, signatureLength), verifyName, i);
+        }
+        verify.report(iterations);
+
+        // A signature over other data has to be turned down.
+        data[sizeof(data) - 1] ^= 1;
+        if (dev->verify_data(dev, params, key->data, key->length, data, sizeof(data),
+                signature, signatureLength) == 0) {
+            fprintf(stderr, "%s accepted a signature over other data\n", verifyName);
+            return 1;
+        }
+        data[sizeof(data) - 1] ^= 1;
+        free(signature);
+    }
+
+    // A wrapped EC key altered in its blob has to be turned down.
+    if (wrapped) {
+        ecKey->data[ecKey->length - 1] ^= 1;
+        keymaster_ec_sign_params_t ecSign;
+        ecSign.digest_type = DIGEST_NONE;
+        uint8_t* signature = NULL;
+        size_t signatureLength = 0;
+        if (dev->sign_data(dev, &ecSign, ecKey->data, ecKey->length, data, sizeof(data),
+                &signature, &signatureLength) == 0) {
+            fprintf(stderr, "sign_ec accepted an altered wrapped key\n");
+            return 1;
+        }
+        ecKey->data[ecKey->length - 1] ^= 1;
+    }
+
+    Phase deleteKeys("delete");
+    for (size_t i = 0; i < blobCount; i++) {
+        check(dev->delete_keypair(dev, blobs[i].data, blobs[i].length), "delete", i);
+        free(blobs[i].data);
+    }
+    deleteKeys.report(blobCount);
+
+    printf("\n");
+    fflush(stdout);
+    keymaster_grouper_dump(dev, STDOUT_FILENO);
+
+    free(blobs);
+    free(rsaPkcs8);
+    free(ecPkcs8);
+    dev->common.close(&dev->common);
+    return 0;
+}
@@ -14,23 +14,39 @@
  * limitations under the License.
  */
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
 
-// For debugging
+// For debugging; host builds turn it off to keep benchmarks quiet.
+#ifndef LOG_NDEBUG
 #define LOG_NDEBUG 0
+#endif
 
 // TEE is the Trusted Execution Environment
 #define LOG_TAG "TEEKeyMaster"
 #include <cutils/log.h>
+#include <cutils/properties.h>
 
 #include <hardware/hardware.h>
 #include <hardware/keymaster0.h>
+#include <hardware/keymaster_defs.h>
 
 #include <openssl/bn.h>
+#include <openssl/crypto.h>
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
+#include <openssl/objects.h>
 #include <openssl/rand.h>
+#include <openssl/sha.h>
 #include <openssl/x509.h>
 
 #include <cryptoki.h>
@@ -43,7 +59,76 @@
 #define ID_LENGTH 32
 
 /** The current stored key version. */
-const static uint32_t KEY_VERSION = 1;
+const static uint32_t KEY_VERSION = 2;
+
+/** Version of the original key blobs, which hold only the key ID. */
+const static uint32_t KEY_VERSION_ID_ONLY = 1;
+
+/** Number of keys whose TEE object handles are kept open between operations. */
+#define KEY_CACHE_SIZE 8
+
+/** Most TEE subsessions open at once, idle or in use. */
+#define SUBSESSION_POOL_SIZE 4
+
+/*
+ * keymaster0 signing params only name DIGEST_NONE and PADDING_NONE. These
+ * keymaster_defs.h values are accepted as well, for callers that hand the
+ * HAL the whole message and let it hash and pad.
+ */
+#define DIGEST_SHA256 KM_DIGEST_SHA_2_256
+#define PADDING_RSA_PKCS1 KM_PAD_RSA_PKCS1_1_5_SIGN
+#define PADDING_RSA_PSS KM_PAD_RSA_PSS
+
+/** Bytes of input passed to SHA256_Update at a time. */
+#define DIGEST_CHUNK_SIZE (64 * 1024)
+
+/** Power-of-two microsecond buckets in each latency histogram, up to ~4 s. */
+#define LATENCY_BUCKETS 24
+
+/** Object handles fetched per C_FindObjects call when wiping the token. */
+#define DELETE_ALL_BATCH 256
+
+/** Workers for generate and import; the other subsessions serve sign and verify. */
+#define KEYGEN_LANE_WORKERS 1
+
+/** Key pregeneration: pool bound, key shape, thread niceness and idle poll. */
+#define PREGEN_MAX_KEYS 4
+#define PREGEN_MODULUS_BITS 2048
+#define PREGEN_EXPONENT 65537
+#define PREGEN_NICE 19
+#define PREGEN_POLL_SECONDS 60
+
+/*
+ * EC mechanisms and attributes from PKCS#11 v2.20 that the TF SDK header
+ * leaves out. Whether the TEE implements them is only found out by trying.
+ */
+#ifndef CKM_EC_KEY_PAIR_GEN
+#define CKM_EC_KEY_PAIR_GEN 0x00001040
+#endif
+#ifndef CKM_ECDSA
+#define CKM_ECDSA 0x00001041
+#endif
+#ifndef CKA_EC_PARAMS
+#define CKA_EC_PARAMS 0x00000180
+#endif
+#ifndef CKA_EC_POINT
+#define CKA_EC_POINT 0x00000181
+#endif
+
+/** Field size of P-256, the only supported curve. */
+#define EC_FIELD_BITS 256
+#define EC_FIELD_BYTES (EC_FIELD_BITS / 8)
+
+/** An uncompressed point: 0x04, then both coordinates. */
+#define EC_POINT_LENGTH (1 + 2 * EC_FIELD_BYTES)
+
+/** AES-256 key and block size for wrapping EC keys the TEE can't hold. */
+#define WRAP_KEY_BYTES 32
+#define WRAP_BLOCK_SIZE 16
+
+/** HMAC-SHA256 key and tag size for authenticating wrapped EC keys. */
+#define WRAP_MAC_KEY_BYTES 32
+#define WRAP_MAC_LENGTH SHA256_DIGEST_LENGTH
 
 
 struct EVP_PKEY_Delete {
@@ -60,6 +145,27 @@ struct RSA_Delete {
 };
 typedef UniquePtr<RSA, RSA_Delete> Unique_RSA;
 
+struct EC_KEY_Delete {
+    void operator()(EC_KEY* p) const {
+        EC_KEY_free(p);
+    }
+};
+typedef UniquePtr<EC_KEY, EC_KEY_Delete> Unique_EC_KEY;
+
+struct EC_POINT_Delete {
+    void operator()(EC_POINT* p) const {
+        EC_POINT_free(p);
+    }
+};
+typedef UniquePtr<EC_POINT, EC_POINT_Delete> Unique_EC_POINT;
+
+struct ECDSA_SIG_Delete {
+    void operator()(ECDSA_SIG* p) const {
+        ECDSA_SIG_free(p);
+    }
+};
+typedef UniquePtr<ECDSA_SIG, ECDSA_SIG_Delete> Unique_ECDSA_SIG;
+
 struct PKCS8_PRIV_KEY_INFO_Delete {
     void operator()(PKCS8_PRIV_KEY_INFO* p) const {
         PKCS8_PRIV_KEY_INFO_free(p);
@@ -67,11 +173,14 @@ struct PKCS8_PRIV_KEY_INFO_Delete {
 };
 typedef UniquePtr<PKCS8_PRIV_KEY_INFO, PKCS8_PRIV_KEY_INFO_Delete> Unique_PKCS8_PRIV_KEY_INFO;
 
-typedef UniquePtr<keymaster0_device_t> Unique_keymaster_device_t;
-
-typedef UniquePtr<CK_BYTE[]> Unique_CK_BYTE;
+/** Frees malloc()ed buffers, such as those handed back to keystore. */
+struct Malloc_Free {
+    void operator()(void* p) const {
+        free(p);
+    }
+};
 
-typedef UniquePtr<CK_ATTRIBUTE[]> Unique_CK_ATTRIBUTE;
+typedef UniquePtr<keymaster0_device_t> Unique_keymaster_device_t;
 
 class ByteArray {
 public:
@@ -114,301 +223,2975 @@ private:
 };
 typedef UniquePtr<ByteArray> Unique_ByteArray;
 
-class CryptoSession {
+static uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * PKCS#11 functions the HAL calls into the secure world through TEE_CALL,
+ * listed once so the enum and the names in the stats stay in step.
+ */
+#define TEE_FUNCTIONS(X) \
+        X(C_OpenSession) \
+        X(C_CloseSession) \
+        X(C_FindObjectsInit) \
+        X(C_FindObjects) \
+        X(C_FindObjectsFinal) \
+        X(C_GetAttributeValue) \
+        X(C_CloseObjectHandle) \
+        X(C_CreateObject) \
+        X(C_CopyObject) \
+        X(C_DestroyObject) \
+        X(C_GenerateKeyPair) \
+        X(C_GenerateKey) \
+        X(C_EncryptInit) \
+        X(C_Encrypt) \
+        X(C_DecryptInit) \
+        X(C_Decrypt) \
+        X(C_SignInit) \
+        X(C_Sign) \
+        X(C_VerifyInit) \
+        X(C_Verify)
+
+enum TeeFunction {
+#define TEE_FUNCTION_ENUM(fn) TEE_FN_##fn,
+    TEE_FUNCTIONS(TEE_FUNCTION_ENUM)
+#undef TEE_FUNCTION_ENUM
+    TEE_FN_COUNT
+};
+
+static const char* const TEE_FUNCTION_NAMES[] = {
+#define TEE_FUNCTION_NAME(fn) #fn,
+    TEE_FUNCTIONS(TEE_FUNCTION_NAME)
+#undef TEE_FUNCTION_NAME
+};
+
+/** HAL operations that TEE calls are attributed to. */
+enum TeeOperationType {
+    TEE_OP_GENERATE,
+    TEE_OP_GENERATE_EC,
+    TEE_OP_IMPORT,
+    TEE_OP_GET_PUBLIC,
+    TEE_OP_DELETE,
+    TEE_OP_DELETE_ALL,
+    TEE_OP_SIGN,
+    TEE_OP_SIGN_RSA_2048,
+    TEE_OP_SIGN_EC,
+    TEE_OP_SIGN_EC_WRAPPED,
+    TEE_OP_VERIFY,
+    TEE_OP_PREGENERATE,
+    TEE_OP_COUNT
+};
+
+static const char* const TEE_OPERATION_NAMES[] = {
+    "generate",
+    "generate_ec",
+    "import",
+    "get_public",
+    "delete",
+    "delete_all",
+    "sign_rsa",
+    "sign_rsa2048",
+    "sign_ec",
+    "sign_ec_wrapped",
+    "verify",
+    "pregenerate",
+};
+
+/**
+ * Destination for the stats dumps: the log when the device is closed, or
+ * a file descriptor for keymaster_grouper_dump().
+ */
+class StatsSink {
 public:
-    CryptoSession(CK_SESSION_HANDLE masterHandle) :
-            mHandle(masterHandle), mSubsession(CK_INVALID_HANDLE) {
-        CK_SESSION_HANDLE subsessionHandle = mHandle;
-        CK_RV openSessionRV = C_OpenSession(CKV_TOKEN_USER,
-                CKF_SERIAL_SESSION | CKF_RW_SESSION | CKVF_OPEN_SUB_SESSION,
-                NULL,
-                NULL,
-                &subsessionHandle);
+    virtual ~StatsSink() {
+    }
 
-        if (openSessionRV != CKR_OK || subsessionHandle == CK_INVALID_HANDLE) {
-            (void) C_Finalize(NULL_PTR);
-            ALOGE("Error opening secondary session with TEE: 0x%x", openSessionRV);
-        } else {
-            ALOGV("Opening subsession 0x%x", subsessionHandle);
-            mSubsession = subsessionHandle;
-        }
+    void print(const char* format, ...) __attribute__((format(printf, 2, 3))) {
+        char line[512];
+        va_list args;
+        va_start(args, format);
+        vsnprintf(line, sizeof(line), format, args);
+        va_end(args);
+        write(line);
     }
 
-    ~CryptoSession() {
-        if (mSubsession != CK_INVALID_HANDLE) {
-            CK_RV rv = C_CloseSession(mSubsession);
-            ALOGV("Closing subsession 0x%x: 0x%x", mSubsession, rv);
-            mSubsession = CK_INVALID_HANDLE;
-        }
+protected:
+    virtual void write(const char* line) = 0;
+};
+
+class LogStatsSink : public StatsSink {
+protected:
+    virtual void write(const char* line) {
+        ALOGI("%s", line);
     }
+};
 
-    CK_SESSION_HANDLE get() const {
-        return mSubsession;
+class FdStatsSink : public StatsSink {
+public:
+    FdStatsSink(int fd) :
+            mFd(fd) {
     }
 
-    CK_SESSION_HANDLE getPrimary() const {
-        return mHandle;
+protected:
+    virtual void write(const char* line) {
+        size_t length = strlen(line);
+        if (::write(mFd, line, length) != static_cast<ssize_t>(length)
+                || ::write(mFd, "\n", 1) != 1) {
+            ALOGW("Couldn't write stats dump: %s", strerror(errno));
+        }
     }
 
 private:
-    CK_SESSION_HANDLE mHandle;
-    CK_SESSION_HANDLE mSubsession;
+    int mFd;
 };
 
-class ObjectHandle {
+/**
+ * Latency distribution in power-of-two microsecond buckets: bucket 0 is
+ * under 1 us, bucket i is [2^(i-1), 2^i) us, and the last bucket takes
+ * everything longer. Updated with atomic adds only.
+ */
+class LatencyHistogram {
 public:
-    ObjectHandle(const CryptoSession* session, CK_OBJECT_HANDLE handle = CK_INVALID_HANDLE) :
-            mSession(session), mHandle(handle) {
+    LatencyHistogram() :
+            mCount(0), mTotalNs(0), mMaxNs(0) {
+        memset(mBuckets, 0, sizeof(mBuckets));
     }
 
-    ~ObjectHandle() {
-        if (mHandle != CK_INVALID_HANDLE) {
-            CK_RV rv = C_CloseObjectHandle(mSession->getPrimary(), mHandle);
-            if (rv != CKR_OK) {
-                ALOGW("Couldn't close object handle 0x%x: 0x%x", mHandle, rv);
+    void record(uint64_t ns) {
+        uint64_t us = ns / 1000;
+        size_t bucket = 0;
+        while (us != 0 && bucket < LATENCY_BUCKETS - 1) {
+            us >>= 1;
+            bucket++;
+        }
+        __sync_fetch_and_add(&mBuckets[bucket], 1);
+        __sync_fetch_and_add(&mCount, 1);
+        __sync_fetch_and_add(&mTotalNs, ns);
+        uint64_t max = mMaxNs;
+        while (ns > max && !__sync_bool_compare_and_swap(&mMaxNs, max, ns)) {
+            max = mMaxNs;
+        }
+    }
+
+    uint32_t count() const {
+        return mCount;
+    }
+
+    uint64_t meanNs() const {
+        uint32_t count = mCount;
+        return count == 0 ? 0 : mTotalNs / count;
+    }
+
+    /**
+     * One line per histogram: count, mean and max, percentiles given as
+     * the upper bound of the bucket they fall in, then the non-empty
+     * buckets as upper-bound:count.
+     */
+    void dump(StatsSink* sink, const char* name) const {
+        uint32_t count = mCount;
+        if (count == 0) {
+            return;
+        }
+
+        char buckets[256];
+        size_t used = 0;
+        buckets[0] = '\0';
+        for (size_t i = 0; i < LATENCY_BUCKETS && used < sizeof(buckets); i++) {
+            if (mBuckets[i] == 0) {
+                continue;
+            }
+            if (i == LATENCY_BUCKETS - 1) {
+                used += snprintf(buckets + used, sizeof(buckets) - used, " >=%lluus:%u",
+                        (unsigned long long) bucketLimitUs(i - 1), mBuckets[i]);
             } else {
-                ALOGV("Closing object handle 0x%x", mHandle);
-                mHandle = CK_INVALID_HANDLE;
+                used += snprintf(buckets + used, sizeof(buckets) - used, " <%lluus:%u",
+                        (unsigned long long) bucketLimitUs(i), mBuckets[i]);
             }
         }
+
+        sink->print("  %-20s n=%u mean=%lluus max=%lluus p50<%lluus p90<%lluus p99<%lluus%s",
+                name, count, (unsigned long long) (mTotalNs / count / 1000),
+                (unsigned long long) (mMaxNs / 1000),
+                (unsigned long long) percentileUs(count, 50),
+                (unsigned long long) percentileUs(count, 90),
+                (unsigned long long) percentileUs(count, 99), buckets);
     }
 
-    CK_OBJECT_HANDLE get() const {
-        return mHandle;
+private:
+    static uint64_t bucketLimitUs(size_t bucket) {
+        return 1ULL << bucket;
     }
 
-    void reset(CK_OBJECT_HANDLE handle) {
-        mHandle = handle;
+    uint64_t percentileUs(uint32_t count, uint32_t percent) const {
+        uint64_t wanted = (static_cast<uint64_t>(count) * percent + 99) / 100;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < LATENCY_BUCKETS; i++) {
+            seen += mBuckets[i];
+            if (seen >= wanted) {
+                return bucketLimitUs(i);
+            }
+        }
+        return bucketLimitUs(LATENCY_BUCKETS - 1);
     }
 
-private:
-    const CryptoSession* mSession;
-    CK_OBJECT_HANDLE mHandle;
+    uint32_t mBuckets[LATENCY_BUCKETS];
+    uint32_t mCount;
+    uint64_t mTotalNs;
+    uint64_t mMaxNs;
 };
 
-
 /**
- * Many OpenSSL APIs take ownership of an argument on success but don't free the argument
- * on failure. This means we need to tell our scoped pointers when we've transferred ownership,
- * without triggering a warning by not using the result of release().
+ * Latencies of each kind of HAL operation and of each PKCS#11 call, plus
+ * how many calls each operation made. This is what tells whether time is
+ * spent in the secure world or in the HAL, and whether a change actually
+ * saved round trips.
  */
-#define OWNERSHIP_TRANSFERRED(obj) \
-    typeof (obj.release()) _dummy __attribute__((unused)) = obj.release()
-
+class TeeCallStats {
+public:
+    TeeCallStats() {
+        memset(mCalls, 0, sizeof(mCalls));
+    }
 
-/*
- * Checks this thread's OpenSSL error queue and logs if
- * necessary.
- */
-static void logOpenSSLError(const char* location) {
-    int error = ERR_get_error();
+    void recordOperation(TeeOperationType type, uint64_t ns, const uint32_t* calls) {
+        mOperations[type].record(ns);
+        for (size_t i = 0; i < TEE_FN_COUNT; i++) {
+            if (calls[i] != 0) {
+                __sync_fetch_and_add(&mCalls[type][i], calls[i]);
+            }
+        }
+    }
 
-    if (error != 0) {
-        char message[256];
-        ERR_error_string_n(error, message, sizeof(message));
-        ALOGE("OpenSSL error in %s %d: %s", location, error, message);
+    void recordCall(TeeFunction fn, uint64_t ns) {
+        mFunctions[fn].record(ns);
     }
 
-    ERR_clear_error();
-    ERR_remove_state(0);
-}
+    void dump(StatsSink* sink) {
+        sink->print("operations:");
+        for (size_t op = 0; op < TEE_OP_COUNT; op++) {
+            mOperations[op].dump(sink, TEE_OPERATION_NAMES[op]);
+        }
 
+        // EC keys are there to replace RSA-2048 ones; show what they save.
+        compare(sink, TEE_OP_SIGN_EC, TEE_OP_SIGN_RSA_2048);
+        compare(sink, TEE_OP_SIGN_EC_WRAPPED, TEE_OP_SIGN_RSA_2048);
 
-/**
- * Convert from OpenSSL's BIGNUM format to TEE's Big Integer format.
- */
-static ByteArray* bignum_to_array(const BIGNUM* bn) {
-    size_t bignumSize = BN_num_bytes(bn);
+        sink->print("TEE calls per operation:");
+        for (size_t op = 0; op < TEE_OP_COUNT; op++) {
+            uint32_t operations = mOperations[op].count();
+            if (operations == 0) {
+                continue;
+            }
 
-    Unique_CK_BYTE bytes(new CK_BYTE[bignumSize]);
+            char detail[384];
+            size_t used = 0;
+            uint64_t total = 0;
+            detail[0] = '\0';
+            for (size_t fn = 0; fn < TEE_FN_COUNT; fn++) {
+                if (mCalls[op][fn] == 0) {
+                    continue;
+                }
+                total += mCalls[op][fn];
+                if (used < sizeof(detail)) {
+                    used += snprintf(detail + used, sizeof(detail) - used, " %s=%u",
+                            TEE_FUNCTION_NAMES[fn], mCalls[op][fn]);
+                }
+            }
 
-    unsigned char* tmp = reinterpret_cast<unsigned char*>(bytes.get());
-    if (BN_bn2bin(bn, tmp) != bignumSize) {
-        ALOGE("public exponent size wasn't what was expected");
-        return NULL;
-    }
+            sink->print("  %-20s %llu.%02llu per op:%s", TEE_OPERATION_NAMES[op],
+                    (unsigned long long) (total / operations),
+                    (unsigned long long) (total * 100 / operations % 100), detail);
+        }
 
-    return new ByteArray(bytes.release(), bignumSize);
-}
+        sink->print("TEE calls:");
+        for (size_t fn = 0; fn < TEE_FN_COUNT; fn++) {
+            mFunctions[fn].dump(sink, TEE_FUNCTION_NAMES[fn]);
+        }
+    }
 
-static void set_attribute(CK_ATTRIBUTE* attrib, CK_ATTRIBUTE_TYPE type, void* pValue,
-        CK_ULONG ulValueLen) {
-    attrib->type = type;
-    attrib->pValue = pValue;
-    attrib->ulValueLen = ulValueLen;
-}
+private:
+    void compare(StatsSink* sink, TeeOperationType op, TeeOperationType baseline) const {
+        uint64_t mean = mOperations[op].meanNs();
+        uint64_t baselineMean = mOperations[baseline].meanNs();
+        if (mean == 0 || baselineMean == 0) {
+            return;
+        }
 
-static ByteArray* generate_random_id() {
-    Unique_ByteArray id(new ByteArray(ID_LENGTH));
-    if (RAND_pseudo_bytes(reinterpret_cast<unsigned char*>(id->get()), id->length()) < 0) {
-        return NULL;
+        sink->print("  %s vs %s: mean %lluus vs %lluus (%llu%%)", TEE_OPERATION_NAMES[op],
+                TEE_OPERATION_NAMES[baseline], (unsigned long long) (mean / 1000),
+                (unsigned long long) (baselineMean / 1000),
+                (unsigned long long) (mean * 100 / baselineMean));
     }
 
-    return id.release();
-}
+    LatencyHistogram mOperations[TEE_OP_COUNT];
+    LatencyHistogram mFunctions[TEE_FN_COUNT];
+    uint32_t mCalls[TEE_OP_COUNT][TEE_FN_COUNT];
+};
 
-static int keyblob_save(ByteArray* objId, uint8_t** key_blob, size_t* key_blob_length) {
-    Unique_ByteArray handleBlob(new ByteArray(sizeof(uint32_t) + objId->length()));
-    if (handleBlob.get() == NULL) {
-        ALOGE("Could not allocate key blob");
-        return -1;
-    }
-    uint8_t* tmp = handleBlob->get();
-    for (size_t i = 0; i < sizeof(uint32_t); i++) {
-        *tmp++ = KEY_VERSION >> ((sizeof(uint32_t) - i - 1) * 8);
+/**
+ * Marks the calling thread as working on one HAL operation for its
+ * lifetime, which is what gets timed, so TEE_CALLs made anywhere
+ * underneath (handle cache, session pool) are attributed to it. Calls made
+ * outside any operation aren't recorded.
+ */
+class TeeOperation {
+public:
+    TeeOperation(TeeCallStats* stats, TeeOperationType type) :
+            mStats(stats), mType(type), mStart(monotonic_ns()) {
+        memset(mCalls, 0, sizeof(mCalls));
+        pthread_once(&sKeyOnce, createKey);
+        mOuter = static_cast<TeeOperation*>(pthread_getspecific(sKey));
+        pthread_setspecific(sKey, this);
     }
-    memcpy(tmp, objId->get(), objId->length());
-
-    *key_blob_length = handleBlob->length();
-    *key_blob = handleBlob->get();
-    ByteArray* unused __attribute__((unused)) = handleBlob.release();
 
-    return 0;
-}
+    ~TeeOperation() {
+        pthread_setspecific(sKey, mOuter);
+        mStats->recordOperation(mType, monotonic_ns() - mStart, mCalls);
+    }
 
-static int find_single_object(const uint8_t* obj_id, const size_t obj_id_length,
-        CK_OBJECT_CLASS obj_class, const CryptoSession* session, ObjectHandle* object) {
+    /** Narrows the type down once the key is known, e.g. EC or RSA signing. */
+    void setType(TeeOperationType type) {
+        mType = type;
+    }
 
-    // Note that the CKA_ID attribute is never written, so we can cast away const here.
-    void* obj_id_ptr = reinterpret_cast<void*>(const_cast<uint8_t*>(obj_id));
-    CK_ATTRIBUTE attributes[] = {
-            { CKA_ID,    obj_id_ptr, obj_id_length },
-            { CKA_CLASS, &obj_class, sizeof(obj_class) },
-    };
+    static void recordCall(TeeFunction fn, uint64_t ns) {
+        pthread_once(&sKeyOnce, createKey);
+        TeeOperation* operation = static_cast<TeeOperation*>(pthread_getspecific(sKey));
+        if (operation != NULL) {
+            operation->mCalls[fn]++;
+            operation->mStats->recordCall(fn, ns);
+        }
+    }
 
-    CK_RV rv = C_FindObjectsInit(session->get(), attributes,
-            sizeof(attributes) / sizeof(CK_ATTRIBUTE));
-    if (rv != CKR_OK) {
-        ALOGE("Error in C_FindObjectsInit: 0x%x", rv);
-        return -1;
+private:
+    static void createKey() {
+        pthread_key_create(&sKey, NULL);
     }
 
-    CK_OBJECT_HANDLE tmpHandle;
-    CK_ULONG tmpCount;
+    static pthread_once_t sKeyOnce;
+    static pthread_key_t sKey;
 
-    rv = C_FindObjects(session->get(), &tmpHandle, 1, &tmpCount);
-    ALOGV("Found %d object 0x%x : class 0x%x", tmpCount, tmpHandle, obj_class);
-    if (rv != CKR_OK || tmpCount != 1) {
-        C_FindObjectsFinal(session->get());
-        ALOGE("Couldn't find key!");
-        return -1;
-    }
-    C_FindObjectsFinal(session->get());
+    TeeCallStats* mStats;
+    TeeOperationType mType;
+    uint64_t mStart;
+    TeeOperation* mOuter;
+    uint32_t mCalls[TEE_FN_COUNT];
+};
 
-    object->reset(tmpHandle);
-    return 0;
-}
+pthread_once_t TeeOperation::sKeyOnce = PTHREAD_ONCE_INIT;
+pthread_key_t TeeOperation::sKey;
 
-static int keyblob_restore(const CryptoSession* session, const uint8_t* keyBlob,
-        const size_t keyBlobLength, ObjectHandle* public_key, ObjectHandle* private_key) {
-    if (keyBlob == NULL) {
-        ALOGE("key blob was null");
-        return -1;
+/** Times one PKCS#11 call for the duration of its scope. */
+class TeeCallTimer {
+public:
+    TeeCallTimer(TeeFunction fn) :
+            mFunction(fn), mStart(monotonic_ns()) {
     }
 
-    if (keyBlobLength < (sizeof(KEY_VERSION) + ID_LENGTH)) {
-        ALOGE("key blob is not correct size");
-        return -1;
+    ~TeeCallTimer() {
+        TeeOperation::recordCall(mFunction, monotonic_ns() - mStart);
     }
 
-    uint32_t keyVersion = 0;
+private:
+    TeeFunction mFunction;
+    uint64_t mStart;
+};
+
+/** Makes a PKCS#11 call, timing it against the current operation. */
+#define TEE_CALL(fn, ...) ({ \
+        TeeCallTimer teeCallTimer(TEE_FN_##fn); \
+        fn(__VA_ARGS__); \
+    })
 
-    const uint8_t* p = keyBlob;
-    for (size_t i = 0; i < sizeof(keyVersion); i++) {
-        keyVersion = (keyVersion << 8) | *p++;
+/**
+ * Subsessions of the primary TEE session, kept open between operations.
+ * Opening and closing a subsession are both round trips to the secure
+ * world, so operations borrow an idle one instead. At most
+ * SUBSESSION_POOL_SIZE are open at once; borrowers beyond that wait for
+ * one to be returned. A subsession that reported a session or device
+ * error is closed on return rather than reused.
+ *
+ * Each thread prefers the subsession it returned last, so a keystore
+ * client that keeps signing stays on one secure-world session instead of
+ * hopping between them. Any idle subsession is used when that one is busy.
+ */
+class SessionPool {
+public:
+    SessionPool(CK_SESSION_HANDLE primary) :
+            mPrimary(primary), mIdleCount(0), mOpenCount(0),
+            mOpened(0), mClosed(0), mBorrowed(0), mAffine(0), mWaits(0), mWaitNs(0),
+            mMaxWaitNs(0) {
+        pthread_mutex_init(&mLock, NULL);
+        pthread_cond_init(&mReturned, NULL);
+        pthread_key_create(&mLastUsed, NULL);
     }
 
-    if (keyVersion != 1) {
-        ALOGE("Invalid key version %d", keyVersion);
-        return -1;
+    ~SessionPool() {
+        for (size_t i = 0; i < mIdleCount; i++) {
+            closeSubsession(mIdle[i]);
+        }
+        pthread_key_delete(mLastUsed);
+        pthread_cond_destroy(&mReturned);
+        pthread_mutex_destroy(&mLock);
     }
 
-    return find_single_object(p, ID_LENGTH, CKO_PUBLIC_KEY, session, public_key)
-            || find_single_object(p, ID_LENGTH, CKO_PRIVATE_KEY, session, private_key);
-}
+    CK_SESSION_HANDLE borrow() {
+        pthread_mutex_lock(&mLock);
+        mBorrowed++;
+        if (mIdleCount == 0 && mOpenCount >= SUBSESSION_POOL_SIZE) {
+            uint64_t start = monotonic_ns();
+            mWaits++;
+            while (mIdleCount == 0 && mOpenCount >= SUBSESSION_POOL_SIZE) {
+                pthread_cond_wait(&mReturned, &mLock);
+            }
+            uint64_t waited = monotonic_ns() - start;
+            mWaitNs += waited;
+            if (waited > mMaxWaitNs) {
+                mMaxWaitNs = waited;
+            }
+        }
 
-static int tee_generate_keypair(const keymaster0_device_t* dev,
-        const keymaster_keypair_t type, const void* key_params,
-        uint8_t** key_blob, size_t* key_blob_length) {
-    CK_BBOOL bTRUE = CK_TRUE;
+        if (mIdleCount > 0) {
+            CK_SESSION_HANDLE handle = takeIdle();
+            pthread_mutex_unlock(&mLock);
+            return handle;
+        }
 
-    if (type != TYPE_RSA) {
-        ALOGW("Unknown key type %d", type);
-        return -1;
-    }
+        // Reserve the slot before dropping the lock for the TEE call.
+        mOpenCount++;
+        pthread_mutex_unlock(&mLock);
 
-    if (key_params == NULL) {
-        ALOGW("generate_keypair params were NULL");
-        return -1;
+        CK_SESSION_HANDLE handle = openSubsession();
+
+        pthread_mutex_lock(&mLock);
+        if (handle == CK_INVALID_HANDLE) {
+            mOpenCount--;
+            pthread_cond_signal(&mReturned);
+        } else {
+            mOpened++;
+        }
+        pthread_mutex_unlock(&mLock);
+        return handle;
     }
 
-    keymaster_rsa_keygen_params_t* rsa_params = (keymaster_rsa_keygen_params_t*) key_params;
+    void giveBack(CK_SESSION_HANDLE handle, bool healthy) {
+        if (handle == CK_INVALID_HANDLE) {
+            return;
+        }
 
-    CK_MECHANISM mechanism = {
-            CKM_RSA_PKCS_KEY_PAIR_GEN, NULL, 0,
-    };
-    CK_ULONG modulusBits = (CK_ULONG) rsa_params->modulus_size;
+        if (!healthy) {
+            closeSubsession(handle);
+        }
 
-    /**
-     * Convert our unsigned 64-bit integer to the TEE Big Integer class. It's
-     * an unsigned array of bytes with MSB first.
-     */
-    CK_BYTE publicExponent[sizeof(uint64_t)];
-    const uint64_t exp = rsa_params->public_exponent;
-    size_t offset = sizeof(publicExponent) - 1;
-    for (size_t i = 0; i < sizeof(publicExponent); i++) {
-        publicExponent[offset--] = (exp >> (i * CHAR_BIT)) & 0xFF;
+        pthread_mutex_lock(&mLock);
+        if (healthy) {
+            mIdle[mIdleCount++] = handle;
+            pthread_setspecific(mLastUsed,
+                    reinterpret_cast<void*>(static_cast<uintptr_t>(handle)));
+        } else {
+            mOpenCount--;
+            mClosed++;
+        }
+        pthread_cond_signal(&mReturned);
+        pthread_mutex_unlock(&mLock);
     }
 
-    Unique_ByteArray objId(generate_random_id());
-    if (objId.get() == NULL) {
-        ALOGE("Couldn't generate random key ID");
-        return -1;
+    void dump(StatsSink* sink) {
+        pthread_mutex_lock(&mLock);
+        sink->print("subsessions: %zu open (%zu idle), %llu opened, %llu closed, %llu borrowed "
+                "(%llu by the same thread), %llu waited for %llu us total, %llu us max",
+                mOpenCount, mIdleCount, (unsigned long long) mOpened,
+                (unsigned long long) mClosed, (unsigned long long) mBorrowed,
+                (unsigned long long) mAffine,
+                (unsigned long long) mWaits, (unsigned long long) (mWaitNs / 1000),
+                (unsigned long long) (mMaxWaitNs / 1000));
+        pthread_mutex_unlock(&mLock);
     }
 
-    CK_ATTRIBUTE publicKeyTemplate[] = {
-            {CKA_ID,              objId->get(),   objId->length()},
-            {CKA_TOKEN,           &bTRUE,         sizeof(bTRUE)},
-            {CKA_ENCRYPT,         &bTRUE,         sizeof(bTRUE)},
-            {CKA_VERIFY,          &bTRUE,         sizeof(bTRUE)},
+private:
+    /** Takes an idle subsession, the calling thread's previous one if idle. */
+    CK_SESSION_HANDLE takeIdle() {
+        CK_SESSION_HANDLE preferred = static_cast<CK_SESSION_HANDLE>(
+                reinterpret_cast<uintptr_t>(pthread_getspecific(mLastUsed)));
+        size_t chosen = mIdleCount - 1;
+        for (size_t i = 0; i < mIdleCount; i++) {
+            if (mIdle[i] == preferred) {
+                chosen = i;
+                mAffine++;
+                break;
+            }
+        }
+        CK_SESSION_HANDLE handle = mIdle[chosen];
+        mIdle[chosen] = mIdle[--mIdleCount];
+        return handle;
+    }
+
+    CK_SESSION_HANDLE openSubsession() {
+        CK_SESSION_HANDLE subsessionHandle = mPrimary;
+        CK_RV openSessionRV = TEE_CALL(C_OpenSession, CKV_TOKEN_USER,
+                CKF_SERIAL_SESSION | CKF_RW_SESSION | CKVF_OPEN_SUB_SESSION,
+                NULL,
+                NULL,
+                &subsessionHandle);
+
+        if (openSessionRV != CKR_OK || subsessionHandle == CK_INVALID_HANDLE) {
+            ALOGE("Error opening secondary session with TEE: 0x%x", openSessionRV);
+            return CK_INVALID_HANDLE;
+        }
+
+        ALOGV("Opening subsession 0x%x", subsessionHandle);
+        return subsessionHandle;
+    }
+
+    void closeSubsession(CK_SESSION_HANDLE handle) {
+        CK_RV rv = TEE_CALL(C_CloseSession, handle);
+        ALOGV("Closing subsession 0x%x: 0x%x", handle, rv);
+    }
+
+    CK_SESSION_HANDLE mPrimary;
+    pthread_mutex_t mLock;
+    pthread_cond_t mReturned;
+    CK_SESSION_HANDLE mIdle[SUBSESSION_POOL_SIZE];
+    size_t mIdleCount;
+    size_t mOpenCount;
+    pthread_key_t mLastUsed;
+
+    uint64_t mOpened;
+    uint64_t mClosed;
+    uint64_t mBorrowed;
+    uint64_t mAffine;
+    uint64_t mWaits;
+    uint64_t mWaitNs;
+    uint64_t mMaxWaitNs;
+};
+
+/**
+ * A subsession borrowed from a SessionPool for the duration of one operation.
+ */
+class CryptoSession {
+public:
+    CryptoSession(CK_SESSION_HANDLE masterHandle, SessionPool* pool) :
+            mHandle(masterHandle), mPool(pool), mHealthy(true) {
+        mSubsession = mPool->borrow();
+    }
+
+    ~CryptoSession() {
+        mPool->giveBack(mSubsession, mHealthy);
+        mSubsession = CK_INVALID_HANDLE;
+    }
+
+    CK_SESSION_HANDLE get() const {
+        return mSubsession;
+    }
+
+    CK_SESSION_HANDLE getPrimary() const {
+        return mHandle;
+    }
+
+    /**
+     * Passes through the result of a call made on this subsession, noting
+     * errors after which it shouldn't go back into the pool.
+     */
+    CK_RV check(CK_RV rv) {
+        if (rv == CKR_SESSION_HANDLE_INVALID || rv == CKR_DEVICE_ERROR
+                || rv == CKR_TOKEN_NOT_PRESENT) {
+            mHealthy = false;
+        }
+        return rv;
+    }
+
+private:
+    CK_SESSION_HANDLE mHandle;
+    SessionPool* mPool;
+    CK_SESSION_HANDLE mSubsession;
+    bool mHealthy;
+};
+
+class ObjectHandle {
+public:
+    ObjectHandle(const CryptoSession* session, CK_OBJECT_HANDLE handle = CK_INVALID_HANDLE) :
+            mSession(session), mHandle(handle) {
+    }
+
+    ~ObjectHandle() {
+        if (mHandle != CK_INVALID_HANDLE) {
+            CK_RV rv = TEE_CALL(C_CloseObjectHandle, mSession->getPrimary(), mHandle);
+            if (rv != CKR_OK) {
+                ALOGW("Couldn't close object handle 0x%x: 0x%x", mHandle, rv);
+            } else {
+                ALOGV("Closing object handle 0x%x", mHandle);
+                mHandle = CK_INVALID_HANDLE;
+            }
+        }
+    }
+
+    CK_OBJECT_HANDLE get() const {
+        return mHandle;
+    }
+
+    void reset(CK_OBJECT_HANDLE handle) {
+        mHandle = handle;
+    }
+
+    CK_OBJECT_HANDLE release() {
+        CK_OBJECT_HANDLE handle = mHandle;
+        mHandle = CK_INVALID_HANDLE;
+        return handle;
+    }
+
+private:
+    const CryptoSession* mSession;
+    CK_OBJECT_HANDLE mHandle;
+};
+
+
+/**
+ * Keeps the public and private object handles of recently used keys open,
+ * so repeated operations on the same key skip the two C_FindObjects
+ * round trips to the secure world. Object handles belong to the primary
+ * session and remain valid across subsessions, which is what lets them
+ * outlive the CryptoSession that looked them up.
+ *
+ * Entries are pinned while an operation uses them and only unpinned
+ * entries are evicted, roughly least recently used first.
+ *
+ * The cache takes no lock. Each entry's refs word is also its state: zero
+ * or more is the pin count of a filled entry, ENTRY_EMPTY and ENTRY_BUSY
+ * mark a slot that holds nothing or that one thread has claimed to fill,
+ * evict or close. Pinning is a compare-and-swap that only succeeds on a
+ * filled entry, and the full ID is compared only once it is pinned, so an
+ * entry refilled under a lookup is just unpinned again. An entry's fields
+ * are only written while it is ENTRY_BUSY, apart from the public key
+ * copies, which are published once by compare-and-swap on a pinned entry.
+ */
+class KeyHandleCache {
+public:
+    KeyHandleCache(CK_SESSION_HANDLE primary) :
+            mPrimary(primary), mClock(0), mHits(0), mMisses(0) {
+        memset(mEntries, 0, sizeof(mEntries));
+        for (int i = 0; i < KEY_CACHE_SIZE; i++) {
+            mEntries[i].refs = ENTRY_EMPTY;
+        }
+    }
+
+    ~KeyHandleCache() {
+        for (int i = 0; i < KEY_CACHE_SIZE; i++) {
+            if (mEntries[i].refs != ENTRY_EMPTY) {
+                closeEntry(&mEntries[i]);
+            }
+        }
+    }
+
+    /**
+     * Looks up the handles for a key ID. On a hit the entry is pinned and
+     * its slot returned, to be passed to the other calls and then to
+     * release(). Returns -1 on a miss.
+     */
+    int acquire(const uint8_t* id, CK_OBJECT_HANDLE* publicKey, CK_OBJECT_HANDLE* privateKey) {
+        int slot = pin(id, false);
+        if (slot < 0) {
+            __sync_fetch_and_add(&mMisses, 1);
+            return -1;
+        }
+        Entry* entry = &mEntries[slot];
+        __sync_fetch_and_add(&mHits, 1);
+        entry->lastUse = __sync_add_and_fetch(&mClock, 1);
+        *publicKey = entry->publicKey;
+        *privateKey = entry->privateKey;
+        return slot;
+    }
+
+    /**
+     * Offers a freshly looked up pair of handles to the cache. If it takes
+     * ownership of them, the new entry is pinned and its slot returned as
+     * for acquire(). Returns -1 if the ID is already cached or every slot
+     * is pinned; the caller then still owns the handles. An invalidated
+     * entry still pinned elsewhere counts as cached, since it may hold
+     * these very handles and close them once released. Two threads
+     * racing to insert the same key may both succeed, which only costs a
+     * slot until one of them is evicted.
+     */
+    int insert(const uint8_t* id, CK_OBJECT_HANDLE publicKey, CK_OBJECT_HANDLE privateKey) {
+        int slot = pin(id, true);
+        if (slot >= 0) {
+            unpin(&mEntries[slot]);
+            return -1;
+        }
+        slot = claim();
+        if (slot < 0) {
+            return -1;
+        }
+
+        Entry* entry = &mEntries[slot];
+        memcpy(entry->id, id, ID_LENGTH);
+        entry->tag = idTag(id);
+        entry->publicKey = publicKey;
+        entry->privateKey = privateKey;
+        entry->lastUse = __sync_add_and_fetch(&mClock, 1);
+        entry->stale = false;
+        __sync_synchronize();
+        entry->refs = 1;
+        return slot;
+    }
+
+    /**
+     * Returns the parsed public key stored with a pinned entry, if any. It
+     * stays valid until the entry is released.
+     */
+    RSA* getPublicRsa(int slot) {
+        return mEntries[slot].publicRsa;
+    }
+
+    /**
+     * Stores a parsed public key with a pinned entry, taking ownership of
+     * it. Returns the key now stored, which is an earlier one if another
+     * thread got there first.
+     */
+    RSA* setPublicRsa(int slot, RSA* rsa) {
+        RSA* stored = __sync_val_compare_and_swap(&mEntries[slot].publicRsa,
+                static_cast<RSA*>(NULL), rsa);
+        if (stored != NULL) {
+            RSA_free(rsa);
+            return stored;
+        }
+        return rsa;
+    }
+
+    /**
+     * Copies the SubjectPublicKeyInfo DER stored with a pinned entry into a
+     * new malloc()ed buffer. Returns false if none is stored.
+     */
+    bool copyPublicDer(int slot, uint8_t** der, size_t* derLength) {
+        const PublicDer* stored = mEntries[slot].publicDer;
+        if (stored == NULL) {
+            return false;
+        }
+        *der = static_cast<uint8_t*>(malloc(stored->length));
+        if (*der == NULL) {
+            return false;
+        }
+        memcpy(*der, stored->data, stored->length);
+        *derLength = stored->length;
+        return true;
+    }
+
+    void setPublicDer(int slot, const uint8_t* der, size_t derLength) {
+        if (mEntries[slot].publicDer != NULL) {
+            return;
+        }
+        PublicDer* copy = new PublicDer;
+        copy->data = new uint8_t[derLength];
+        memcpy(copy->data, der, derLength);
+        copy->length = derLength;
+        if (!__sync_bool_compare_and_swap(&mEntries[slot].publicDer,
+                static_cast<PublicDer*>(NULL), copy)) {
+            delete[] copy->data;
+            delete copy;
+        }
+    }
+
+    void release(int slot) {
+        unpin(&mEntries[slot]);
+    }
+
+    /**
+     * Drops the entry for a key that is about to be destroyed. If another
+     * operation still has it pinned, the handles are closed when the last
+     * pin is released instead.
+     */
+    void invalidate(const uint8_t* id) {
+        // A racing insert may have cached the key twice.
+        for (int slot = pin(id, false); slot >= 0; slot = pin(id, false)) {
+            mEntries[slot].stale = true;
+            unpin(&mEntries[slot]);
+        }
+    }
+
+    /** Drops every entry, as invalidate() does for one. */
+    void invalidateAll() {
+        for (int i = 0; i < KEY_CACHE_SIZE; i++) {
+            Entry* entry = &mEntries[i];
+            if (tryPin(entry)) {
+                entry->stale = true;
+                unpin(entry);
+            }
+        }
+    }
+
+    void dump(StatsSink* sink) {
+        size_t used = 0;
+        for (int i = 0; i < KEY_CACHE_SIZE; i++) {
+            used += mEntries[i].refs >= 0 ? 1 : 0;
+        }
+        sink->print("key cache: %zu of %d entries used, %u hits, %u misses", used,
+                KEY_CACHE_SIZE, mHits, mMisses);
+    }
+
+private:
+    enum {
+        ENTRY_EMPTY = -1,
+        ENTRY_BUSY = -2,
+    };
+
+    struct PublicDer {
+        size_t length;
+        uint8_t* data;
+    };
+
+    struct Entry {
+        volatile int refs;
+        volatile uint32_t tag;
+        volatile uint32_t lastUse;
+        volatile bool stale;
+        uint8_t id[ID_LENGTH];
+        CK_OBJECT_HANDLE publicKey;
+        CK_OBJECT_HANDLE privateKey;
+        RSA* volatile publicRsa;
+        PublicDer* volatile publicDer;
+    };
+
+    /** The first bytes of an ID, which lookups compare before pinning. */
+    static uint32_t idTag(const uint8_t* id) {
+        uint32_t tag;
+        memcpy(&tag, id, sizeof(tag));
+        return tag;
+    }
+
+    static bool tryPin(Entry* entry) {
+        int refs = entry->refs;
+        while (refs >= 0) {
+            int seen = __sync_val_compare_and_swap(&entry->refs, refs, refs + 1);
+            if (seen == refs) {
+                return true;
+            }
+            refs = seen;
+        }
+        return false;
+    }
+
+    /**
+     * Pins an entry for the ID and returns its slot, or -1 if there is
+     * none. Invalidated entries are skipped unless includeStale is set.
+     */
+    int pin(const uint8_t* id, bool includeStale) {
+        uint32_t tag = idTag(id);
+        for (int i = 0; i < KEY_CACHE_SIZE; i++) {
+            Entry* entry = &mEntries[i];
+            if (entry->tag != tag || !tryPin(entry)) {
+                continue;
+            }
+            if (memcmp(entry->id, id, ID_LENGTH) == 0 && (includeStale || !entry->stale)) {
+                return i;
+            }
+            unpin(entry);
+        }
+        return -1;
+    }
+
+    /** Drops a pin, closing the entry if it was the last one on a stale entry. */
+    void unpin(Entry* entry) {
+        if (__sync_sub_and_fetch(&entry->refs, 1) == 0 && entry->stale
+                && __sync_bool_compare_and_swap(&entry->refs, 0, ENTRY_BUSY)) {
+            closeEntry(entry);
+            __sync_synchronize();
+            entry->refs = ENTRY_EMPTY;
+        }
+    }
+
+    /**
+     * Claims an empty slot, or else evicts the least recently used
+     * unpinned entry, and returns it as ENTRY_BUSY. Returns -1 if every
+     * entry stays pinned for a few attempts.
+     */
+    int claim() {
+        for (int attempt = 0; attempt < KEY_CACHE_SIZE; attempt++) {
+            uint32_t now = mClock;
+            int victim = -1;
+            for (int i = 0; i < KEY_CACHE_SIZE; i++) {
+                Entry* entry = &mEntries[i];
+                int refs = entry->refs;
+                if (refs == ENTRY_EMPTY
+                        && __sync_bool_compare_and_swap(&entry->refs, ENTRY_EMPTY, ENTRY_BUSY)) {
+                    return i;
+                }
+                // The clock may wrap, so compare ages rather than timestamps.
+                if (refs == 0 && (victim < 0
+                        || now - entry->lastUse > now - mEntries[victim].lastUse)) {
+                    victim = i;
+                }
+            }
+            if (victim < 0) {
+                return -1;
+            }
+            if (__sync_bool_compare_and_swap(&mEntries[victim].refs, 0, ENTRY_BUSY)) {
+                closeEntry(&mEntries[victim]);
+                return victim;
+            }
+        }
+        return -1;
+    }
+
+    /** Closes and empties an entry the caller has made ENTRY_BUSY, leaving refs alone. */
+    void closeEntry(Entry* entry) {
+        ALOGV("Evicting cached handles 0x%x/0x%x", entry->publicKey, entry->privateKey);
+        TEE_CALL(C_CloseObjectHandle, mPrimary, entry->publicKey);
+        TEE_CALL(C_CloseObjectHandle, mPrimary, entry->privateKey);
+        if (entry->publicRsa != NULL) {
+            RSA_free(entry->publicRsa);
+            entry->publicRsa = NULL;
+        }
+        if (entry->publicDer != NULL) {
+            delete[] entry->publicDer->data;
+            delete entry->publicDer;
+            entry->publicDer = NULL;
+        }
+        entry->tag = 0;
+        memset(entry->id, 0, sizeof(entry->id));
+        entry->publicKey = CK_INVALID_HANDLE;
+        entry->privateKey = CK_INVALID_HANDLE;
+    }
+
+    CK_SESSION_HANDLE mPrimary;
+    uint32_t mClock;
+    uint32_t mHits;
+    uint32_t mMisses;
+    Entry mEntries[KEY_CACHE_SIZE];
+};
+
+/** A unit of work for a WorkQueue; done is called with run's result. */
+struct WorkItem {
+    int (*run)(void* arg);
+    void* arg;
+    void (*done)(void* cookie, int result);
+    void* cookie;
+    WorkItem* next;
+};
+
+/**
+ * One lane of HAL work: a FIFO of work items run in order by a fixed set
+ * of worker threads. Items are owned by the submitter and must stay alive
+ * until their done callback has run; the queue never touches an item
+ * after that.
+ *
+ * The HAL uses two lanes so that keygens, which hold a subsession for
+ * seconds, can't take every subsession and stall the short sign and
+ * verify operations queued behind them.
+ */
+class WorkQueue {
+public:
+    WorkQueue(const char* name, size_t workers) :
+            mName(name), mWorkers(workers < SUBSESSION_POOL_SIZE ? workers : SUBSESSION_POOL_SIZE),
+            mStarted(0), mStop(false), mHead(NULL), mTail(NULL) {
+        pthread_mutex_init(&mLock, NULL);
+        pthread_cond_init(&mPending, NULL);
+    }
+
+    ~WorkQueue() {
+        stop();
+        pthread_cond_destroy(&mPending);
+        pthread_mutex_destroy(&mLock);
+    }
+
+    void start() {
+        pthread_mutex_lock(&mLock);
+        mStop = false;
+        pthread_mutex_unlock(&mLock);
+        for (size_t i = mStarted; i < mWorkers; i++) {
+            if (pthread_create(&mThreads[i], NULL, threadMain, this) != 0) {
+                ALOGW("Could not start %s worker %zu", mName, i);
+                break;
+            }
+            mStarted++;
+        }
+    }
+
+    /** Runs whatever is still queued, then joins the workers. */
+    void stop() {
+        pthread_mutex_lock(&mLock);
+        mStop = true;
+        pthread_cond_broadcast(&mPending);
+        pthread_mutex_unlock(&mLock);
+        for (size_t i = 0; i < mStarted; i++) {
+            pthread_join(mThreads[i], NULL);
+        }
+        mStarted = 0;
+    }
+
+    /**
+     * Queues an item. Returns false if the lane has no workers, in which
+     * case the caller has to run it itself.
+     */
+    bool submit(WorkItem* item) {
+        item->next = NULL;
+        pthread_mutex_lock(&mLock);
+        bool accepted = mStarted > 0 && !mStop;
+        if (accepted) {
+            if (mTail != NULL) {
+                mTail->next = item;
+            } else {
+                mHead = item;
+            }
+            mTail = item;
+            pthread_cond_signal(&mPending);
+        }
+        pthread_mutex_unlock(&mLock);
+        return accepted;
+    }
+
+    bool isWorker() const {
+        pthread_t self = pthread_self();
+        for (size_t i = 0; i < mStarted; i++) {
+            if (pthread_equal(mThreads[i], self)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    static void* threadMain(void* arg) {
+        static_cast<WorkQueue*>(arg)->run();
+        return NULL;
+    }
+
+    void run() {
+        pthread_mutex_lock(&mLock);
+        for (;;) {
+            while (mHead == NULL && !mStop) {
+                pthread_cond_wait(&mPending, &mLock);
+            }
+            if (mHead == NULL) {
+                break;
+            }
+
+            WorkItem* item = mHead;
+            mHead = item->next;
+            if (mHead == NULL) {
+                mTail = NULL;
+            }
+            pthread_mutex_unlock(&mLock);
+
+            int result = item->run(item->arg);
+            item->done(item->cookie, result);
+
+            pthread_mutex_lock(&mLock);
+        }
+        pthread_mutex_unlock(&mLock);
+    }
+
+    const char* mName;
+    size_t mWorkers;
+    size_t mStarted;
+    bool mStop;
+    WorkItem* mHead;
+    WorkItem* mTail;
+    pthread_mutex_t mLock;
+    pthread_cond_t mPending;
+    pthread_t mThreads[SUBSESSION_POOL_SIZE];
+};
+
+class KeyPregenerator;
+
+/**
+ * Per-device state, stored in keymaster0_device_t::context.
+ *
+ * The HAL entry points may be called from any number of threads at once.
+ * Each operation borrows its own subsession, and everything shared here
+ * is internally locked; operations on different keys, or signatures with
+ * the same key, run in parallel up to SUBSESSION_POOL_SIZE at a time.
+ */
+struct TeeContext {
+    TeeContext(CK_SESSION_HANDLE primary) :
+            primary(primary), subsessions(primary), keyCache(primary), pregenerator(NULL),
+            keygenLane("keygen", KEYGEN_LANE_WORKERS),
+            fastLane("fast", SUBSESSION_POOL_SIZE - KEYGEN_LANE_WORKERS),
+            ecInSoftware(0), wrapKey(CK_INVALID_HANDLE), macKey(CK_INVALID_HANDLE) {
+        pthread_mutex_init(&wrapLock, NULL);
+    }
+
+    ~TeeContext() {
+        pthread_mutex_destroy(&wrapLock);
+    }
+
+    CK_SESSION_HANDLE primary;
+    SessionPool subsessions;
+    KeyHandleCache keyCache;
+    TeeCallStats callStats;
+
+    KeyPregenerator* pregenerator;
+
+    // Generate and import run on keygenLane, sign and verify on fastLane.
+    WorkQueue keygenLane;
+    WorkQueue fastLane;
+
+    // Set once the TEE turns out not to support P-256 keys, and never
+    // cleared; see ec_in_software().
+    int32_t ecInSoftware;
+
+    // The AES and HMAC keys that wrap software EC keys, looked up on first use.
+    pthread_mutex_t wrapLock;
+    CK_OBJECT_HANDLE wrapKey;
+    CK_OBJECT_HANDLE macKey;
+};
+
+static TeeContext* tee_context(const keymaster0_device_t* dev) {
+    return reinterpret_cast<TeeContext*>(dev->context);
+}
+
+
+/**
+ * Many OpenSSL APIs take ownership of an argument on success but don't free the argument
+ * on failure. This means we need to tell our scoped pointers when we've transferred ownership,
+ * without triggering a warning by not using the result of release().
+ */
+#define OWNERSHIP_TRANSFERRED(obj) \
+    typeof (obj.release()) _dummy __attribute__((unused)) = obj.release()
+
+
+/*
+ * Checks this thread's OpenSSL error queue and logs if
+ * necessary.
+ */
+static void logOpenSSLError(const char* location) {
+    int error = ERR_get_error();
+
+    if (error != 0) {
+        char message[256];
+        ERR_error_string_n(error, message, sizeof(message));
+        ALOGE("OpenSSL error in %s %d: %s", location, error, message);
+    }
+
+    ERR_clear_error();
+    ERR_remove_state(0);
+}
+
+
+/** Bytes an AttributeArena holds without touching the heap. */
+#define ATTRIBUTE_ARENA_INLINE_SIZE 2048
+
+/**
+ * Bump allocator for the attribute templates and values of one operation.
+ * The caller sizes it up front: up to ATTRIBUTE_ARENA_INLINE_SIZE comes
+ * from storage inside the arena itself, anything larger from a single heap
+ * block. Everything is wiped, since private key material passes through
+ * here, and released at once when the arena goes out of scope.
+ */
+class AttributeArena {
+public:
+    AttributeArena(size_t capacity) :
+            mUsed(0) {
+        if (capacity <= sizeof(mInline)) {
+            mBlock = mInline;
+            mCapacity = sizeof(mInline);
+        } else {
+            mBlock = new uint8_t[capacity];
+            mCapacity = mBlock != NULL ? capacity : 0;
+        }
+    }
+
+    ~AttributeArena() {
+        if (mBlock != NULL) {
+            OPENSSL_cleanse(mBlock, mUsed);
+        }
+        if (mBlock != mInline) {
+            delete[] mBlock;
+        }
+    }
+
+    /** Arena space taken by an allocation of size bytes. */
+    static size_t sizeFor(size_t size) {
+        return (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+    }
+
+    void* alloc(size_t size) {
+        if (size > mCapacity - mUsed) {
+            ALOGE("Attribute arena exhausted: %zu of %zu bytes used, %zu requested", mUsed,
+                    mCapacity, size);
+            return NULL;
+        }
+        void* block = mBlock + mUsed;
+        mUsed += sizeFor(size);
+        if (mUsed > mCapacity) {
+            mUsed = mCapacity;
+        }
+        return block;
+    }
+
+private:
+    static const size_t ALIGNMENT = 8;
+
+    uint8_t* mBlock;
+    size_t mCapacity;
+    size_t mUsed;
+    uint8_t mInline[ATTRIBUTE_ARENA_INLINE_SIZE] __attribute__((aligned(8)));
+};
+
+/**
+ * Convert from OpenSSL's BIGNUM format to TEE's Big Integer format, straight
+ * into an attribute value allocated from the arena.
+ */
+static int bignum_to_attribute(AttributeArena* arena, CK_ATTRIBUTE* attrib,
+        CK_ATTRIBUTE_TYPE type, const BIGNUM* bn) {
+    size_t bignumSize = BN_num_bytes(bn);
+
+    unsigned char* tmp = static_cast<unsigned char*>(arena->alloc(bignumSize));
+    if (tmp == NULL) {
+        return -1;
+    }
+
+    if (BN_bn2bin(bn, tmp) != static_cast<int>(bignumSize)) {
+        ALOGE("BIGNUM size wasn't what was expected");
+        return -1;
+    }
+
+    attrib->type = type;
+    attrib->pValue = tmp;
+    attrib->ulValueLen = bignumSize;
+    return 0;
+}
+
+static void set_attribute(CK_ATTRIBUTE* attrib, CK_ATTRIBUTE_TYPE type, void* pValue,
+        CK_ULONG ulValueLen) {
+    attrib->type = type;
+    attrib->pValue = pValue;
+    attrib->ulValueLen = ulValueLen;
+}
+
+static ByteArray* generate_random_id() {
+    Unique_ByteArray id(new ByteArray(ID_LENGTH));
+    if (RAND_pseudo_bytes(reinterpret_cast<unsigned char*>(id->get()), id->length()) < 0) {
+        return NULL;
+    }
+
+    return id.release();
+}
+
+static void write_u32(uint8_t* p, uint32_t value) {
+    for (size_t i = 0; i < sizeof(uint32_t); i++) {
+        *p++ = value >> ((sizeof(uint32_t) - i - 1) * 8);
+    }
+}
+
+static uint32_t read_u32(const uint8_t* p) {
+    uint32_t value = 0;
+    for (size_t i = 0; i < sizeof(uint32_t); i++) {
+        value = (value << 8) | *p++;
+    }
+    return value;
+}
+
+/**
+ * Encodes a public key as SubjectPublicKeyInfo DER into a new malloc()ed
+ * buffer.
+ */
+static int encode_pkey_der(EVP_PKEY* pkey, uint8_t** der, size_t* derLength) {
+    int len = i2d_PUBKEY(pkey, NULL);
+    if (len <= 0) {
+        logOpenSSLError("encode_pkey_der");
+        return -1;
+    }
+
+    UniquePtr<uint8_t, Malloc_Free> buffer(static_cast<uint8_t*>(malloc(len)));
+    if (buffer.get() == NULL) {
+        ALOGE("Could not allocate memory for public key data");
+        return -1;
+    }
+
+    unsigned char* tmp = reinterpret_cast<unsigned char*>(buffer.get());
+    if (i2d_PUBKEY(pkey, &tmp) != len) {
+        logOpenSSLError("encode_pkey_der");
+        return -1;
+    }
+
+    *derLength = len;
+    *der = buffer.release();
+    return 0;
+}
+
+static int encode_rsa_public_der(RSA* key, uint8_t** der, size_t* derLength) {
+    Unique_RSA rsa(RSAPublicKey_dup(key));
+    if (rsa.get() == NULL) {
+        logOpenSSLError("encode_rsa_public_der");
+        return -1;
+    }
+
+    Unique_EVP_PKEY pkey(EVP_PKEY_new());
+    if (pkey.get() == NULL) {
+        ALOGE("Could not allocate EVP_PKEY structure");
+        return -1;
+    }
+    if (EVP_PKEY_assign_RSA(pkey.get(), rsa.get()) != 1) {
+        logOpenSSLError("encode_rsa_public_der");
+        return -1;
+    }
+    OWNERSHIP_TRANSFERRED(rsa);
+
+    return encode_pkey_der(pkey.get(), der, derLength);
+}
+
+static int encode_ec_public_der(EC_KEY* key, uint8_t** der, size_t* derLength) {
+    Unique_EVP_PKEY pkey(EVP_PKEY_new());
+    if (pkey.get() == NULL) {
+        ALOGE("Could not allocate EVP_PKEY structure");
+        return -1;
+    }
+
+    // Name the curve rather than spelling out its parameters.
+    EC_KEY_set_asn1_flag(key, OPENSSL_EC_NAMED_CURVE);
+    if (EVP_PKEY_set1_EC_KEY(pkey.get(), key) != 1) {
+        logOpenSSLError("encode_ec_public_der");
+        return -1;
+    }
+
+    return encode_pkey_der(pkey.get(), der, derLength);
+}
+
+/*
+ * Version 2 key blob layout, integers big-endian:
+ *
+ *   uint32_t version            KEY_VERSION
+ *   uint8_t  id[ID_LENGTH]      CKA_ID of the key objects
+ *   uint32_t keyType            TYPE_RSA or TYPE_EC
+ *   uint32_t flags              KEYBLOB_FLAG_*
+ *   uint32_t keyBits            modulus or field size, 0 if unknown
+ *   uint32_t publicHandle       object handles at creation time, or
+ *   uint32_t privateHandle      CK_INVALID_HANDLE
+ *   uint8_t  digest[32]         SHA-256 of the public key DER
+ *   uint32_t publicDerLength    0 if no public key is stored
+ *   uint8_t  publicDer[]        SubjectPublicKeyInfo
+ *   uint32_t wrappedLength      only with KEYBLOB_FLAG_WRAPPED
+ *   uint8_t  wrapped[]          IV, the encrypted ECPrivateKey, then its MAC
+ *
+ * Version 1 blobs are just the version and the ID, and are always RSA.
+ */
+#define KEYBLOB_V1_LENGTH (sizeof(uint32_t) + ID_LENGTH)
+#define KEYBLOB_V2_HEADER_LENGTH (KEYBLOB_V1_LENGTH + 5 * sizeof(uint32_t) \
+        + SHA256_DIGEST_LENGTH + sizeof(uint32_t))
+
+/**
+ * The private key isn't a TEE object but is kept in the blob, encrypted
+ * and authenticated with TEE-held keys, and signs in the normal world.
+ */
+#define KEYBLOB_FLAG_WRAPPED 0x1
+
+/**
+ * A parsed key blob, or one to be saved. Pointers refer into the blob it
+ * was parsed from.
+ */
+struct KeyBlob {
+    uint32_t version;
+    const uint8_t* id;
+    uint32_t keyType;
+    uint32_t flags;
+    uint32_t keyBits;
+    CK_OBJECT_HANDLE publicHint;
+    CK_OBJECT_HANDLE privateHint;
+    const uint8_t* publicDer;
+    size_t publicDerLength;
+    const uint8_t* wrapped;
+    size_t wrappedLength;
+};
+
+/** Writes a current version key blob. blob->version is ignored. */
+static int keyblob_save(const KeyBlob* blob, uint8_t** key_blob, size_t* key_blob_length) {
+    size_t length = KEYBLOB_V2_HEADER_LENGTH + blob->publicDerLength;
+    if (blob->flags & KEYBLOB_FLAG_WRAPPED) {
+        length += sizeof(uint32_t) + blob->wrappedLength;
+    }
+
+    Unique_ByteArray handleBlob(new ByteArray(length));
+    if (handleBlob.get() == NULL) {
+        ALOGE("Could not allocate key blob");
+        return -1;
+    }
+
+    uint8_t* tmp = handleBlob->get();
+    write_u32(tmp, KEY_VERSION);
+    tmp += sizeof(uint32_t);
+    memcpy(tmp, blob->id, ID_LENGTH);
+    tmp += ID_LENGTH;
+    write_u32(tmp, blob->keyType);
+    tmp += sizeof(uint32_t);
+    write_u32(tmp, blob->flags);
+    tmp += sizeof(uint32_t);
+    write_u32(tmp, blob->keyBits);
+    tmp += sizeof(uint32_t);
+    write_u32(tmp, blob->publicHint);
+    tmp += sizeof(uint32_t);
+    write_u32(tmp, blob->privateHint);
+    tmp += sizeof(uint32_t);
+    if (blob->publicDerLength > 0) {
+        SHA256(blob->publicDer, blob->publicDerLength, tmp);
+    } else {
+        memset(tmp, 0, SHA256_DIGEST_LENGTH);
+    }
+    tmp += SHA256_DIGEST_LENGTH;
+    write_u32(tmp, blob->publicDerLength);
+    tmp += sizeof(uint32_t);
+    if (blob->publicDerLength > 0) {
+        memcpy(tmp, blob->publicDer, blob->publicDerLength);
+        tmp += blob->publicDerLength;
+    }
+    if (blob->flags & KEYBLOB_FLAG_WRAPPED) {
+        write_u32(tmp, blob->wrappedLength);
+        tmp += sizeof(uint32_t);
+        memcpy(tmp, blob->wrapped, blob->wrappedLength);
+    }
+
+    *key_blob_length = handleBlob->length();
+    *key_blob = handleBlob->get();
+    ByteArray* unused __attribute__((unused)) = handleBlob.release();
+
+    return 0;
+}
+
+/** Writes the blob of a keypair whose objects live in the TEE. */
+static int keyblob_save_tee_key(const ByteArray* objId, uint32_t keyType, uint32_t keyBits,
+        const uint8_t* publicDer, size_t publicDerLength, CK_OBJECT_HANDLE publicHandle,
+        CK_OBJECT_HANDLE privateHandle, uint8_t** key_blob, size_t* key_blob_length) {
+    KeyBlob blob;
+    memset(&blob, 0, sizeof(blob));
+    blob.id = objId->get();
+    blob.keyType = keyType;
+    blob.keyBits = keyBits;
+    blob.publicHint = publicHandle;
+    blob.privateHint = privateHandle;
+    blob.publicDer = publicDer;
+    blob.publicDerLength = publicDerLength;
+    return keyblob_save(&blob, key_blob, key_blob_length);
+}
+
+/**
+ * Writes the blob of an RSA keypair. publicRsa may be NULL, in which case
+ * no public key material is stored and operations fall back to the TEE.
+ */
+static int keyblob_save_rsa(const ByteArray* objId, RSA* publicRsa,
+        CK_OBJECT_HANDLE publicHandle, CK_OBJECT_HANDLE privateHandle, uint8_t** key_blob,
+        size_t* key_blob_length) {
+    uint8_t* der = NULL;
+    size_t derLength = 0;
+    uint32_t modulusBits = 0;
+    if (publicRsa != NULL) {
+        modulusBits = BN_num_bits(publicRsa->n);
+        if (encode_rsa_public_der(publicRsa, &der, &derLength)) {
+            ALOGW("Saving key blob without public key");
+            der = NULL;
+            derLength = 0;
+        }
+    }
+    UniquePtr<uint8_t, Malloc_Free> derOwner(der);
+
+    return keyblob_save_tee_key(objId, TYPE_RSA, modulusBits, der, derLength, publicHandle,
+            privateHandle, key_blob, key_blob_length);
+}
+
+static int keyblob_parse(const uint8_t* keyBlob, const size_t keyBlobLength, KeyBlob* parsed) {
+    if (keyBlob == NULL) {
+        ALOGE("key blob was null");
+        return -1;
+    }
+
+    if (keyBlobLength < KEYBLOB_V1_LENGTH) {
+        ALOGE("key blob is not correct size");
+        return -1;
+    }
+
+    memset(parsed, 0, sizeof(*parsed));
+    parsed->version = read_u32(keyBlob);
+    parsed->id = keyBlob + sizeof(uint32_t);
+    parsed->keyType = TYPE_RSA;
+    parsed->publicHint = CK_INVALID_HANDLE;
+    parsed->privateHint = CK_INVALID_HANDLE;
+
+    if (parsed->version == KEY_VERSION_ID_ONLY) {
+        return 0;
+    }
+
+    if (parsed->version != KEY_VERSION) {
+        ALOGE("Invalid key version %d", parsed->version);
+        return -1;
+    }
+
+    size_t headerLength = KEYBLOB_V2_HEADER_LENGTH;
+    if (keyBlobLength < headerLength) {
+        ALOGE("key blob is not correct size");
+        return -1;
+    }
+
+    const uint8_t* p = keyBlob + KEYBLOB_V1_LENGTH;
+    parsed->keyType = read_u32(p);
+    p += sizeof(uint32_t);
+    parsed->flags = read_u32(p);
+    p += sizeof(uint32_t);
+    parsed->keyBits = read_u32(p);
+    p += sizeof(uint32_t);
+    parsed->publicHint = read_u32(p);
+    p += sizeof(uint32_t);
+    parsed->privateHint = read_u32(p);
+    p += sizeof(uint32_t);
+    const uint8_t* digest = p;
+    p += SHA256_DIGEST_LENGTH;
+    size_t derLength = read_u32(p);
+    p += sizeof(uint32_t);
+
+    if (parsed->keyType != TYPE_RSA && parsed->keyType != TYPE_EC) {
+        ALOGE("Invalid key type %d", parsed->keyType);
+        return -1;
+    }
+
+    if ((parsed->flags & ~KEYBLOB_FLAG_WRAPPED) != 0
+            || ((parsed->flags & KEYBLOB_FLAG_WRAPPED) && parsed->keyType != TYPE_EC)) {
+        ALOGE("Invalid key blob flags 0x%x", parsed->flags);
+        return -1;
+    }
+
+    size_t remaining = keyBlobLength - headerLength;
+    if (derLength > remaining) {
+        ALOGE("key blob is not correct size");
+        return -1;
+    }
+    remaining -= derLength;
+
+    if (parsed->flags & KEYBLOB_FLAG_WRAPPED) {
+        if (remaining < sizeof(uint32_t)
+                || read_u32(p + derLength) != remaining - sizeof(uint32_t)) {
+            ALOGE("key blob is not correct size");
+            return -1;
+        }
+        parsed->wrapped = p + derLength + sizeof(uint32_t);
+        parsed->wrappedLength = remaining - sizeof(uint32_t);
+    } else if (remaining != 0) {
+        ALOGE("key blob is not correct size");
+        return -1;
+    }
+
+    if (derLength > 0) {
+        uint8_t actual[SHA256_DIGEST_LENGTH];
+        SHA256(p, derLength, actual);
+        if (memcmp(actual, digest, SHA256_DIGEST_LENGTH) != 0) {
+            // The ID is still usable; just don't trust the public key.
+            ALOGW("Public key digest mismatch in key blob");
+        } else {
+            parsed->publicDer = p;
+            parsed->publicDerLength = derLength;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Parses the public key stored in a key blob. Returns NULL if there is
+ * none, in which case it has to be read from the TEE.
+ */
+static RSA* keyblob_public_rsa(const KeyBlob* blob) {
+    if (blob->publicDer == NULL || blob->keyType != TYPE_RSA) {
+        return NULL;
+    }
+
+    const unsigned char* tmp = blob->publicDer;
+    Unique_EVP_PKEY pkey(d2i_PUBKEY(NULL, &tmp, blob->publicDerLength));
+    if (pkey.get() == NULL || EVP_PKEY_type(pkey->type) != EVP_PKEY_RSA) {
+        logOpenSSLError("keyblob_public_rsa");
+        return NULL;
+    }
+
+    return EVP_PKEY_get1_RSA(pkey.get());
+}
+
+/**
+ * Parses the public key of an EC key blob. EC blobs always carry it, so
+ * NULL means the blob is damaged.
+ */
+static EC_KEY* keyblob_public_ec(const KeyBlob* blob) {
+    if (blob->publicDer == NULL || blob->keyType != TYPE_EC) {
+        ALOGE("EC key blob has no usable public key");
+        return NULL;
+    }
+
+    const unsigned char* tmp = blob->publicDer;
+    Unique_EVP_PKEY pkey(d2i_PUBKEY(NULL, &tmp, blob->publicDerLength));
+    if (pkey.get() == NULL || EVP_PKEY_type(pkey->type) != EVP_PKEY_EC) {
+        logOpenSSLError("keyblob_public_ec");
+        return NULL;
+    }
+
+    return EVP_PKEY_get1_EC_KEY(pkey.get());
+}
+
+static int find_single_object(const uint8_t* obj_id, const size_t obj_id_length,
+        CK_OBJECT_CLASS obj_class, const CryptoSession* session, ObjectHandle* object) {
+
+    // Note that the CKA_ID attribute is never written, so we can cast away const here.
+    void* obj_id_ptr = reinterpret_cast<void*>(const_cast<uint8_t*>(obj_id));
+    CK_ATTRIBUTE attributes[] = {
+            { CKA_ID,    obj_id_ptr, static_cast<CK_ULONG>(obj_id_length) },
+            { CKA_CLASS, &obj_class, sizeof(obj_class) },
+    };
+
+    CK_RV rv = TEE_CALL(C_FindObjectsInit, session->get(), attributes,
+            sizeof(attributes) / sizeof(CK_ATTRIBUTE));
+    if (rv != CKR_OK) {
+        ALOGE("Error in C_FindObjectsInit: 0x%x", rv);
+        return -1;
+    }
+
+    CK_OBJECT_HANDLE tmpHandle;
+    CK_ULONG tmpCount;
+
+    rv = TEE_CALL(C_FindObjects, session->get(), &tmpHandle, 1, &tmpCount);
+    ALOGV("Found %d object 0x%x : class 0x%x", tmpCount, tmpHandle, obj_class);
+    if (rv != CKR_OK || tmpCount != 1) {
+        TEE_CALL(C_FindObjectsFinal, session->get());
+        ALOGE("Couldn't find key!");
+        return -1;
+    }
+    TEE_CALL(C_FindObjectsFinal, session->get());
+
+    object->reset(tmpHandle);
+    return 0;
+}
+
+static int keyblob_get_id(const uint8_t* keyBlob, const size_t keyBlobLength,
+        const uint8_t** id) {
+    KeyBlob blob;
+    if (keyblob_parse(keyBlob, keyBlobLength, &blob)) {
+        return -1;
+    }
+
+    *id = blob.id;
+    return 0;
+}
+
+/**
+ * Checks that a handle stored in a key blob still refers to the object it
+ * was written for.
+ */
+static bool handle_matches(const CryptoSession* session, CK_OBJECT_HANDLE handle,
+        const uint8_t* id, CK_OBJECT_CLASS objClass) {
+    if (handle == CK_INVALID_HANDLE) {
+        return false;
+    }
+
+    uint8_t actualId[ID_LENGTH];
+    CK_OBJECT_CLASS actualClass;
+    CK_ATTRIBUTE attributes[] = {
+            { CKA_ID,    actualId,     sizeof(actualId) },
+            { CKA_CLASS, &actualClass, sizeof(actualClass) },
+    };
+
+    CK_RV rv = TEE_CALL(C_GetAttributeValue, session->get(), handle, attributes,
+            sizeof(attributes) / sizeof(CK_ATTRIBUTE));
+    return rv == CKR_OK && attributes[0].ulValueLen == ID_LENGTH
+            && memcmp(actualId, id, ID_LENGTH) == 0 && actualClass == objClass;
+}
+
+static int keyblob_restore(const CryptoSession* session, const uint8_t* keyBlob,
+        const size_t keyBlobLength, ObjectHandle* public_key, ObjectHandle* private_key) {
+    const uint8_t* id;
+    if (keyblob_get_id(keyBlob, keyBlobLength, &id)) {
+        return -1;
+    }
+
+    return find_single_object(id, ID_LENGTH, CKO_PUBLIC_KEY, session, public_key)
+            || find_single_object(id, ID_LENGTH, CKO_PRIVATE_KEY, session, private_key);
+}
+
+/**
+ * Reads the modulus and public exponent of a public key object out of the
+ * TEE and builds an OpenSSL RSA key from them.
+ */
+static RSA* fetch_public_rsa(CryptoSession* session, CK_OBJECT_HANDLE publicKey) {
+    CK_ATTRIBUTE attributes[] = {
+            {CKA_MODULUS,         NULL, 0},
+            {CKA_PUBLIC_EXPONENT, NULL, 0},
+    };
+
+    // Call first to get the sizes of the values.
+    CK_RV rv = session->check(TEE_CALL(C_GetAttributeValue, session->get(), publicKey, attributes,
+            sizeof(attributes)/sizeof(CK_ATTRIBUTE)));
+    if (rv != CKR_OK) {
+        ALOGW("Could not query attribute value sizes: 0x%02x", rv);
+        return NULL;
+    }
+
+    AttributeArena arena(AttributeArena::sizeFor(attributes[0].ulValueLen)
+            + AttributeArena::sizeFor(attributes[1].ulValueLen));
+    attributes[0].pValue = arena.alloc(attributes[0].ulValueLen);
+    attributes[1].pValue = arena.alloc(attributes[1].ulValueLen);
+    if (attributes[0].pValue == NULL || attributes[1].pValue == NULL) {
+        return NULL;
+    }
+    const size_t modulusCapacity = attributes[0].ulValueLen;
+    const size_t exponentCapacity = attributes[1].ulValueLen;
+
+    rv = session->check(TEE_CALL(C_GetAttributeValue, session->get(), publicKey, attributes,
+            sizeof(attributes) / sizeof(CK_ATTRIBUTE)));
+    if (rv != CKR_OK) {
+        ALOGW("Could not query attribute values: 0x%02x", rv);
+        return NULL;
+    }
+
+    /*
+     * Work around a bug in the implementation. The first call to measure how large the array
+     * should be sometimes returns values that are too large. The call to get the actual value
+     * returns the correct length of the array, so use that instead.
+     */
+    ALOGV("modulus is %zu (ret=%u), exponent is %zu (ret=%u)",
+            modulusCapacity, attributes[0].ulValueLen,
+            exponentCapacity, attributes[1].ulValueLen);
+
+    Unique_RSA rsa(RSA_new());
+    if (rsa.get() == NULL) {
+        ALOGE("Could not allocate RSA structure");
+        return NULL;
+    }
+
+    rsa->n = BN_bin2bn(static_cast<const unsigned char*>(attributes[0].pValue),
+            attributes[0].ulValueLen, NULL);
+    if (rsa->n == NULL) {
+        logOpenSSLError("fetch_public_rsa");
+        return NULL;
+    }
+
+    rsa->e = BN_bin2bn(static_cast<const unsigned char*>(attributes[1].pValue),
+            attributes[1].ulValueLen, NULL);
+    if (rsa->e == NULL) {
+        logOpenSSLError("fetch_public_rsa");
+        return NULL;
+    }
+
+    return rsa.release();
+}
+
+/**
+ * The object handles for a key blob for the duration of one operation,
+ * either borrowed from the context's KeyHandleCache or looked up in the
+ * TEE and then offered to it.
+ */
+class KeyHandles {
+public:
+    KeyHandles(TeeContext* context, const CryptoSession* session) :
+            mCache(&context->keyCache), mSession(session), mSlot(-1), mBorrowed(false),
+            mPublicKey(session), mPrivateKey(session),
+            mCachedPublicKey(CK_INVALID_HANDLE), mCachedPrivateKey(CK_INVALID_HANDLE),
+            mPublicRsa(NULL) {
+    }
+
+    ~KeyHandles() {
+        if (mSlot >= 0) {
+            mCache->release(mSlot);
+        }
+    }
+
+    int restore(const uint8_t* keyBlob, const size_t keyBlobLength) {
+        KeyBlob blob;
+        if (keyblob_parse(keyBlob, keyBlobLength, &blob)) {
+            return -1;
+        }
+        memcpy(mId, blob.id, ID_LENGTH);
+
+        mSlot = mCache->acquire(mId, &mCachedPublicKey, &mCachedPrivateKey);
+        if (mSlot >= 0) {
+            return 0;
+        }
+
+        /*
+         * The handles recorded in the blob are only trusted once the TEE
+         * confirms they still name this key. A hinted handle is owned by a
+         * cache entry that is being invalidated or evicted, so it is
+         * borrowed and never closed here or offered to the cache again.
+         */
+        if (handle_matches(mSession, blob.publicHint, mId, CKO_PUBLIC_KEY)
+                && handle_matches(mSession, blob.privateHint, mId, CKO_PRIVATE_KEY)) {
+            mCachedPublicKey = blob.publicHint;
+            mCachedPrivateKey = blob.privateHint;
+            mBorrowed = true;
+            return 0;
+        }
+        if (find_single_object(mId, ID_LENGTH, CKO_PUBLIC_KEY, mSession, &mPublicKey)
+                || find_single_object(mId, ID_LENGTH, CKO_PRIVATE_KEY, mSession, &mPrivateKey)) {
+            return -1;
+        }
+
+        mSlot = mCache->insert(mId, mPublicKey.get(), mPrivateKey.get());
+        if (mSlot >= 0) {
+            mCachedPublicKey = mPublicKey.release();
+            mCachedPrivateKey = mPrivateKey.release();
+        }
+        return 0;
+    }
+
+    CK_OBJECT_HANDLE publicKey() const {
+        return (mSlot >= 0 || mBorrowed) ? mCachedPublicKey : mPublicKey.get();
+    }
+
+    CK_OBJECT_HANDLE privateKey() const {
+        return (mSlot >= 0 || mBorrowed) ? mCachedPrivateKey : mPrivateKey.get();
+    }
+
+    /**
+     * Returns the parsed public key, reading it out of the TEE only the
+     * first time while the key stays cached. Owned by this object or the
+     * cache; valid for this object's lifetime.
+     */
+    RSA* publicRsa(CryptoSession* session) {
+        if (mPublicRsa.get() != NULL) {
+            return mPublicRsa.get();
+        }
+        if (mSlot >= 0) {
+            RSA* cached = mCache->getPublicRsa(mSlot);
+            if (cached != NULL) {
+                return cached;
+            }
+        }
+
+        Unique_RSA rsa(fetch_public_rsa(session, publicKey()));
+        if (rsa.get() == NULL) {
+            return NULL;
+        }
+        if (mSlot >= 0) {
+            return mCache->setPublicRsa(mSlot, rsa.release());
+        }
+        mPublicRsa.reset(rsa.release());
+        return mPublicRsa.get();
+    }
+
+    bool copyPublicDer(uint8_t** der, size_t* derLength) {
+        return mSlot >= 0 && mCache->copyPublicDer(mSlot, der, derLength);
+    }
+
+    void setPublicDer(const uint8_t* der, size_t derLength) {
+        if (mSlot >= 0) {
+            mCache->setPublicDer(mSlot, der, derLength);
+        }
+    }
+
+private:
+    KeyHandleCache* mCache;
+    const CryptoSession* mSession;
+    int mSlot;                      // pinned cache entry, or -1
+    bool mBorrowed;
+    uint8_t mId[ID_LENGTH];
+    ObjectHandle mPublicKey;
+    ObjectHandle mPrivateKey;
+    CK_OBJECT_HANDLE mCachedPublicKey;
+    CK_OBJECT_HANDLE mCachedPrivateKey;
+    Unique_RSA mPublicRsa;
+};
+
+/**
+ * Generates an RSA keypair in the TEE with both objects tagged with the
+ * given CKA_ID. The new objects' handles are stored in publicKey and
+ * privateKey.
+ */
+static int generate_rsa_keypair(CryptoSession* session, const ByteArray* objId,
+        CK_ULONG modulusBits, uint64_t exp, ObjectHandle* publicKey, ObjectHandle* privateKey) {
+    CK_BBOOL bTRUE = CK_TRUE;
+
+    CK_MECHANISM mechanism = {
+            CKM_RSA_PKCS_KEY_PAIR_GEN, NULL, 0,
+    };
+
+    /**
+     * Convert our unsigned 64-bit integer to the TEE Big Integer class. It's
+     * an unsigned array of bytes with MSB first.
+     */
+    CK_BYTE publicExponent[sizeof(uint64_t)];
+    size_t offset = sizeof(publicExponent) - 1;
+    for (size_t i = 0; i < sizeof(publicExponent); i++) {
+        publicExponent[offset--] = (exp >> (i * CHAR_BIT)) & 0xFF;
+    }
+
+    CK_ATTRIBUTE publicKeyTemplate[] = {
+            {CKA_ID,              objId->get(),   static_cast<CK_ULONG>(objId->length())},
+            {CKA_TOKEN,           &bTRUE,         sizeof(bTRUE)},
+            {CKA_ENCRYPT,         &bTRUE,         sizeof(bTRUE)},
+            {CKA_VERIFY,          &bTRUE,         sizeof(bTRUE)},
             {CKA_MODULUS_BITS,    &modulusBits,   sizeof(modulusBits)},
             {CKA_PUBLIC_EXPONENT, publicExponent, sizeof(publicExponent)},
     };
 
-    CK_ATTRIBUTE privateKeyTemplate[] = {
-            {CKA_ID,              objId->get(),   objId->length()},
-            {CKA_TOKEN,           &bTRUE,         sizeof(bTRUE)},
-            {CKA_DECRYPT,         &bTRUE,         sizeof(bTRUE)},
-            {CKA_SIGN,            &bTRUE,         sizeof(bTRUE)},
-    };
+    CK_ATTRIBUTE privateKeyTemplate[] = {
+            {CKA_ID,              objId->get(),   static_cast<CK_ULONG>(objId->length())},
+            {CKA_TOKEN,           &bTRUE,         sizeof(bTRUE)},
+            {CKA_DECRYPT,         &bTRUE,         sizeof(bTRUE)},
+            {CKA_SIGN,            &bTRUE,         sizeof(bTRUE)},
+    };
+
+    CK_OBJECT_HANDLE hPublicKey, hPrivateKey;
+    CK_RV rv = session->check(TEE_CALL(C_GenerateKeyPair, session->get(),
+            &mechanism,
+            publicKeyTemplate,
+            sizeof(publicKeyTemplate)/sizeof(CK_ATTRIBUTE),
+            privateKeyTemplate,
+            sizeof(privateKeyTemplate)/sizeof(CK_ATTRIBUTE),
+            &hPublicKey,
+            &hPrivateKey));
+
+    if (rv != CKR_OK) {
+        ALOGE("Generate keypair failed: 0x%x", rv);
+        return -1;
+    }
+
+    publicKey->reset(hPublicKey);
+    privateKey->reset(hPrivateKey);
+    ALOGV("public handle = 0x%x, private handle = 0x%x", hPublicKey, hPrivateKey);
+
+    return 0;
+}
+
+/**
+ * Copies both halves of the keypair tagged with one CKA_ID to a new ID and
+ * destroys the originals, so a pregenerated key looks freshly generated.
+ */
+static int rename_keypair(CryptoSession* session, const uint8_t* oldId, const ByteArray* newId,
+        ObjectHandle* publicKey, ObjectHandle* privateKey) {
+    ObjectHandle oldPublic(session);
+    ObjectHandle oldPrivate(session);
+    if (find_single_object(oldId, ID_LENGTH, CKO_PUBLIC_KEY, session, &oldPublic)
+            || find_single_object(oldId, ID_LENGTH, CKO_PRIVATE_KEY, session, &oldPrivate)) {
+        return -1;
+    }
+
+    CK_ATTRIBUTE idTemplate[] = {
+            {CKA_ID, newId->get(), static_cast<CK_ULONG>(newId->length())},
+    };
+
+    CK_OBJECT_HANDLE hPublicKey, hPrivateKey;
+    CK_RV rv = session->check(TEE_CALL(C_CopyObject, session->get(), oldPublic.get(), idTemplate,
+            sizeof(idTemplate) / sizeof(CK_ATTRIBUTE), &hPublicKey));
+    if (rv != CKR_OK) {
+        ALOGW("Could not copy public key: 0x%x", rv);
+        return -1;
+    }
+    ObjectHandle newPublic(session, hPublicKey);
+
+    rv = session->check(TEE_CALL(C_CopyObject, session->get(), oldPrivate.get(), idTemplate,
+            sizeof(idTemplate) / sizeof(CK_ATTRIBUTE), &hPrivateKey));
+    if (rv != CKR_OK) {
+        ALOGW("Could not copy private key: 0x%x", rv);
+        TEE_CALL(C_DestroyObject, session->get(), newPublic.get());
+        return -1;
+    }
+
+    TEE_CALL(C_DestroyObject, session->get(), oldPrivate.get());
+    TEE_CALL(C_DestroyObject, session->get(), oldPublic.get());
+
+    publicKey->reset(newPublic.release());
+    privateKey->reset(hPrivateKey);
+    return 0;
+}
+
+/**
+ * Opt-in pool of RSA keypairs generated ahead of time. A 2048-bit keygen in
+ * the TEE takes seconds; with persist.keymaster.pregen set to N (at most
+ * PREGEN_MAX_KEYS) a low priority thread keeps N keypairs of the common
+ * 2048-bit, e=65537 shape ready while the device is charging, and matching
+ * generate_keypair requests are served by renaming one to a fresh random
+ * ID.
+ *
+ * Pool keys live on the token under fixed slot IDs, so keys generated
+ * before a restart are picked up again instead of leaking.
+ */
+class KeyPregenerator {
+public:
+    KeyPregenerator(CK_SESSION_HANDLE primary, SessionPool* subsessions, TeeCallStats* stats) :
+            mPrimary(primary), mSubsessions(subsessions), mStats(stats), mTarget(0),
+            mPauses(0), mRunning(false), mStop(false) {
+        pthread_mutex_init(&mLock, NULL);
+        pthread_cond_init(&mCond, NULL);
+        pthread_cond_init(&mStopped, NULL);
+        clearSlots();
+    }
+
+    ~KeyPregenerator() {
+        pthread_mutex_lock(&mLock);
+        stopLocked();
+        pthread_mutex_unlock(&mLock);
+        pthread_cond_destroy(&mStopped);
+        pthread_cond_destroy(&mCond);
+        pthread_mutex_destroy(&mLock);
+    }
+
+    void start(int target) {
+        if (target <= 0) {
+            return;
+        }
+        pthread_mutex_lock(&mLock);
+        mTarget = target > PREGEN_MAX_KEYS ? PREGEN_MAX_KEYS : target;
+        if (mPauses == 0) {
+            startLocked();
+        }
+        pthread_mutex_unlock(&mLock);
+    }
+
+    /**
+     * Stops the thread around a wipe of the token and starts it again with
+     * an empty pool once every pause() has been matched by a resume().
+     * Nothing is handed out in between.
+     */
+    void pause() {
+        pthread_mutex_lock(&mLock);
+        mPauses++;
+        stopLocked();
+        pthread_mutex_unlock(&mLock);
+    }
+
+    void resume() {
+        pthread_mutex_lock(&mLock);
+        if (mPauses > 0 && --mPauses == 0) {
+            clearSlots();
+            startLocked();
+        }
+        pthread_mutex_unlock(&mLock);
+    }
+
+    static bool matches(CK_ULONG modulusBits, uint64_t exponent) {
+        return modulusBits == PREGEN_MODULUS_BITS && exponent == PREGEN_EXPONENT;
+    }
+
+    /**
+     * Hands out a pregenerated keypair under newId. Returns -1 if none is
+     * ready, in which case the caller generates one inline.
+     */
+    int take(CryptoSession* session, const ByteArray* newId, ObjectHandle* publicKey,
+            ObjectHandle* privateKey) {
+        pthread_mutex_lock(&mLock);
+        int slot = -1;
+        for (int i = 0; i < mTarget && mPauses == 0; i++) {
+            if (mSlots[i] == SLOT_READY) {
+                mSlots[i] = SLOT_TAKEN;
+                slot = i;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&mLock);
+        if (slot < 0) {
+            return -1;
+        }
+
+        uint8_t slotId[ID_LENGTH];
+        slot_id(slot, slotId);
+        int result = rename_keypair(session, slotId, newId, publicKey, privateKey);
+
+        // The slot ID stays in use until the rename is over.
+        pthread_mutex_lock(&mLock);
+        mSlots[slot] = result == 0 ? SLOT_EMPTY : SLOT_READY;
+        pthread_cond_signal(&mCond);
+        pthread_mutex_unlock(&mLock);
+
+        ALOGV("Served key from pregeneration slot %d: %d", slot, result);
+        return result;
+    }
+
+private:
+    /**
+     * A slot's keypair is only touched by the thread that moved it out of
+     * SLOT_EMPTY or SLOT_READY, until it moves it on.
+     */
+    enum SlotState {
+        SLOT_EMPTY,
+        SLOT_FILLING,       // being generated by run()
+        SLOT_READY,
+        SLOT_TAKEN,         // being renamed by take()
+    };
+
+    /** Called with mLock held. Does nothing if pregeneration is off or running. */
+    void startLocked() {
+        if (mTarget <= 0 || mRunning) {
+            return;
+        }
+
+        // Detached, so stopLocked() can wait for it under mLock instead of joining.
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        pthread_t thread;
+        mStop = false;
+        if (pthread_create(&thread, &attr, threadMain, this) == 0) {
+            mRunning = true;
+        } else {
+            ALOGW("Could not start key pregeneration thread");
+        }
+        pthread_attr_destroy(&attr);
+    }
+
+    /** Called with mLock held; returns once the thread has left run(). */
+    void stopLocked() {
+        mStop = true;
+        pthread_cond_signal(&mCond);
+        while (mRunning) {
+            pthread_cond_wait(&mStopped, &mLock);
+        }
+    }
+
+    void clearSlots() {
+        for (int i = 0; i < PREGEN_MAX_KEYS; i++) {
+            mSlots[i] = SLOT_EMPTY;
+        }
+    }
+
+    static void slot_id(int slot, uint8_t* id) {
+        static const char prefix[] = "TEEKeyMaster pregenerated key";
+        memset(id, 0, ID_LENGTH);
+        memcpy(id, prefix, sizeof(prefix) - 1);
+        id[ID_LENGTH - 1] = static_cast<uint8_t>(slot);
+    }
+
+    static bool charging() {
+        static const char* const supplies[] = {
+                "/sys/class/power_supply/ac/online",
+                "/sys/class/power_supply/usb/online",
+        };
+        for (size_t i = 0; i < sizeof(supplies) / sizeof(supplies[0]); i++) {
+            char value = '0';
+            int fd = open(supplies[i], O_RDONLY);
+            if (fd >= 0) {
+                if (read(fd, &value, 1) != 1) {
+                    value = '0';
+                }
+                close(fd);
+            }
+            if (value == '1') {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /** Picks up slot keys left on the token by an earlier process. */
+    void adopt() {
+        TeeOperation operation(mStats, TEE_OP_PREGENERATE);
+        CryptoSession session(mPrimary, mSubsessions);
+        for (int i = 0; i < mTarget; i++) {
+            uint8_t id[ID_LENGTH];
+            slot_id(i, id);
+            ObjectHandle publicKey(&session);
+            ObjectHandle privateKey(&session);
+            bool hasPublic = !find_single_object(id, ID_LENGTH, CKO_PUBLIC_KEY, &session,
+                    &publicKey);
+            bool hasPrivate = !find_single_object(id, ID_LENGTH, CKO_PRIVATE_KEY, &session,
+                    &privateKey);
+            if (hasPublic && hasPrivate) {
+                pthread_mutex_lock(&mLock);
+                mSlots[i] = SLOT_READY;
+                pthread_mutex_unlock(&mLock);
+            } else if (hasPublic) {
+                TEE_CALL(C_DestroyObject, session.get(), publicKey.get());
+            } else if (hasPrivate) {
+                TEE_CALL(C_DestroyObject, session.get(), privateKey.get());
+            }
+        }
+    }
+
+    void run() {
+        // Linux applies this to the calling thread only.
+        setpriority(PRIO_PROCESS, 0, PREGEN_NICE);
+
+        adopt();
+
+        pthread_mutex_lock(&mLock);
+        while (!mStop) {
+            int slot = -1;
+            for (int i = 0; i < mTarget; i++) {
+                if (mSlots[i] == SLOT_EMPTY) {
+                    slot = i;
+                    break;
+                }
+            }
+
+            if (slot < 0 || !charging()) {
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += PREGEN_POLL_SECONDS;
+                pthread_cond_timedwait(&mCond, &mLock, &deadline);
+                continue;
+            }
+            mSlots[slot] = SLOT_FILLING;
+            pthread_mutex_unlock(&mLock);
+
+            ByteArray id(ID_LENGTH);
+            slot_id(slot, id.get());
+            int result;
+            {
+                TeeOperation operation(mStats, TEE_OP_PREGENERATE);
+                CryptoSession session(mPrimary, mSubsessions);
+                ObjectHandle publicKey(&session);
+                ObjectHandle privateKey(&session);
+                result = generate_rsa_keypair(&session, &id, PREGEN_MODULUS_BITS,
+                        PREGEN_EXPONENT, &publicKey, &privateKey);
+            }
+            ALOGV("Pregenerated key for slot %d: %d", slot, result);
+
+            pthread_mutex_lock(&mLock);
+            mSlots[slot] = result == 0 ? SLOT_READY : SLOT_EMPTY;
+            if (result != 0 && !mStop) {
+                // Don't spin on a TEE that keeps failing.
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += PREGEN_POLL_SECONDS;
+                pthread_cond_timedwait(&mCond, &mLock, &deadline);
+            }
+        }
+        mRunning = false;
+        pthread_cond_broadcast(&mStopped);
+        pthread_mutex_unlock(&mLock);
+    }
+
+    static void* threadMain(void* arg) {
+        static_cast<KeyPregenerator*>(arg)->run();
+        return NULL;
+    }
+
+    CK_SESSION_HANDLE mPrimary;
+    SessionPool* mSubsessions;
+    TeeCallStats* mStats;
+    int mTarget;
+    SlotState mSlots[PREGEN_MAX_KEYS];
+    int mPauses;
+    bool mRunning;
+    bool mStop;
+    pthread_mutex_t mLock;
+    pthread_cond_t mCond;
+    pthread_cond_t mStopped;
+};
+
+/**
+ * Hands the handles of a key that was just created to the cache, since it
+ * is usually used right away. They are closed as usual if it is full.
+ */
+static void keep_new_key(TeeContext* context, const ByteArray* objId, ObjectHandle* publicKey,
+        ObjectHandle* privateKey) {
+    int slot = context->keyCache.insert(objId->get(), publicKey->get(), privateKey->get());
+    if (slot >= 0) {
+        publicKey->release();
+        privateKey->release();
+        context->keyCache.release(slot);
+    }
+}
+
+/*
+ * P-256 keys. Where the TEE implements CKM_EC_KEY_PAIR_GEN and CKM_ECDSA
+ * they are ordinary TEE keypairs. Where it doesn't, they are generated by
+ * OpenSSL and only wrapped by the TEE: the private key is stored in the
+ * blob, AES-CBC encrypted under a TEE-held key that never leaves it and
+ * followed by an HMAC-SHA256 under a second one, and is decrypted into
+ * this process for every signature. Such blobs carry KEYBLOB_FLAG_WRAPPED
+ * and are logged as software keys when created, and the device doesn't
+ * claim KEYMASTER_SUPPORTS_EC, so keystore doesn't report EC keys as
+ * hardware-backed.
+ */
+
+/** DER of the P-256 curve OID, the CKA_EC_PARAMS of every EC key. */
+static const uint8_t P256_EC_PARAMS[] = {
+        0x06, 0x08, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x03, 0x01, 0x07,
+};
+
+/** CKA_ID of the AES key that wraps software EC keys. */
+static const uint8_t WRAP_KEY_ID[] = "TEEKeyMaster EC wrapping key";
+
+/** CKA_ID of the HMAC key that authenticates wrapped EC keys. */
+static const uint8_t WRAP_MAC_KEY_ID[] = "TEEKeyMaster EC wrapping MAC key";
+
+/**
+ * Whether EC keys are kept in software because the TEE has no P-256. The
+ * TEE can't be asked directly, so this is decided by a throwaway keygen
+ * when the device is opened, or else by the first EC keygen: only
+ * CKR_MECHANISM_INVALID from C_GenerateKeyPair switches it on, for the
+ * rest of the process. Any other failure fails just that call.
+ */
+static bool ec_in_software(TeeContext* context) {
+    return __sync_fetch_and_or(&context->ecInSoftware, 0) != 0;
+}
+
+static void set_ec_in_software(TeeContext* context, CK_RV rv) {
+    if (__sync_bool_compare_and_swap(&context->ecInSoftware, 0, 1)) {
+        ALOGW("TEE has no P-256 keys (0x%x); EC keys will be software-wrapped", rv);
+    }
+}
+
+/**
+ * Builds a public P-256 key from an uncompressed point as read from
+ * CKA_EC_POINT: DER-wrapped in an OCTET STRING as PKCS#11 says, or bare
+ * as some tokens return it.
+ */
+static EC_KEY* ec_key_from_point(const uint8_t* point, size_t pointLength) {
+    if (pointLength == EC_POINT_LENGTH + 2 && point[0] == 0x04 && point[1] == EC_POINT_LENGTH) {
+        point += 2;
+        pointLength -= 2;
+    }
+
+    Unique_EC_KEY key(EC_KEY_new_by_curve_name(NID_X9_62_prime256v1));
+    if (key.get() == NULL) {
+        logOpenSSLError("ec_key_from_point");
+        return NULL;
+    }
+
+    const EC_GROUP* group = EC_KEY_get0_group(key.get());
+    Unique_EC_POINT publicPoint(EC_POINT_new(group));
+    if (publicPoint.get() == NULL
+            || EC_POINT_oct2point(group, publicPoint.get(), point, pointLength, NULL) != 1
+            || EC_KEY_set_public_key(key.get(), publicPoint.get()) != 1) {
+        logOpenSSLError("ec_key_from_point");
+        return NULL;
+    }
+
+    return key.release();
+}
+
+static EC_KEY* fetch_public_ec(CryptoSession* session, CK_OBJECT_HANDLE publicKey) {
+    uint8_t point[EC_POINT_LENGTH + 2];
+    CK_ATTRIBUTE attributes[] = {
+            {CKA_EC_POINT, point, sizeof(point)},
+    };
+
+    CK_RV rv = session->check(TEE_CALL(C_GetAttributeValue, session->get(), publicKey,
+            attributes, sizeof(attributes) / sizeof(CK_ATTRIBUTE)));
+    if (rv != CKR_OK) {
+        ALOGW("Could not read EC point: 0x%x", rv);
+        return NULL;
+    }
+
+    return ec_key_from_point(point, attributes[0].ulValueLen);
+}
+
+/** Generates a P-256 keypair in the TEE; returns the TEE's result. */
+static CK_RV generate_ec_keypair(CryptoSession* session, const ByteArray* objId,
+        ObjectHandle* publicKey, ObjectHandle* privateKey) {
+    CK_BBOOL bTRUE = CK_TRUE;
+    void* ecParams = const_cast<uint8_t*>(P256_EC_PARAMS);
+
+    CK_MECHANISM mechanism = {
+            CKM_EC_KEY_PAIR_GEN, NULL, 0,
+    };
+
+    CK_ATTRIBUTE publicKeyTemplate[] = {
+            {CKA_ID,        objId->get(), static_cast<CK_ULONG>(objId->length())},
+            {CKA_TOKEN,     &bTRUE,       sizeof(bTRUE)},
+            {CKA_VERIFY,    &bTRUE,       sizeof(bTRUE)},
+            {CKA_EC_PARAMS, ecParams,     sizeof(P256_EC_PARAMS)},
+    };
+
+    CK_ATTRIBUTE privateKeyTemplate[] = {
+            {CKA_ID,        objId->get(), static_cast<CK_ULONG>(objId->length())},
+            {CKA_TOKEN,     &bTRUE,       sizeof(bTRUE)},
+            {CKA_SIGN,      &bTRUE,       sizeof(bTRUE)},
+    };
+
+    CK_OBJECT_HANDLE hPublicKey, hPrivateKey;
+    CK_RV rv = session->check(TEE_CALL(C_GenerateKeyPair, session->get(),
+            &mechanism,
+            publicKeyTemplate,
+            sizeof(publicKeyTemplate)/sizeof(CK_ATTRIBUTE),
+            privateKeyTemplate,
+            sizeof(privateKeyTemplate)/sizeof(CK_ATTRIBUTE),
+            &hPublicKey,
+            &hPrivateKey));
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    publicKey->reset(hPublicKey);
+    privateKey->reset(hPrivateKey);
+    ALOGV("public handle = 0x%x, private handle = 0x%x", hPublicKey, hPrivateKey);
+    return CKR_OK;
+}
+
+/** Creates TEE objects for an existing P-256 keypair; returns the TEE's result. */
+static CK_RV create_ec_objects(CryptoSession* session, const ByteArray* objId, EC_KEY* key,
+        ObjectHandle* publicKey, ObjectHandle* privateKey) {
+    CK_BBOOL bTRUE = CK_TRUE;
+    CK_KEY_TYPE ecType = CKK_EC;
+    CK_OBJECT_CLASS pubClass = CKO_PUBLIC_KEY;
+    CK_OBJECT_CLASS privClass = CKO_PRIVATE_KEY;
+    void* ecParams = const_cast<uint8_t*>(P256_EC_PARAMS);
+
+    uint8_t point[EC_POINT_LENGTH + 2] = { 0x04, EC_POINT_LENGTH };
+    if (EC_POINT_point2oct(EC_KEY_get0_group(key), EC_KEY_get0_public_key(key),
+            POINT_CONVERSION_UNCOMPRESSED, point + 2, EC_POINT_LENGTH, NULL)
+            != EC_POINT_LENGTH) {
+        logOpenSSLError("create_ec_objects");
+        return CKR_ATTRIBUTE_VALUE_INVALID;
+    }
+
+    AttributeArena arena(AttributeArena::sizeFor(EC_FIELD_BYTES));
+    CK_ATTRIBUTE value;
+    if (bignum_to_attribute(&arena, &value, CKA_VALUE, EC_KEY_get0_private_key(key))) {
+        ALOGW("Could not convert EC private key");
+        return CKR_ATTRIBUTE_VALUE_INVALID;
+    }
+
+    CK_ATTRIBUTE publicKeyTemplate[] = {
+            {CKA_ID,        objId->get(), static_cast<CK_ULONG>(objId->length())},
+            {CKA_TOKEN,     &bTRUE,       sizeof(bTRUE)},
+            {CKA_CLASS,     &pubClass,    sizeof(pubClass)},
+            {CKA_KEY_TYPE,  &ecType,      sizeof(ecType)},
+            {CKA_VERIFY,    &bTRUE,       sizeof(bTRUE)},
+            {CKA_EC_PARAMS, ecParams,     sizeof(P256_EC_PARAMS)},
+            {CKA_EC_POINT,  point,        sizeof(point)},
+    };
+
+    CK_ATTRIBUTE privateKeyTemplate[] = {
+            {CKA_ID,        objId->get(), static_cast<CK_ULONG>(objId->length())},
+            {CKA_TOKEN,     &bTRUE,       sizeof(bTRUE)},
+            {CKA_CLASS,     &privClass,   sizeof(privClass)},
+            {CKA_KEY_TYPE,  &ecType,      sizeof(ecType)},
+            {CKA_SIGN,      &bTRUE,       sizeof(bTRUE)},
+            {CKA_EC_PARAMS, ecParams,     sizeof(P256_EC_PARAMS)},
+            value,
+    };
+
+    CK_OBJECT_HANDLE hPublicKey;
+    CK_RV rv = session->check(TEE_CALL(C_CreateObject, session->get(), publicKeyTemplate,
+            sizeof(publicKeyTemplate) / sizeof(CK_ATTRIBUTE), &hPublicKey));
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    ObjectHandle newPublic(session, hPublicKey);
+
+    CK_OBJECT_HANDLE hPrivateKey;
+    rv = session->check(TEE_CALL(C_CreateObject, session->get(), privateKeyTemplate,
+            sizeof(privateKeyTemplate) / sizeof(CK_ATTRIBUTE), &hPrivateKey));
+    if (rv != CKR_OK) {
+        TEE_CALL(C_DestroyObject, session->get(), newPublic.get());
+        return rv;
+    }
+
+    publicKey->reset(newPublic.release());
+    privateKey->reset(hPrivateKey);
+    return CKR_OK;
+}
+
+/**
+ * Creates one of the wrapping keys: a non-extractable secret key of
+ * keyBytes, made with keyGen and allowed the two given uses.
+ */
+static int create_wrap_key(CryptoSession* session, const uint8_t* id, size_t idLength,
+        CK_MECHANISM_TYPE keyGen, CK_ULONG keyBytes, CK_ATTRIBUTE_TYPE use1,
+        CK_ATTRIBUTE_TYPE use2, ObjectHandle* wrapKey) {
+    CK_BBOOL bTRUE = CK_TRUE;
+    CK_BBOOL bFALSE = CK_FALSE;
+    CK_ULONG keyLength = keyBytes;
+
+    CK_MECHANISM mechanism = {
+            keyGen, NULL, 0,
+    };
+
+    CK_ATTRIBUTE keyTemplate[] = {
+            {CKA_ID,          const_cast<uint8_t*>(id), static_cast<CK_ULONG>(idLength)},
+            {CKA_TOKEN,       &bTRUE,     sizeof(bTRUE)},
+            {use1,            &bTRUE,     sizeof(bTRUE)},
+            {use2,            &bTRUE,     sizeof(bTRUE)},
+            {CKA_SENSITIVE,   &bTRUE,     sizeof(bTRUE)},
+            {CKA_EXTRACTABLE, &bFALSE,    sizeof(bFALSE)},
+            {CKA_VALUE_LEN,   &keyLength, sizeof(keyLength)},
+    };
+
+    CK_OBJECT_HANDLE handle;
+    CK_RV rv = session->check(TEE_CALL(C_GenerateKey, session->get(), &mechanism, keyTemplate,
+            sizeof(keyTemplate) / sizeof(CK_ATTRIBUTE), &handle));
+    if (rv != CKR_OK) {
+        ALOGE("Could not create %s: 0x%x", reinterpret_cast<const char*>(id), rv);
+        return -1;
+    }
+
+    ALOGI("Created %s", reinterpret_cast<const char*>(id));
+    wrapKey->reset(handle);
+    return 0;
+}
+
+/**
+ * Looks up the AES wrapping key and the HMAC key, creating whichever is
+ * missing, on first use. They stay open until forget_wrap_keys().
+ */
+static int get_wrap_keys(TeeContext* context, CryptoSession* session, CK_OBJECT_HANDLE* wrapKey,
+        CK_OBJECT_HANDLE* macKey) {
+    pthread_mutex_lock(&context->wrapLock);
+    if (context->wrapKey == CK_INVALID_HANDLE) {
+        ObjectHandle key(session);
+        if (find_single_object(WRAP_KEY_ID, sizeof(WRAP_KEY_ID), CKO_SECRET_KEY, session,
+                &key) == 0 || create_wrap_key(session, WRAP_KEY_ID, sizeof(WRAP_KEY_ID),
+                CKM_AES_KEY_GEN, WRAP_KEY_BYTES, CKA_ENCRYPT, CKA_DECRYPT, &key) == 0) {
+            context->wrapKey = key.release();
+        }
+    }
+    if (context->macKey == CK_INVALID_HANDLE) {
+        ObjectHandle key(session);
+        if (find_single_object(WRAP_MAC_KEY_ID, sizeof(WRAP_MAC_KEY_ID), CKO_SECRET_KEY,
+                session, &key) == 0 || create_wrap_key(session, WRAP_MAC_KEY_ID,
+                sizeof(WRAP_MAC_KEY_ID), CKM_GENERIC_SECRET_KEY_GEN, WRAP_MAC_KEY_BYTES,
+                CKA_SIGN, CKA_VERIFY, &key) == 0) {
+            context->macKey = key.release();
+        }
+    }
+    *wrapKey = context->wrapKey;
+    *macKey = context->macKey;
+    pthread_mutex_unlock(&context->wrapLock);
+    return *wrapKey != CK_INVALID_HANDLE && *macKey != CK_INVALID_HANDLE ? 0 : -1;
+}
+
+static void forget_wrap_keys(TeeContext* context) {
+    pthread_mutex_lock(&context->wrapLock);
+    if (context->wrapKey != CK_INVALID_HANDLE) {
+        TEE_CALL(C_CloseObjectHandle, context->primary, context->wrapKey);
+        context->wrapKey = CK_INVALID_HANDLE;
+    }
+    if (context->macKey != CK_INVALID_HANDLE) {
+        TEE_CALL(C_CloseObjectHandle, context->primary, context->macKey);
+        context->macKey = CK_INVALID_HANDLE;
+    }
+    pthread_mutex_unlock(&context->wrapLock);
+}
+
+/**
+ * Builds in a new malloc()ed buffer what a wrapped key's MAC covers: the
+ * key ID, the SHA-256 of the public key DER, then the IV and ciphertext.
+ * That binds the private key to the blob it was saved in.
+ */
+static uint8_t* wrap_mac_input(const uint8_t* id, const uint8_t* publicDer,
+        size_t publicDerLength, const uint8_t* encrypted, size_t encryptedLength,
+        size_t* inputLength) {
+    *inputLength = ID_LENGTH + SHA256_DIGEST_LENGTH + encryptedLength;
+    uint8_t* input = static_cast<uint8_t*>(malloc(*inputLength));
+    if (input == NULL) {
+        ALOGE("Could not allocate memory for wrapped key MAC");
+        return NULL;
+    }
+    memcpy(input, id, ID_LENGTH);
+    SHA256(publicDer, publicDerLength, input + ID_LENGTH);
+    memcpy(input + ID_LENGTH + SHA256_DIGEST_LENGTH, encrypted, encryptedLength);
+    return input;
+}
+
+/**
+ * Encrypts the ECPrivateKey DER of key under the wrapping key into a new
+ * malloc()ed buffer: a random IV, then AES-CBC of the DER with PKCS#7
+ * padding added here, as the TEE has no CKM_AES_CBC_PAD, then the MAC
+ * described at wrap_mac_input() for the blob with this ID and public key.
+ */
+static int wrap_ec_private(TeeContext* context, CryptoSession* session, const uint8_t* id,
+        const uint8_t* publicDer, size_t publicDerLength, EC_KEY* key, uint8_t** wrapped,
+        size_t* wrappedLength) {
+    CK_OBJECT_HANDLE wrapKey;
+    CK_OBJECT_HANDLE macKey;
+    if (get_wrap_keys(context, session, &wrapKey, &macKey)) {
+        return -1;
+    }
+
+    int derLength = i2d_ECPrivateKey(key, NULL);
+    if (derLength <= 0) {
+        logOpenSSLError("wrap_ec_private");
+        return -1;
+    }
+    size_t paddedLength = (derLength / WRAP_BLOCK_SIZE + 1) * WRAP_BLOCK_SIZE;
+
+    // The arena wipes the plaintext on the way out.
+    AttributeArena arena(AttributeArena::sizeFor(paddedLength));
+    uint8_t* padded = static_cast<uint8_t*>(arena.alloc(paddedLength));
+    if (padded == NULL) {
+        return -1;
+    }
+    unsigned char* tmp = padded;
+    if (i2d_ECPrivateKey(key, &tmp) != derLength) {
+        logOpenSSLError("wrap_ec_private");
+        return -1;
+    }
+    memset(padded + derLength, paddedLength - derLength, paddedLength - derLength);
+
+    size_t encryptedLength = WRAP_BLOCK_SIZE + paddedLength;
+    UniquePtr<uint8_t, Malloc_Free> buffer(
+            static_cast<uint8_t*>(malloc(encryptedLength + WRAP_MAC_LENGTH)));
+    if (buffer.get() == NULL) {
+        ALOGE("Could not allocate memory for wrapped key");
+        return -1;
+    }
+    if (RAND_bytes(buffer.get(), WRAP_BLOCK_SIZE) != 1) {
+        logOpenSSLError("wrap_ec_private");
+        return -1;
+    }
+
+    CK_MECHANISM mechanism = {
+            CKM_AES_CBC, buffer.get(), WRAP_BLOCK_SIZE,
+    };
+    CK_RV rv = session->check(TEE_CALL(C_EncryptInit, session->get(), &mechanism, wrapKey));
+    if (rv != CKR_OK) {
+        ALOGE("C_EncryptInit failed: 0x%x", rv);
+        return -1;
+    }
+
+    CK_ULONG cipherLength = paddedLength;
+    rv = session->check(TEE_CALL(C_Encrypt, session->get(), padded, paddedLength,
+            buffer.get() + WRAP_BLOCK_SIZE, &cipherLength));
+    if (rv != CKR_OK || cipherLength != paddedLength) {
+        ALOGE("C_Encrypt failed: 0x%x", rv);
+        return -1;
+    }
+
+    size_t macInputLength;
+    UniquePtr<uint8_t, Malloc_Free> macInput(wrap_mac_input(id, publicDer, publicDerLength,
+            buffer.get(), encryptedLength, &macInputLength));
+    if (macInput.get() == NULL) {
+        return -1;
+    }
+
+    CK_MECHANISM macMechanism = {
+            CKM_SHA256_HMAC, NULL, 0,
+    };
+    rv = session->check(TEE_CALL(C_SignInit, session->get(), &macMechanism, macKey));
+    if (rv != CKR_OK) {
+        ALOGE("C_SignInit failed: 0x%x", rv);
+        return -1;
+    }
+
+    CK_ULONG macLength = WRAP_MAC_LENGTH;
+    rv = session->check(TEE_CALL(C_Sign, session->get(), macInput.get(), macInputLength,
+            buffer.get() + encryptedLength, &macLength));
+    if (rv != CKR_OK || macLength != WRAP_MAC_LENGTH) {
+        ALOGE("C_Sign failed: 0x%x", rv);
+        return -1;
+    }
+
+    *wrappedLength = encryptedLength + WRAP_MAC_LENGTH;
+    *wrapped = buffer.release();
+    return 0;
+}
+
+/**
+ * Checks the MAC of a wrapped EC blob, decrypts its private key and checks
+ * that belongs to the public key stored next to it.
+ */
+static EC_KEY* unwrap_ec_private(TeeContext* context, CryptoSession* session,
+        const KeyBlob* blob) {
+    if (blob->wrappedLength < 2 * WRAP_BLOCK_SIZE + WRAP_MAC_LENGTH
+            || (blob->wrappedLength - WRAP_MAC_LENGTH) % WRAP_BLOCK_SIZE != 0
+            || blob->publicDerLength == 0) {
+        ALOGE("Wrapped EC key has bad length %zu", blob->wrappedLength);
+        return NULL;
+    }
+
+    Unique_EC_KEY publicKey(keyblob_public_ec(blob));
+    if (publicKey.get() == NULL) {
+        return NULL;
+    }
+
+    CK_OBJECT_HANDLE wrapKey;
+    CK_OBJECT_HANDLE macKey;
+    if (get_wrap_keys(context, session, &wrapKey, &macKey)) {
+        return NULL;
+    }
+
+    size_t encryptedLength = blob->wrappedLength - WRAP_MAC_LENGTH;
+    size_t macInputLength;
+    UniquePtr<uint8_t, Malloc_Free> macInput(wrap_mac_input(blob->id, blob->publicDer,
+            blob->publicDerLength, blob->wrapped, encryptedLength, &macInputLength));
+    if (macInput.get() == NULL) {
+        return NULL;
+    }
+
+    CK_MECHANISM macMechanism = {
+            CKM_SHA256_HMAC, NULL, 0,
+    };
+    CK_RV rv = session->check(TEE_CALL(C_VerifyInit, session->get(), &macMechanism, macKey));
+    if (rv != CKR_OK) {
+        ALOGE("C_VerifyInit failed: 0x%x", rv);
+        return NULL;
+    }
+
+    rv = session->check(TEE_CALL(C_Verify, session->get(), macInput.get(), macInputLength,
+            const_cast<uint8_t*>(blob->wrapped + encryptedLength), WRAP_MAC_LENGTH));
+    if (rv != CKR_OK) {
+        ALOGE("Wrapped EC key fails its MAC: 0x%x", rv);
+        return NULL;
+    }
+
+    size_t cipherLength = encryptedLength - WRAP_BLOCK_SIZE;
+    AttributeArena arena(AttributeArena::sizeFor(cipherLength));
+    uint8_t* padded = static_cast<uint8_t*>(arena.alloc(cipherLength));
+    if (padded == NULL) {
+        return NULL;
+    }
+
+    CK_MECHANISM mechanism = {
+            CKM_AES_CBC, const_cast<uint8_t*>(blob->wrapped), WRAP_BLOCK_SIZE,
+    };
+    rv = session->check(TEE_CALL(C_DecryptInit, session->get(), &mechanism, wrapKey));
+    if (rv != CKR_OK) {
+        ALOGE("C_DecryptInit failed: 0x%x", rv);
+        return NULL;
+    }
+
+    CK_ULONG plainLength = cipherLength;
+    rv = session->check(TEE_CALL(C_Decrypt, session->get(), blob->wrapped + WRAP_BLOCK_SIZE,
+            cipherLength, padded, &plainLength));
+    if (rv != CKR_OK || plainLength != cipherLength) {
+        ALOGE("C_Decrypt failed: 0x%x", rv);
+        return NULL;
+    }
+
+    size_t padding = padded[plainLength - 1];
+    if (padding == 0 || padding > WRAP_BLOCK_SIZE) {
+        ALOGE("Wrapped EC key doesn't decrypt");
+        return NULL;
+    }
+
+    const unsigned char* tmp = padded;
+    Unique_EC_KEY key(d2i_ECPrivateKey(NULL, &tmp, plainLength - padding));
+    if (key.get() == NULL) {
+        logOpenSSLError("unwrap_ec_private");
+        return NULL;
+    }
+
+    const EC_GROUP* group = EC_KEY_get0_group(key.get());
+    if (group == NULL || EC_GROUP_get_curve_name(group) != NID_X9_62_prime256v1
+            || EC_KEY_get0_public_key(key.get()) == NULL
+            || EC_POINT_cmp(group, EC_KEY_get0_public_key(key.get()),
+                    EC_KEY_get0_public_key(publicKey.get()), NULL) != 0) {
+        ALOGE("Wrapped EC key doesn't match its public key");
+        return NULL;
+    }
+
+    return key.release();
+}
+
+/** Saves an EC key the TEE can't hold as a wrapped blob. */
+static int keyblob_save_wrapped_ec(TeeContext* context, CryptoSession* session,
+        const ByteArray* objId, EC_KEY* key, uint8_t** key_blob, size_t* key_blob_length) {
+    uint8_t* der;
+    size_t derLength;
+    if (encode_ec_public_der(key, &der, &derLength)) {
+        return -1;
+    }
+    UniquePtr<uint8_t, Malloc_Free> derOwner(der);
+
+    uint8_t* wrapped;
+    size_t wrappedLength;
+    if (wrap_ec_private(context, session, objId->get(), der, derLength, key, &wrapped,
+            &wrappedLength)) {
+        return -1;
+    }
+    UniquePtr<uint8_t, Malloc_Free> wrappedOwner(wrapped);
+
+    KeyBlob blob;
+    memset(&blob, 0, sizeof(blob));
+    blob.id = objId->get();
+    blob.keyType = TYPE_EC;
+    blob.flags = KEYBLOB_FLAG_WRAPPED;
+    blob.keyBits = EC_FIELD_BITS;
+    blob.publicHint = CK_INVALID_HANDLE;
+    blob.privateHint = CK_INVALID_HANDLE;
+    blob.publicDer = der;
+    blob.publicDerLength = derLength;
+    blob.wrapped = wrapped;
+    blob.wrappedLength = wrappedLength;
+
+    ALOGW("Saving software EC key: the TEE wraps it, but it signs outside the TEE");
+    return keyblob_save(&blob, key_blob, key_blob_length);
+}
+
+/** Saves the blob of a P-256 keypair held by the TEE. */
+static int keyblob_save_tee_ec(const ByteArray* objId, EC_KEY* publicEc,
+        CK_OBJECT_HANDLE publicHandle, CK_OBJECT_HANDLE privateHandle, uint8_t** key_blob,
+        size_t* key_blob_length) {
+    uint8_t* der;
+    size_t derLength;
+    if (encode_ec_public_der(publicEc, &der, &derLength)) {
+        return -1;
+    }
+    UniquePtr<uint8_t, Malloc_Free> derOwner(der);
+
+    return keyblob_save_tee_key(objId, TYPE_EC, EC_FIELD_BITS, der, derLength, publicHandle,
+            privateHandle, key_blob, key_blob_length);
+}
+
+/**
+ * Generates and destroys a throwaway P-256 keypair, so the device only
+ * claims KEYMASTER_SUPPORTS_EC once the TEE has shown it holds EC keys.
+ * Otherwise keystore keeps EC keys in its own software keymaster rather
+ * than report wrapped ones as hardware-backed. Returns whether it worked.
+ */
+static bool probe_tee_ec(TeeContext* context) {
+    Unique_ByteArray objId(generate_random_id());
+    if (objId.get() == NULL) {
+        ALOGE("Couldn't generate random key ID");
+        return false;
+    }
+
+    CryptoSession session(context->primary, &context->subsessions);
+    ObjectHandle publicKey(&session);
+    ObjectHandle privateKey(&session);
+    CK_RV rv = generate_ec_keypair(&session, objId.get(), &publicKey, &privateKey);
+    if (rv != CKR_OK) {
+        if (rv == CKR_MECHANISM_INVALID) {
+            set_ec_in_software(context, rv);
+        } else {
+            ALOGW("Couldn't tell whether the TEE has P-256 keys: 0x%x", rv);
+        }
+        return false;
+    }
+
+    TEE_CALL(C_DestroyObject, session.get(), privateKey.get());
+    TEE_CALL(C_DestroyObject, session.get(), publicKey.get());
+    return true;
+}
+
+static int generate_ec(TeeContext* context, const keymaster_ec_keygen_params_t* ec_params,
+        uint8_t** key_blob, size_t* key_blob_length) {
+    if (ec_params->field_size != EC_FIELD_BITS) {
+        ALOGW("Unsupported EC field size %d", ec_params->field_size);
+        return -1;
+    }
+
+    Unique_ByteArray objId(generate_random_id());
+    if (objId.get() == NULL) {
+        ALOGE("Couldn't generate random key ID");
+        return -1;
+    }
+
+    CryptoSession session(context->primary, &context->subsessions);
+
+    if (!ec_in_software(context)) {
+        ObjectHandle publicKey(&session);
+        ObjectHandle privateKey(&session);
+        CK_RV rv = generate_ec_keypair(&session, objId.get(), &publicKey, &privateKey);
+        if (rv == CKR_OK) {
+            Unique_EC_KEY publicEc(fetch_public_ec(&session, publicKey.get()));
+            if (publicEc.get() == NULL || keyblob_save_tee_ec(objId.get(), publicEc.get(),
+                    publicKey.get(), privateKey.get(), key_blob, key_blob_length)) {
+                TEE_CALL(C_DestroyObject, session.get(), privateKey.get());
+                TEE_CALL(C_DestroyObject, session.get(), publicKey.get());
+                return -1;
+            }
+            keep_new_key(context, objId.get(), &publicKey, &privateKey);
+            return 0;
+        }
+
+        if (rv != CKR_MECHANISM_INVALID) {
+            ALOGE("Generate EC keypair failed: 0x%x", rv);
+            return -1;
+        }
+        set_ec_in_software(context, rv);
+    }
+
+    Unique_EC_KEY key(EC_KEY_new_by_curve_name(NID_X9_62_prime256v1));
+    if (key.get() == NULL || EC_KEY_generate_key(key.get()) != 1) {
+        logOpenSSLError("generate_ec");
+        return -1;
+    }
+
+    return keyblob_save_wrapped_ec(context, &session, objId.get(), key.get(), key_blob,
+            key_blob_length);
+}
+
+static int import_ec(TeeContext* context, EVP_PKEY* pkey, uint8_t** key_blob,
+        size_t* key_blob_length) {
+    Unique_EC_KEY key(EVP_PKEY_get1_EC_KEY(pkey));
+    if (key.get() == NULL) {
+        logOpenSSLError("import_ec");
+        return -1;
+    }
+
+    const EC_GROUP* group = EC_KEY_get0_group(key.get());
+    if (group == NULL || EC_GROUP_get_curve_name(group) != NID_X9_62_prime256v1) {
+        ALOGE("Unsupported EC curve");
+        return -1;
+    }
+    if (EC_KEY_get0_private_key(key.get()) == NULL || EC_KEY_get0_public_key(key.get()) == NULL) {
+        ALOGE("EC key is missing its private or public part");
+        return -1;
+    }
+
+    Unique_ByteArray objId(generate_random_id());
+    if (objId.get() == NULL) {
+        ALOGE("Couldn't generate random key ID");
+        return -1;
+    }
+
+    CryptoSession session(context->primary, &context->subsessions);
+
+    if (!ec_in_software(context)) {
+        ObjectHandle publicKey(&session);
+        ObjectHandle privateKey(&session);
+        CK_RV rv = create_ec_objects(&session, objId.get(), key.get(), &publicKey, &privateKey);
+        if (rv == CKR_OK) {
+            if (keyblob_save_tee_ec(objId.get(), key.get(), publicKey.get(), privateKey.get(),
+                    key_blob, key_blob_length)) {
+                TEE_CALL(C_DestroyObject, session.get(), privateKey.get());
+                TEE_CALL(C_DestroyObject, session.get(), publicKey.get());
+                return -1;
+            }
+            keep_new_key(context, objId.get(), &publicKey, &privateKey);
+            return 0;
+        }
+
+        ALOGE("Creation of EC key failed: 0x%x", rv);
+        return -1;
+    }
+
+    return keyblob_save_wrapped_ec(context, &session, objId.get(), key.get(), key_blob,
+            key_blob_length);
+}
+
+static int generate_keypair(const keymaster0_device_t* dev,
+        const keymaster_keypair_t type, const void* key_params,
+        uint8_t** key_blob, size_t* key_blob_length) {
+    TeeOperation operation(&tee_context(dev)->callStats, TEE_OP_GENERATE);
+
+    if (key_params == NULL) {
+        ALOGW("generate_keypair params were NULL");
+        return -1;
+    }
 
-    CryptoSession session(reinterpret_cast<CK_SESSION_HANDLE>(dev->context));
+    if (type == TYPE_EC) {
+        operation.setType(TEE_OP_GENERATE_EC);
+        return generate_ec(tee_context(dev), (const keymaster_ec_keygen_params_t*) key_params,
+                key_blob, key_blob_length);
+    }
 
-    CK_OBJECT_HANDLE hPublicKey, hPrivateKey;
-    CK_RV rv = C_GenerateKeyPair(session.get(),
-            &mechanism,
-            publicKeyTemplate,
-            sizeof(publicKeyTemplate)/sizeof(CK_ATTRIBUTE),
-            privateKeyTemplate,
-            sizeof(privateKeyTemplate)/sizeof(CK_ATTRIBUTE),
-            &hPublicKey,
-            &hPrivateKey);
+    if (type != TYPE_RSA) {
+        ALOGW("Unknown key type %d", type);
+        return -1;
+    }
 
-    if (rv != CKR_OK) {
-        ALOGE("Generate keypair failed: 0x%x", rv);
+    keymaster_rsa_keygen_params_t* rsa_params = (keymaster_rsa_keygen_params_t*) key_params;
+    CK_ULONG modulusBits = (CK_ULONG) rsa_params->modulus_size;
+    const uint64_t exp = rsa_params->public_exponent;
+
+    Unique_ByteArray objId(generate_random_id());
+    if (objId.get() == NULL) {
+        ALOGE("Couldn't generate random key ID");
         return -1;
     }
 
-    ObjectHandle publicKey(&session, hPublicKey);
-    ObjectHandle privateKey(&session, hPrivateKey);
-    ALOGV("public handle = 0x%x, private handle = 0x%x", publicKey.get(), privateKey.get());
+    TeeContext* context = tee_context(dev);
+    CryptoSession session(context->primary, &context->subsessions);
+
+    ObjectHandle publicKey(&session);
+    ObjectHandle privateKey(&session);
+    if (!KeyPregenerator::matches(modulusBits, exp)
+            || context->pregenerator->take(&session, objId.get(), &publicKey, &privateKey)) {
+        if (generate_rsa_keypair(&session, objId.get(), modulusBits, exp, &publicKey,
+                &privateKey)) {
+            return -1;
+        }
+    }
+
+    Unique_RSA publicRsa(fetch_public_rsa(&session, publicKey.get()));
+    if (keyblob_save_rsa(objId.get(), publicRsa.get(), publicKey.get(), privateKey.get(),
+            key_blob, key_blob_length)) {
+        return -1;
+    }
 
-    return keyblob_save(objId.get(), key_blob, key_blob_length);
+    keep_new_key(context, objId.get(), &publicKey, &privateKey);
+    return 0;
 }
 
-static int tee_import_keypair(const keymaster0_device_t* dev,
+static int import_keypair(const keymaster0_device_t* dev,
         const uint8_t* key, const size_t key_length,
         uint8_t** key_blob, size_t* key_blob_length) {
+    TeeOperation operation(&tee_context(dev)->callStats, TEE_OP_IMPORT);
     CK_RV rv;
     CK_BBOOL bTRUE = CK_TRUE;
 
@@ -430,6 +3213,10 @@ static int tee_import_keypair(const keymaster0_device_t* dev,
         return -1;
     }
 
+    if (EVP_PKEY_type(pkey->type) == EVP_PKEY_EC) {
+        return import_ec(tee_context(dev), pkey.get(), key_blob, key_blob_length);
+    }
+
     if (EVP_PKEY_type(pkey->type) != EVP_PKEY_RSA) {
         ALOGE("Unsupported key type: %d", EVP_PKEY_type(pkey->type));
         return -1;
@@ -441,58 +3228,12 @@ static int tee_import_keypair(const keymaster0_device_t* dev,
         return -1;
     }
 
-    Unique_ByteArray modulus(bignum_to_array(rsa->n));
-    if (modulus.get() == NULL) {
-        ALOGW("Could not convert modulus to array");
-        return -1;
-    }
-
-    Unique_ByteArray publicExponent(bignum_to_array(rsa->e));
-    if (publicExponent.get() == NULL) {
-        ALOGW("Could not convert publicExponent to array");
-        return -1;
-    }
-
-    CK_KEY_TYPE rsaType = CKK_RSA;
-
-    CK_OBJECT_CLASS pubClass = CKO_PUBLIC_KEY;
-
-    Unique_ByteArray objId(generate_random_id());
-    if (objId.get() == NULL) {
-        ALOGE("Couldn't generate random key ID");
-        return -1;
-    }
-
-    CK_ATTRIBUTE publicKeyTemplate[] = {
-            {CKA_ID,              objId->get(),          objId->length()},
-            {CKA_TOKEN,           &bTRUE,                sizeof(bTRUE)},
-            {CKA_CLASS,           &pubClass,             sizeof(pubClass)},
-            {CKA_KEY_TYPE,        &rsaType,              sizeof(rsaType)},
-            {CKA_ENCRYPT,         &bTRUE,                sizeof(bTRUE)},
-            {CKA_VERIFY,          &bTRUE,                sizeof(bTRUE)},
-            {CKA_MODULUS,         modulus->get(),        modulus->length()},
-            {CKA_PUBLIC_EXPONENT, publicExponent->get(), publicExponent->length()},
-    };
-
-    CryptoSession session(reinterpret_cast<CK_SESSION_HANDLE>(dev->context));
-
-    CK_OBJECT_HANDLE hPublicKey;
-    rv = C_CreateObject(session.get(),
-            publicKeyTemplate,
-            sizeof(publicKeyTemplate)/sizeof(CK_ATTRIBUTE),
-            &hPublicKey);
-    if (rv != CKR_OK) {
-        ALOGE("Creation of public key failed: 0x%x", rv);
-        return -1;
-    }
-    ObjectHandle publicKey(&session, hPublicKey);
-
-    Unique_ByteArray privateExponent(bignum_to_array(rsa->d));
-    if (privateExponent.get() == NULL) {
-        ALOGW("Could not convert private exponent");
-        return -1;
-    }
-
+    /*
+     * If we have the prime, prime exponents, and coefficient, we can
+     * copy them in.
+     */
+    bool has_extra_data = (rsa->p != NULL) && (rsa->q != NULL) && (rsa->dmp1 != NULL) &&
+            (rsa->dmq1 != NULL) && (rsa->iqmp != NULL);
 
     /*
      * Normally we need:
@@ -522,15 +3263,39 @@ static int tee_import_keypair(const keymaster0_device_t* dev,
      */
 #define PRIV_ATTRIB_EXTENDED_NUM (PRIV_ATTRIB_NORMAL_NUM + 5)
 
+    size_t privateAttributes = has_extra_data ? PRIV_ATTRIB_EXTENDED_NUM : PRIV_ATTRIB_NORMAL_NUM;
+
     /*
-     * If we have the prime, prime exponents, and coefficient, we can
-     * copy them in.
+     * Size the arena for every value and the private key template up
+     * front, so a 2048-bit key fits in its inline storage.
      */
-    bool has_extra_data = (rsa->p != NULL) && (rsa->q != NULL) && (rsa->dmp1 != NULL) &&
-            (rsa->dmq1 != NULL) && (rsa->iqmp != NULL);
+    size_t arenaSize = AttributeArena::sizeFor(privateAttributes * sizeof(CK_ATTRIBUTE))
+            + AttributeArena::sizeFor(BN_num_bytes(rsa->n))
+            + AttributeArena::sizeFor(BN_num_bytes(rsa->e))
+            + AttributeArena::sizeFor(BN_num_bytes(rsa->d));
+    if (has_extra_data) {
+        arenaSize += AttributeArena::sizeFor(BN_num_bytes(rsa->p))
+                + AttributeArena::sizeFor(BN_num_bytes(rsa->q))
+                + AttributeArena::sizeFor(BN_num_bytes(rsa->dmp1))
+                + AttributeArena::sizeFor(BN_num_bytes(rsa->dmq1))
+                + AttributeArena::sizeFor(BN_num_bytes(rsa->iqmp));
+    }
+    AttributeArena arena(arenaSize);
+
+    CK_ATTRIBUTE* privateKeyTemplate = static_cast<CK_ATTRIBUTE*>(
+            arena.alloc(privateAttributes * sizeof(CK_ATTRIBUTE)));
+    if (privateKeyTemplate == NULL) {
+        ALOGE("Could not allocate private key template");
+        return -1;
+    }
+
+    CK_KEY_TYPE rsaType = CKK_RSA;
 
-    Unique_CK_ATTRIBUTE privateKeyTemplate(new CK_ATTRIBUTE[
-            has_extra_data ? PRIV_ATTRIB_EXTENDED_NUM : PRIV_ATTRIB_NORMAL_NUM]);
+    Unique_ByteArray objId(generate_random_id());
+    if (objId.get() == NULL) {
+        ALOGE("Couldn't generate random key ID");
+        return -1;
+    }
 
     CK_OBJECT_CLASS privClass = CKO_PRIVATE_KEY;
 
@@ -544,218 +3309,509 @@ static int tee_import_keypair(const keymaster0_device_t* dev,
     set_attribute(&privateKeyTemplate[templateOffset++], CKA_DECRYPT, &bTRUE, sizeof(bTRUE));
     set_attribute(&privateKeyTemplate[templateOffset++], CKA_SIGN, &bTRUE, sizeof(bTRUE));
 
-    set_attribute(&privateKeyTemplate[templateOffset++], CKA_MODULUS, modulus->get(),
-            modulus->length());
-    set_attribute(&privateKeyTemplate[templateOffset++], CKA_PUBLIC_EXPONENT,
-            publicExponent->get(), publicExponent->length());
-    set_attribute(&privateKeyTemplate[templateOffset++], CKA_PRIVATE_EXPONENT,
-            privateExponent->get(), privateExponent->length());
+    CK_ATTRIBUTE* modulus = &privateKeyTemplate[templateOffset++];
+    if (bignum_to_attribute(&arena, modulus, CKA_MODULUS, rsa->n)) {
+        ALOGW("Could not convert modulus to array");
+        return -1;
+    }
+
+    CK_ATTRIBUTE* publicExponent = &privateKeyTemplate[templateOffset++];
+    if (bignum_to_attribute(&arena, publicExponent, CKA_PUBLIC_EXPONENT, rsa->e)) {
+        ALOGW("Could not convert publicExponent to array");
+        return -1;
+    }
+
+    if (bignum_to_attribute(&arena, &privateKeyTemplate[templateOffset++], CKA_PRIVATE_EXPONENT,
+            rsa->d)) {
+        ALOGW("Could not convert private exponent");
+        return -1;
+    }
+
+    if (has_extra_data) {
+        if (bignum_to_attribute(&arena, &privateKeyTemplate[templateOffset++], CKA_PRIME_1,
+                rsa->p)) {
+            ALOGW("Could not convert prime1");
+            return -1;
+        }
+
+        if (bignum_to_attribute(&arena, &privateKeyTemplate[templateOffset++], CKA_PRIME_2,
+                rsa->q)) {
+            ALOGW("Could not convert prime2");
+            return -1;
+        }
+
+        if (bignum_to_attribute(&arena, &privateKeyTemplate[templateOffset++], CKA_EXPONENT_1,
+                rsa->dmp1)) {
+            ALOGW("Could not convert exponent 1");
+            return -1;
+        }
+
+        if (bignum_to_attribute(&arena, &privateKeyTemplate[templateOffset++], CKA_EXPONENT_2,
+                rsa->dmq1)) {
+            ALOGW("Could not convert exponent 2");
+            return -1;
+        }
+
+        if (bignum_to_attribute(&arena, &privateKeyTemplate[templateOffset++], CKA_COEFFICIENT,
+                rsa->iqmp)) {
+            ALOGW("Could not convert coefficient");
+            return -1;
+        }
+    }
+
+    CK_OBJECT_CLASS pubClass = CKO_PUBLIC_KEY;
+
+    // The public key shares the modulus and exponent values with the private key template.
+    CK_ATTRIBUTE publicKeyTemplate[] = {
+            {CKA_ID,              objId->get(),           static_cast<CK_ULONG>(objId->length())},
+            {CKA_TOKEN,           &bTRUE,                 sizeof(bTRUE)},
+            {CKA_CLASS,           &pubClass,              sizeof(pubClass)},
+            {CKA_KEY_TYPE,        &rsaType,               sizeof(rsaType)},
+            {CKA_ENCRYPT,         &bTRUE,                 sizeof(bTRUE)},
+            {CKA_VERIFY,          &bTRUE,                 sizeof(bTRUE)},
+            {CKA_MODULUS,         modulus->pValue,        modulus->ulValueLen},
+            {CKA_PUBLIC_EXPONENT, publicExponent->pValue, publicExponent->ulValueLen},
+    };
+
+    CryptoSession session(tee_context(dev)->primary, &tee_context(dev)->subsessions);
+
+    CK_OBJECT_HANDLE hPublicKey;
+    rv = session.check(TEE_CALL(C_CreateObject, session.get(),
+            publicKeyTemplate,
+            sizeof(publicKeyTemplate)/sizeof(CK_ATTRIBUTE),
+            &hPublicKey));
+    if (rv != CKR_OK) {
+        ALOGE("Creation of public key failed: 0x%x", rv);
+        return -1;
+    }
+    ObjectHandle publicKey(&session, hPublicKey);
+
+    CK_OBJECT_HANDLE hPrivateKey;
+    rv = session.check(TEE_CALL(C_CreateObject, session.get(),
+            privateKeyTemplate,
+            templateOffset,
+            &hPrivateKey));
+    if (rv != CKR_OK) {
+        ALOGE("Creation of private key failed: 0x%x", rv);
+        return -1;
+    }
+    ObjectHandle privateKey(&session, hPrivateKey);
+
+    ALOGV("public handle = 0x%x, private handle = 0x%x", publicKey.get(), privateKey.get());
+
+    if (keyblob_save_rsa(objId.get(), rsa.get(), publicKey.get(), privateKey.get(),
+            key_blob, key_blob_length)) {
+        return -1;
+    }
+
+    keep_new_key(tee_context(dev), objId.get(), &publicKey, &privateKey);
+    return 0;
+}
+
+static int tee_get_keypair_public(const keymaster0_device* dev,
+        const uint8_t* key_blob, const size_t key_blob_length,
+        uint8_t** x509_data, size_t* x509_data_length) {
+    TeeOperation operation(&tee_context(dev)->callStats, TEE_OP_GET_PUBLIC);
+
+    KeyBlob blob;
+    if (keyblob_parse(key_blob, key_blob_length, &blob)) {
+        return -1;
+    }
+
+    if (x509_data == NULL || x509_data_length == NULL) {
+        ALOGW("Provided destination variables were null");
+        return -1;
+    }
+
+    // Version 2 blobs carry the public key, so the TEE isn't needed.
+    if (blob.publicDer != NULL) {
+        UniquePtr<uint8_t, Malloc_Free> key(static_cast<uint8_t*>(malloc(blob.publicDerLength)));
+        if (key.get() == NULL) {
+            ALOGE("Could not allocate memory for public key data");
+            return -1;
+        }
+        memcpy(key.get(), blob.publicDer, blob.publicDerLength);
+        *x509_data_length = blob.publicDerLength;
+        *x509_data = key.release();
+        return 0;
+    }
+
+    if (blob.keyType != TYPE_RSA) {
+        ALOGE("EC key blob has no usable public key");
+        return -1;
+    }
+
+    CryptoSession session(tee_context(dev)->primary, &tee_context(dev)->subsessions);
+
+    KeyHandles handles(tee_context(dev), &session);
+    if (handles.restore(key_blob, key_blob_length)) {
+        return -1;
+    }
+
+    if (handles.copyPublicDer(x509_data, x509_data_length)) {
+        ALOGV("Length of cached x509 data is %zu", *x509_data_length);
+        return 0;
+    }
+
+    RSA* publicRsa = handles.publicRsa(&session);
+    if (publicRsa == NULL) {
+        return -1;
+    }
+
+    uint8_t* der;
+    size_t len;
+    if (encode_rsa_public_der(publicRsa, &der, &len)) {
+        return -1;
+    }
+
+    ALOGV("Length of x509 data is %zu", len);
+    handles.setPublicDer(der, len);
+    *x509_data_length = len;
+    *x509_data = der;
+
+    return 0;
+}
+
+static int tee_delete_keypair(const keymaster0_device_t* dev,
+            const uint8_t* key_blob, const size_t key_blob_length) {
+    TeeOperation operation(&tee_context(dev)->callStats, TEE_OP_DELETE);
+
+    KeyBlob blob;
+    if (keyblob_parse(key_blob, key_blob_length, &blob)) {
+        return -1;
+    }
+    tee_context(dev)->keyCache.invalidate(blob.id);
+
+    // A wrapped key exists only in its blob.
+    if (blob.flags & KEYBLOB_FLAG_WRAPPED) {
+        return 0;
+    }
+
+    CryptoSession session(tee_context(dev)->primary, &tee_context(dev)->subsessions);
+
+    ObjectHandle publicKey(&session);
+    ObjectHandle privateKey(&session);
+
+    if (keyblob_restore(&session, key_blob, key_blob_length, &publicKey, &privateKey)) {
+        return -1;
+    }
+
+    // Delete the private key.
+    CK_RV rv = session.check(TEE_CALL(C_DestroyObject, session.get(), privateKey.get()));
+    if (rv != CKR_OK) {
+        ALOGW("Could destroy private key object: 0x%02x", rv);
+        return -1;
+    }
+
+    // Delete the public key.
+    rv = session.check(TEE_CALL(C_DestroyObject, session.get(), publicKey.get()));
+    if (rv != CKR_OK) {
+        ALOGW("Could destroy public key object: 0x%02x", rv);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Collects the handles of every object of one class into a growing
+ * malloc()ed array, DELETE_ALL_BATCH at a time. Nothing may be destroyed
+ * while the find operation is active, so destruction happens afterwards.
+ */
+static int find_all_objects(CryptoSession* session, CK_OBJECT_CLASS objClass,
+        CK_OBJECT_HANDLE** handles, size_t* count, size_t* capacity) {
+    CK_ATTRIBUTE attributes[] = {
+            { CKA_CLASS, &objClass, sizeof(objClass) },
+    };
+
+    CK_RV rv = session->check(TEE_CALL(C_FindObjectsInit, session->get(), attributes,
+            sizeof(attributes) / sizeof(CK_ATTRIBUTE)));
+    if (rv != CKR_OK) {
+        ALOGE("Error in C_FindObjectsInit: 0x%x", rv);
+        return -1;
+    }
+
+    int result = 0;
+    for (;;) {
+        if (*capacity - *count < DELETE_ALL_BATCH) {
+            size_t newCapacity = *capacity + DELETE_ALL_BATCH * 4;
+            CK_OBJECT_HANDLE* grown = static_cast<CK_OBJECT_HANDLE*>(
+                    realloc(*handles, newCapacity * sizeof(CK_OBJECT_HANDLE)));
+            if (grown == NULL) {
+                ALOGE("Could not grow object handle list to %zu", newCapacity);
+                result = -1;
+                break;
+            }
+            *handles = grown;
+            *capacity = newCapacity;
+        }
+
+        CK_ULONG found = 0;
+        rv = session->check(TEE_CALL(C_FindObjects, session->get(), *handles + *count,
+                DELETE_ALL_BATCH, &found));
+        if (rv != CKR_OK) {
+            ALOGE("Error in C_FindObjects: 0x%x", rv);
+            result = -1;
+            break;
+        }
+        *count += found;
+        if (found < DELETE_ALL_BATCH) {
+            break;
+        }
+    }
+
+    TEE_CALL(C_FindObjectsFinal, session->get());
+    return result;
+}
+
+static int tee_delete_all(const keymaster0_device_t* dev) {
+    TeeOperation operation(&tee_context(dev)->callStats, TEE_OP_DELETE_ALL);
+    static const CK_OBJECT_CLASS classes[] = {
+            CKO_PRIVATE_KEY,
+            CKO_PUBLIC_KEY,
+            CKO_SECRET_KEY,
+    };
 
-    Unique_ByteArray prime1, prime2, exp1, exp2, coeff;
-    if (has_extra_data) {
-        prime1.reset(bignum_to_array(rsa->p));
-        if (prime1->get() == NULL) {
-            ALOGW("Could not convert prime1");
-            return -1;
-        }
-        set_attribute(&privateKeyTemplate[templateOffset++], CKA_PRIME_1, prime1->get(),
-                prime1->length());
+    TeeContext* context = tee_context(dev);
+    uint64_t start = monotonic_ns();
 
-        prime2.reset(bignum_to_array(rsa->q));
-        if (prime2->get() == NULL) {
-            ALOGW("Could not convert prime2");
-            return -1;
-        }
-        set_attribute(&privateKeyTemplate[templateOffset++], CKA_PRIME_2, prime2->get(),
-                prime2->length());
+    context->pregenerator->pause();
+    context->keyCache.invalidateAll();
 
-        exp1.reset(bignum_to_array(rsa->dmp1));
-        if (exp1->get() == NULL) {
-            ALOGW("Could not convert exponent 1");
-            return -1;
-        }
-        set_attribute(&privateKeyTemplate[templateOffset++], CKA_EXPONENT_1, exp1->get(),
-                exp1->length());
+    // Wrapped EC keys go with their wrapping keys; new ones are made on demand.
+    forget_wrap_keys(context);
 
-        exp2.reset(bignum_to_array(rsa->dmq1));
-        if (exp2->get() == NULL) {
-            ALOGW("Could not convert exponent 2");
-            return -1;
+    int result = 0;
+    size_t destroyed = 0;
+    size_t failed = 0;
+    {
+        CryptoSession session(context->primary, &context->subsessions);
+
+        CK_OBJECT_HANDLE* handles = NULL;
+        size_t count = 0;
+        size_t capacity = 0;
+        for (size_t i = 0; i < sizeof(classes) / sizeof(classes[0]) && result == 0; i++) {
+            result = find_all_objects(&session, classes[i], &handles, &count, &capacity);
         }
-        set_attribute(&privateKeyTemplate[templateOffset++], CKA_EXPONENT_2, exp2->get(),
-                exp2->length());
+        uint64_t found = monotonic_ns();
 
-        coeff.reset(bignum_to_array(rsa->iqmp));
-        if (coeff->get() == NULL) {
-            ALOGW("Could not convert coefficient");
-            return -1;
+        // Destroy whatever was found even if enumeration stopped early.
+        for (size_t i = 0; i < count; i++) {
+            CK_RV rv = session.check(TEE_CALL(C_DestroyObject, session.get(), handles[i]));
+            if (rv == CKR_OK) {
+                destroyed++;
+            } else {
+                ALOGW("Could not destroy object 0x%x: 0x%x", handles[i], rv);
+                failed++;
+            }
         }
-        set_attribute(&privateKeyTemplate[templateOffset++], CKA_COEFFICIENT, coeff->get(),
-                coeff->length());
-    }
+        free(handles);
 
-    CK_OBJECT_HANDLE hPrivateKey;
-    rv = C_CreateObject(session.get(),
-            privateKeyTemplate.get(),
-            templateOffset,
-            &hPrivateKey);
-    if (rv != CKR_OK) {
-        ALOGE("Creation of private key failed: 0x%x", rv);
-        return -1;
+        ALOGI("delete_all: %zu objects found in %llu us, %zu destroyed (%zu failed) in %llu us",
+                count, (unsigned long long) (found - start) / 1000,
+                destroyed, failed, (unsigned long long) (monotonic_ns() - found) / 1000);
     }
-    ObjectHandle privateKey(&session, hPrivateKey);
 
-    ALOGV("public handle = 0x%x, private handle = 0x%x", publicKey.get(), privateKey.get());
+    context->pregenerator->resume();
 
-    return keyblob_save(objId.get(), key_blob, key_blob_length);
+    return (result == 0 && failed == 0) ? 0 : -1;
 }
 
-static int tee_get_keypair_public(const keymaster0_device* dev,
-        const uint8_t* key_blob, const size_t key_blob_length,
-        uint8_t** x509_data, size_t* x509_data_length) {
+/** DER prefix of a SHA-256 DigestInfo, to which the digest is appended. */
+static const uint8_t SHA256_DIGEST_INFO_PREFIX[] = {
+        0x30, 0x31, 0x30, 0x0d, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x01,
+        0x05, 0x00, 0x04, 0x20,
+};
 
-    CryptoSession session(reinterpret_cast<CK_SESSION_HANDLE>(dev->context));
+/**
+ * What is actually handed to the TEE for a sign or verify request: the
+ * mechanism and either the caller's data (raw RSA) or a short encoding of
+ * its digest, so large messages never cross into the secure world.
+ */
+struct SignInput {
+    CK_MECHANISM mechanism;
+    CK_RSA_PKCS_PSS_PARAMS pssParams;
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    uint8_t digestInfo[sizeof(SHA256_DIGEST_INFO_PREFIX) + SHA256_DIGEST_LENGTH];
+    const uint8_t* data;
+    size_t dataLength;
+};
 
-    ObjectHandle publicKey(&session);
-    ObjectHandle privateKey(&session);
+/**
+ * SHA-256 of the caller's buffer, fed to the hash DIGEST_CHUNK_SIZE at a
+ * time straight from where it lies.
+ */
+static void sha256_chunked(const uint8_t* data, size_t dataLength, uint8_t* digest) {
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    while (dataLength > 0) {
+        size_t chunk = dataLength < DIGEST_CHUNK_SIZE ? dataLength : DIGEST_CHUNK_SIZE;
+        SHA256_Update(&ctx, data, chunk);
+        data += chunk;
+        dataLength -= chunk;
+    }
+    SHA256_Final(digest, &ctx);
+}
 
-    if (keyblob_restore(&session, key_blob, key_blob_length, &publicKey, &privateKey)) {
-        return -1;
+static int prepare_sign_input(const keymaster_rsa_sign_params_t* params, const uint8_t* data,
+        const size_t dataLength, SignInput* input) {
+    memset(input, 0, sizeof(*input));
+    int digest = params->digest_type;
+    int padding = params->padding_type;
+
+    if (digest == DIGEST_NONE && padding == PADDING_NONE) {
+        input->mechanism.mechanism = CKM_RSA_X_509;
+        input->data = data;
+        input->dataLength = dataLength;
+        return 0;
     }
 
-    if (x509_data == NULL || x509_data_length == NULL) {
-        ALOGW("Provided destination variables were null");
+    if (digest != DIGEST_SHA256) {
+        ALOGW("Cannot handle digest type %d", digest);
         return -1;
     }
 
-    CK_ATTRIBUTE attributes[] = {
-            {CKA_MODULUS,         NULL, 0},
-            {CKA_PUBLIC_EXPONENT, NULL, 0},
-    };
-
-    // Call first to get the sizes of the values.
-    CK_RV rv = C_GetAttributeValue(session.get(), publicKey.get(), attributes,
-            sizeof(attributes)/sizeof(CK_ATTRIBUTE));
-    if (rv != CKR_OK) {
-        ALOGW("Could not query attribute value sizes: 0x%02x", rv);
+    sha256_chunked(data, dataLength, input->digest);
+
+    if (padding == PADDING_RSA_PKCS1) {
+        memcpy(input->digestInfo, SHA256_DIGEST_INFO_PREFIX, sizeof(SHA256_DIGEST_INFO_PREFIX));
+        memcpy(input->digestInfo + sizeof(SHA256_DIGEST_INFO_PREFIX), input->digest,
+                SHA256_DIGEST_LENGTH);
+        input->mechanism.mechanism = CKM_RSA_PKCS;
+        input->data = input->digestInfo;
+        input->dataLength = sizeof(input->digestInfo);
+    } else if (padding == PADDING_RSA_PSS) {
+        input->pssParams.hashAlg = CKM_SHA256;
+        input->pssParams.mgf = CKG_MGF1_SHA256;
+        input->pssParams.sLen = SHA256_DIGEST_LENGTH;
+        input->mechanism.mechanism = CKM_RSA_PKCS_PSS;
+        input->mechanism.pParameter = &input->pssParams;
+        input->mechanism.ulParameterLen = sizeof(input->pssParams);
+        input->data = input->digest;
+        input->dataLength = sizeof(input->digest);
+    } else {
+        ALOGW("Cannot handle padding type %d", padding);
         return -1;
     }
 
-    ByteArray modulus(new CK_BYTE[attributes[0].ulValueLen], attributes[0].ulValueLen);
-    ByteArray exponent(new CK_BYTE[attributes[1].ulValueLen], attributes[1].ulValueLen);
+    return 0;
+}
 
-    attributes[0].pValue = modulus.get();
-    attributes[1].pValue = exponent.get();
+/**
+ * ECDSA signs a digest: the caller's data as it is with DIGEST_NONE, as
+ * keymaster0 defines it, or its SHA-256. Only the leftmost field-size
+ * bytes of it count, so nothing longer is handed on.
+ */
+static int prepare_ec_input(const keymaster_ec_sign_params_t* params, const uint8_t* data,
+        const size_t dataLength, uint8_t* digest, const uint8_t** input, size_t* inputLength) {
+    int digestType = params->digest_type;
+    if (digestType == DIGEST_NONE) {
+        *input = data;
+        *inputLength = dataLength < EC_FIELD_BYTES ? dataLength : EC_FIELD_BYTES;
+        return 0;
+    }
 
-    rv = C_GetAttributeValue(session.get(), publicKey.get(), attributes,
-            sizeof(attributes) / sizeof(CK_ATTRIBUTE));
-    if (rv != CKR_OK) {
-        ALOGW("Could not query attribute values: 0x%02x", rv);
+    if (digestType != DIGEST_SHA256) {
+        ALOGW("Cannot handle digest type %d", digestType);
         return -1;
     }
 
-    ALOGV("modulus is %d (ret=%d), exponent is %d (ret=%d)",
-            modulus.length(), attributes[0].ulValueLen,
-            exponent.length(), attributes[1].ulValueLen);
-
-    /*
-     * Work around a bug in the implementation. The first call to measure how large the array
-     * should be sometimes returns values that are too large. The call to get the actual value
-     * returns the correct length of the array, so use that instead.
-     */
-    modulus.setLength(attributes[0].ulValueLen);
-    exponent.setLength(attributes[1].ulValueLen);
+    sha256_chunked(data, dataLength, digest);
+    *input = digest;
+    *inputLength = SHA256_DIGEST_LENGTH;
+    return 0;
+}
 
-    Unique_RSA rsa(RSA_new());
-    if (rsa.get() == NULL) {
-        ALOGE("Could not allocate RSA structure");
+/** Signs with an EC keypair held by the TEE, which returns r || s. */
+static int sign_ec_tee(TeeContext* context, CryptoSession* session, const uint8_t* key_blob,
+        const size_t key_blob_length, const uint8_t* input, const size_t inputLength,
+        uint8_t** signedData, size_t* signedDataLength) {
+    KeyHandles handles(context, session);
+    if (handles.restore(key_blob, key_blob_length)) {
         return -1;
     }
 
-    rsa->n = BN_bin2bn(reinterpret_cast<const unsigned char*>(modulus.get()), modulus.length(),
-            NULL);
-    if (rsa->n == NULL) {
-        logOpenSSLError("tee_get_keypair_public");
+    CK_MECHANISM mechanism = {
+            CKM_ECDSA, NULL, 0,
+    };
+    CK_RV rv = session->check(TEE_CALL(C_SignInit, session->get(), &mechanism,
+            handles.privateKey()));
+    if (rv != CKR_OK) {
+        ALOGV("C_SignInit failed: 0x%x", rv);
         return -1;
     }
 
-    rsa->e = BN_bin2bn(reinterpret_cast<const unsigned char*>(exponent.get()), exponent.length(),
-            NULL);
-    if (rsa->e == NULL) {
-        logOpenSSLError("tee_get_keypair_public");
+    uint8_t rs[2 * EC_FIELD_BYTES];
+    CK_ULONG rsLength = sizeof(rs);
+    rv = session->check(TEE_CALL(C_Sign, session->get(), const_cast<uint8_t*>(input),
+            inputLength, rs, &rsLength));
+    if (rv != CKR_OK || rsLength != sizeof(rs)) {
+        ALOGV("C_Sign failed: 0x%x", rv);
         return -1;
     }
 
-    Unique_EVP_PKEY pkey(EVP_PKEY_new());
-    if (pkey.get() == NULL) {
-        ALOGE("Could not allocate EVP_PKEY structure");
+    // Callers expect the DER ECDSA-Sig-Value that OpenSSL produces.
+    Unique_ECDSA_SIG sig(ECDSA_SIG_new());
+    if (sig.get() == NULL || BN_bin2bn(rs, EC_FIELD_BYTES, sig->r) == NULL
+            || BN_bin2bn(rs + EC_FIELD_BYTES, EC_FIELD_BYTES, sig->s) == NULL) {
+        logOpenSSLError("sign_ec_tee");
         return -1;
     }
-    if (EVP_PKEY_assign_RSA(pkey.get(), rsa.get()) != 1) {
-        logOpenSSLError("tee_get_keypair_public");
-        return -1;
-    }
-    OWNERSHIP_TRANSFERRED(rsa);
 
-    int len = i2d_PUBKEY(pkey.get(), NULL);
-    if (len <= 0) {
-        logOpenSSLError("tee_get_keypair_public");
+    int derLength = i2d_ECDSA_SIG(sig.get(), NULL);
+    if (derLength <= 0) {
+        logOpenSSLError("sign_ec_tee");
         return -1;
     }
 
-    UniquePtr<uint8_t> key(static_cast<uint8_t*>(malloc(len)));
-    if (key.get() == NULL) {
-        ALOGE("Could not allocate memory for public key data");
+    UniquePtr<uint8_t[]> signature(new uint8_t[derLength]);
+    if (signature.get() == NULL) {
+        ALOGE("Couldn't allocate memory for signature");
         return -1;
     }
-
-    unsigned char* tmp = reinterpret_cast<unsigned char*>(key.get());
-    if (i2d_PUBKEY(pkey.get(), &tmp) != len) {
-        logOpenSSLError("tee_get_keypair_public");
+    unsigned char* tmp = signature.get();
+    if (i2d_ECDSA_SIG(sig.get(), &tmp) != derLength) {
+        logOpenSSLError("sign_ec_tee");
         return -1;
     }
 
-    ALOGV("Length of x509 data is %d", len);
-    *x509_data_length = len;
-    *x509_data = key.release();
-
+    *signedData = signature.release();
+    *signedDataLength = derLength;
     return 0;
 }
 
-static int tee_delete_keypair(const keymaster0_device_t* dev,
-            const uint8_t* key_blob, const size_t key_blob_length) {
-
-    CryptoSession session(reinterpret_cast<CK_SESSION_HANDLE>(dev->context));
-
-    ObjectHandle publicKey(&session);
-    ObjectHandle privateKey(&session);
-
-    if (keyblob_restore(&session, key_blob, key_blob_length, &publicKey, &privateKey)) {
+/** Signs with a wrapped EC key, which the TEE only decrypts. */
+static int sign_ec_wrapped(TeeContext* context, CryptoSession* session, const KeyBlob* blob,
+        const uint8_t* input, const size_t inputLength, uint8_t** signedData,
+        size_t* signedDataLength) {
+    Unique_EC_KEY key(unwrap_ec_private(context, session, blob));
+    if (key.get() == NULL) {
         return -1;
     }
 
-    // Delete the private key.
-    CK_RV rv = C_DestroyObject(session.get(), privateKey.get());
-    if (rv != CKR_OK) {
-        ALOGW("Could destroy private key object: 0x%02x", rv);
+    UniquePtr<uint8_t[]> signature(new uint8_t[ECDSA_size(key.get())]);
+    if (signature.get() == NULL) {
+        ALOGE("Couldn't allocate memory for signature");
         return -1;
     }
 
-    // Delete the public key.
-    rv = C_DestroyObject(session.get(), publicKey.get());
-    if (rv != CKR_OK) {
-        ALOGW("Could destroy public key object: 0x%02x", rv);
+    unsigned int signatureLength;
+    if (ECDSA_sign(0, input, inputLength, signature.get(), &signatureLength, key.get()) != 1) {
+        logOpenSSLError("sign_ec_wrapped");
         return -1;
     }
 
+    *signedData = signature.release();
+    *signedDataLength = signatureLength;
     return 0;
 }
 
-static int tee_sign_data(const keymaster0_device_t* dev,
+static int sign_data(const keymaster0_device_t* dev,
         const void* params,
         const uint8_t* key_blob, const size_t key_blob_length,
         const uint8_t* data, const size_t dataLength,
         uint8_t** signedData, size_t* signedDataLength) {
+    TeeOperation operation(&tee_context(dev)->callStats, TEE_OP_SIGN);
     ALOGV("tee_sign_data(%p, %p, %llu, %p, %llu, %p, %p)", dev, key_blob,
             (unsigned long long) key_blob_length, data, (unsigned long long) dataLength, signedData,
             signedDataLength);
@@ -765,53 +3821,80 @@ static int tee_sign_data(const keymaster0_device_t* dev,
         return -1;
     }
 
-    CryptoSession session(reinterpret_cast<CK_SESSION_HANDLE>(dev->context));
+    KeyBlob blob;
+    if (keyblob_parse(key_blob, key_blob_length, &blob)) {
+        return -1;
+    }
 
-    ObjectHandle publicKey(&session);
-    ObjectHandle privateKey(&session);
+    if (blob.keyType == TYPE_EC) {
+        uint8_t digest[SHA256_DIGEST_LENGTH];
+        const uint8_t* input;
+        size_t inputLength;
+        if (prepare_ec_input((const keymaster_ec_sign_params_t*) params, data, dataLength,
+                digest, &input, &inputLength)) {
+            return -1;
+        }
 
-    if (keyblob_restore(&session, key_blob, key_blob_length, &publicKey, &privateKey)) {
-        return -1;
+        CryptoSession session(tee_context(dev)->primary, &tee_context(dev)->subsessions);
+        if (blob.flags & KEYBLOB_FLAG_WRAPPED) {
+            operation.setType(TEE_OP_SIGN_EC_WRAPPED);
+            return sign_ec_wrapped(tee_context(dev), &session, &blob, input, inputLength,
+                    signedData, signedDataLength);
+        }
+        operation.setType(TEE_OP_SIGN_EC);
+        return sign_ec_tee(tee_context(dev), &session, key_blob, key_blob_length, input,
+                inputLength, signedData, signedDataLength);
     }
-    ALOGV("public handle = 0x%x, private handle = 0x%x", publicKey.get(), privateKey.get());
 
-    keymaster_rsa_sign_params_t* sign_params = (keymaster_rsa_sign_params_t*) params;
-    if (sign_params->digest_type != DIGEST_NONE) {
-        ALOGW("Cannot handle digest type %d", sign_params->digest_type);
+    if (blob.keyBits == 2048) {
+        operation.setType(TEE_OP_SIGN_RSA_2048);
+    }
+
+    SignInput input;
+    if (prepare_sign_input((const keymaster_rsa_sign_params_t*) params, data, dataLength,
+            &input)) {
         return -1;
-    } else if (sign_params->padding_type != PADDING_NONE) {
-        ALOGW("Cannot handle padding type %d", sign_params->padding_type);
+    }
+
+    size_t modulusLength = (blob.keyBits + 7) / 8;
+    if (blob.keyBits != 0 && input.dataLength > modulusLength) {
+        ALOGW("Data length %zu is longer than the %u-bit modulus", input.dataLength,
+                blob.keyBits);
         return -1;
     }
 
-    CK_MECHANISM rawRsaMechanism = {
-            CKM_RSA_X_509, NULL, 0
-    };
+    CryptoSession session(tee_context(dev)->primary, &tee_context(dev)->subsessions);
 
-    CK_RV rv = C_SignInit(session.get(), &rawRsaMechanism, privateKey.get());
-    if (rv != CKR_OK) {
-        ALOGV("C_SignInit failed: 0x%x", rv);
+    KeyHandles handles(tee_context(dev), &session);
+    if (handles.restore(key_blob, key_blob_length)) {
         return -1;
     }
+    ALOGV("public handle = 0x%x, private handle = 0x%x", handles.publicKey(),
+            handles.privateKey());
 
-    CK_BYTE signature[1024];
-    CK_ULONG signatureLength = 1024;
-
-    rv = C_Sign(session.get(), data, dataLength, signature, &signatureLength);
+    CK_RV rv = session.check(TEE_CALL(C_SignInit, session.get(), &input.mechanism,
+            handles.privateKey()));
     if (rv != CKR_OK) {
-        ALOGV("C_SignFinal failed: 0x%x", rv);
+        ALOGV("C_SignInit failed: 0x%x", rv);
         return -1;
     }
 
-    UniquePtr<uint8_t[]> finalSignature(new uint8_t[signatureLength]);
-    if (finalSignature.get() == NULL) {
-        ALOGE("Couldn't allocate memory to copy signature");
+    // Sign straight into the buffer handed back to the caller.
+    CK_ULONG signatureLength = blob.keyBits != 0 ? modulusLength : 1024;
+    UniquePtr<uint8_t[]> signature(new uint8_t[signatureLength]);
+    if (signature.get() == NULL) {
+        ALOGE("Couldn't allocate memory for signature");
         return -1;
     }
 
-    memcpy(finalSignature.get(), signature, signatureLength);
+    rv = session.check(TEE_CALL(C_Sign, session.get(), const_cast<uint8_t*>(input.data),
+            input.dataLength, signature.get(), &signatureLength));
+    if (rv != CKR_OK) {
+        ALOGV("C_SignFinal failed: 0x%x", rv);
+        return -1;
+    }
 
-    *signedData = finalSignature.release();
+    *signedData = signature.release();
     *signedDataLength = static_cast<size_t>(signatureLength);
 
     ALOGV("tee_sign_data(%p, %p, %llu, %p, %llu, %p, %p) => %p size %llu", dev, key_blob,
@@ -821,11 +3904,98 @@ static int tee_sign_data(const keymaster0_device_t* dev,
     return 0;
 }
 
-static int tee_verify_data(const keymaster0_device_t* dev,
+/** Returned by verify_raw_rsa() when the TEE has to be asked instead. */
+#define VERIFY_UNAVAILABLE 1
+
+/**
+ * Raw RSA verification with a public key: the signature, raised to the
+ * public exponent, must equal the data. As with the TEE's CKM_RSA_X_509,
+ * data shorter than the modulus is treated as left-padded with zeros.
+ * Returns 0 on a match, -1 on a mismatch, or VERIFY_UNAVAILABLE if
+ * OpenSSL couldn't do the operation.
+ */
+static int verify_raw_rsa(RSA* rsa, const uint8_t* signedData, const size_t signedDataLength,
+        const uint8_t* signature, const size_t signatureLength) {
+    size_t modulusLength = RSA_size(rsa);
+    if (signatureLength != modulusLength || signedDataLength > modulusLength) {
+        ALOGW("Signature length %zu or data length %zu doesn't match modulus length %zu",
+                signatureLength, signedDataLength, modulusLength);
+        return -1;
+    }
+
+    UniquePtr<uint8_t[]> recovered(new uint8_t[modulusLength]);
+    if (recovered.get() == NULL) {
+        return VERIFY_UNAVAILABLE;
+    }
+
+    int recoveredLength = RSA_public_decrypt(signatureLength, signature, recovered.get(), rsa,
+            RSA_NO_PADDING);
+    if (recoveredLength != static_cast<int>(modulusLength)) {
+        logOpenSSLError("verify_raw_rsa");
+        return VERIFY_UNAVAILABLE;
+    }
+
+    size_t padding = modulusLength - signedDataLength;
+    uint8_t difference = 0;
+    for (size_t i = 0; i < padding; i++) {
+        difference |= recovered[i];
+    }
+    for (size_t i = 0; i < signedDataLength; i++) {
+        difference |= recovered[padding + i] ^ signedData[i];
+    }
+
+    return difference == 0 ? 0 : -1;
+}
+
+/**
+ * Verifies a prepared request with a public key, in the same modes the
+ * TEE supports. Returns as verify_raw_rsa().
+ */
+static int verify_with_public_key(RSA* rsa, const SignInput* input,
+        const uint8_t* signature, const size_t signatureLength) {
+    if (input->mechanism.mechanism == CKM_RSA_X_509) {
+        return verify_raw_rsa(rsa, input->data, input->dataLength, signature, signatureLength);
+    }
+
+    size_t modulusLength = RSA_size(rsa);
+    if (signatureLength != modulusLength) {
+        ALOGW("Signature length %zu doesn't match modulus length %zu", signatureLength,
+                modulusLength);
+        return -1;
+    }
+
+    if (input->mechanism.mechanism == CKM_RSA_PKCS) {
+        // Any failure here, bad padding included, is a mismatch.
+        int ok = RSA_verify(NID_sha256, input->digest, sizeof(input->digest), signature,
+                signatureLength, rsa);
+        ERR_clear_error();
+        return ok == 1 ? 0 : -1;
+    }
+
+    UniquePtr<uint8_t[]> encoded(new uint8_t[modulusLength]);
+    if (encoded.get() == NULL) {
+        return VERIFY_UNAVAILABLE;
+    }
+
+    int encodedLength = RSA_public_decrypt(signatureLength, signature, encoded.get(), rsa,
+            RSA_NO_PADDING);
+    if (encodedLength != static_cast<int>(modulusLength)) {
+        logOpenSSLError("verify_with_public_key");
+        return VERIFY_UNAVAILABLE;
+    }
+
+    int ok = RSA_verify_PKCS1_PSS(rsa, input->digest, EVP_sha256(), encoded.get(),
+            SHA256_DIGEST_LENGTH);
+    ERR_clear_error();
+    return ok == 1 ? 0 : -1;
+}
+
+static int verify_data(const keymaster0_device_t* dev,
         const void* params,
         const uint8_t* keyBlob, const size_t keyBlobLength,
         const uint8_t* signedData, const size_t signedDataLength,
         const uint8_t* signature, const size_t signatureLength) {
+    TeeOperation operation(&tee_context(dev)->callStats, TEE_OP_VERIFY);
     ALOGV("tee_verify_data(%p, %p, %llu, %p, %llu, %p, %llu)", dev, keyBlob,
             (unsigned long long) keyBlobLength, signedData, (unsigned long long) signedDataLength,
             signature, (unsigned long long) signatureLength);
@@ -835,38 +4005,77 @@ static int tee_verify_data(const keymaster0_device_t* dev,
         return -1;
     }
 
-    CryptoSession session(reinterpret_cast<CK_SESSION_HANDLE>(dev->context));
+    KeyBlob blob;
+    if (keyblob_parse(keyBlob, keyBlobLength, &blob)) {
+        return -1;
+    }
 
-    ObjectHandle publicKey(&session);
-    ObjectHandle privateKey(&session);
+    // EC blobs always carry the public key, so EC verification is local.
+    if (blob.keyType == TYPE_EC) {
+        uint8_t digest[SHA256_DIGEST_LENGTH];
+        const uint8_t* input;
+        size_t inputLength;
+        if (prepare_ec_input((const keymaster_ec_sign_params_t*) params, signedData,
+                signedDataLength, digest, &input, &inputLength)) {
+            return -1;
+        }
 
-    if (keyblob_restore(&session, keyBlob, keyBlobLength, &publicKey, &privateKey)) {
-        return -1;
+        Unique_EC_KEY key(keyblob_public_ec(&blob));
+        if (key.get() == NULL) {
+            return -1;
+        }
+
+        int ok = ECDSA_verify(0, input, inputLength, signature, signatureLength, key.get());
+        ERR_clear_error();
+        return ok == 1 ? 0 : -1;
     }
-    ALOGV("public handle = 0x%x, private handle = 0x%x", publicKey.get(), privateKey.get());
 
-    keymaster_rsa_sign_params_t* sign_params = (keymaster_rsa_sign_params_t*) params;
-    if (sign_params->digest_type != DIGEST_NONE) {
-        ALOGW("Cannot handle digest type %d", sign_params->digest_type);
+    SignInput input;
+    if (prepare_sign_input((const keymaster_rsa_sign_params_t*) params, signedData,
+            signedDataLength, &input)) {
         return -1;
-    } else if (sign_params->padding_type != PADDING_NONE) {
-        ALOGW("Cannot handle padding type %d", sign_params->padding_type);
+    }
+
+    // With the public key in the blob, verification needs no session at all.
+    Unique_RSA blobRsa(keyblob_public_rsa(&blob));
+    if (blobRsa.get() != NULL) {
+        int result = verify_with_public_key(blobRsa.get(), &input, signature, signatureLength);
+        if (result != VERIFY_UNAVAILABLE) {
+            return result;
+        }
+    }
+
+    CryptoSession session(tee_context(dev)->primary, &tee_context(dev)->subsessions);
+
+    KeyHandles handles(tee_context(dev), &session);
+    if (handles.restore(keyBlob, keyBlobLength)) {
         return -1;
     }
+    ALOGV("public handle = 0x%x, private handle = 0x%x", handles.publicKey(),
+            handles.privateKey());
 
-    CK_MECHANISM rawRsaMechanism = {
-            CKM_RSA_X_509, NULL, 0
-    };
+    /*
+     * Verification only needs the public key, so do it here instead of in
+     * the TEE. Only fall back to the TEE if the key can't be used locally.
+     */
+    RSA* publicRsa = handles.publicRsa(&session);
+    if (publicRsa != NULL) {
+        int result = verify_with_public_key(publicRsa, &input, signature, signatureLength);
+        if (result != VERIFY_UNAVAILABLE) {
+            return result;
+        }
+    }
 
-    CK_RV rv = C_VerifyInit(session.get(), &rawRsaMechanism, publicKey.get());
+    CK_RV rv = session.check(TEE_CALL(C_VerifyInit, session.get(), &input.mechanism,
+            handles.publicKey()));
     if (rv != CKR_OK) {
         ALOGV("C_VerifyInit failed: 0x%x", rv);
         return -1;
     }
 
     // This is a bad prototype for this function. C_Verify should have only const args.
-    rv = C_Verify(session.get(), signedData, signedDataLength,
-            const_cast<unsigned char*>(signature), signatureLength);
+    rv = session.check(TEE_CALL(C_Verify, session.get(), const_cast<uint8_t*>(input.data),
+            input.dataLength, const_cast<unsigned char*>(signature), signatureLength));
     if (rv != CKR_OK) {
         ALOGV("C_Verify failed: 0x%x", rv);
         return -1;
@@ -875,13 +4084,196 @@ static int tee_verify_data(const keymaster0_device_t* dev,
     return 0;
 }
 
+/*
+ * The keymaster0 entry points for the slow and the frequent operations
+ * hand their work to a lane and wait for it, so the API stays synchronous
+ * while keygens and signatures don't compete for the same workers.
+ */
+
+struct SyncCompletion {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool done;
+    int result;
+};
+
+static void complete_sync(void* cookie, int result) {
+    SyncCompletion* completion = static_cast<SyncCompletion*>(cookie);
+    pthread_mutex_lock(&completion->lock);
+    completion->result = result;
+    completion->done = true;
+    pthread_cond_signal(&completion->cond);
+    pthread_mutex_unlock(&completion->lock);
+}
+
+/**
+ * Runs fn(arg) on a lane and waits for the result. Runs it on the calling
+ * thread instead if the lane isn't running or this is one of its workers.
+ */
+static int run_sync(WorkQueue* lane, int (*fn)(void*), void* arg) {
+    if (lane->isWorker()) {
+        return fn(arg);
+    }
+
+    SyncCompletion completion;
+    pthread_mutex_init(&completion.lock, NULL);
+    pthread_cond_init(&completion.cond, NULL);
+    completion.done = false;
+    completion.result = -1;
+
+    WorkItem item = { fn, arg, complete_sync, &completion, NULL };
+    int result;
+    if (lane->submit(&item)) {
+        pthread_mutex_lock(&completion.lock);
+        while (!completion.done) {
+            pthread_cond_wait(&completion.cond, &completion.lock);
+        }
+        result = completion.result;
+        pthread_mutex_unlock(&completion.lock);
+    } else {
+        result = fn(arg);
+    }
+
+    pthread_cond_destroy(&completion.cond);
+    pthread_mutex_destroy(&completion.lock);
+    return result;
+}
+
+struct GenerateArgs {
+    const keymaster0_device_t* dev;
+    keymaster_keypair_t type;
+    const void* key_params;
+    uint8_t** key_blob;
+    size_t* key_blob_length;
+};
+
+static int run_generate(void* arg) {
+    GenerateArgs* a = static_cast<GenerateArgs*>(arg);
+    return generate_keypair(a->dev, a->type, a->key_params, a->key_blob, a->key_blob_length);
+}
+
+static int tee_generate_keypair(const keymaster0_device_t* dev,
+        const keymaster_keypair_t type, const void* key_params,
+        uint8_t** key_blob, size_t* key_blob_length) {
+    GenerateArgs args = { dev, type, key_params, key_blob, key_blob_length };
+    return run_sync(&tee_context(dev)->keygenLane, run_generate, &args);
+}
+
+struct ImportArgs {
+    const keymaster0_device_t* dev;
+    const uint8_t* key;
+    size_t key_length;
+    uint8_t** key_blob;
+    size_t* key_blob_length;
+};
+
+static int run_import(void* arg) {
+    ImportArgs* a = static_cast<ImportArgs*>(arg);
+    return import_keypair(a->dev, a->key, a->key_length, a->key_blob, a->key_blob_length);
+}
+
+static int tee_import_keypair(const keymaster0_device_t* dev,
+        const uint8_t* key, const size_t key_length,
+        uint8_t** key_blob, size_t* key_blob_length) {
+    ImportArgs args = { dev, key, key_length, key_blob, key_blob_length };
+    return run_sync(&tee_context(dev)->keygenLane, run_import, &args);
+}
+
+struct SignArgs {
+    const keymaster0_device_t* dev;
+    const void* params;
+    const uint8_t* key_blob;
+    size_t key_blob_length;
+    const uint8_t* data;
+    size_t dataLength;
+    uint8_t** signedData;
+    size_t* signedDataLength;
+};
+
+static int run_sign(void* arg) {
+    SignArgs* a = static_cast<SignArgs*>(arg);
+    return sign_data(a->dev, a->params, a->key_blob, a->key_blob_length, a->data,
+            a->dataLength, a->signedData, a->signedDataLength);
+}
+
+static int tee_sign_data(const keymaster0_device_t* dev,
+        const void* params,
+        const uint8_t* key_blob, const size_t key_blob_length,
+        const uint8_t* data, const size_t dataLength,
+        uint8_t** signedData, size_t* signedDataLength) {
+    SignArgs args = {
+        dev, params, key_blob, key_blob_length, data, dataLength, signedData, signedDataLength,
+    };
+    return run_sync(&tee_context(dev)->fastLane, run_sign, &args);
+}
+
+struct VerifyArgs {
+    const keymaster0_device_t* dev;
+    const void* params;
+    const uint8_t* keyBlob;
+    size_t keyBlobLength;
+    const uint8_t* signedData;
+    size_t signedDataLength;
+    const uint8_t* signature;
+    size_t signatureLength;
+};
+
+static int run_verify(void* arg) {
+    VerifyArgs* a = static_cast<VerifyArgs*>(arg);
+    return verify_data(a->dev, a->params, a->keyBlob, a->keyBlobLength, a->signedData,
+            a->signedDataLength, a->signature, a->signatureLength);
+}
+
+static int tee_verify_data(const keymaster0_device_t* dev,
+        const void* params,
+        const uint8_t* keyBlob, const size_t keyBlobLength,
+        const uint8_t* signedData, const size_t signedDataLength,
+        const uint8_t* signature, const size_t signatureLength) {
+    VerifyArgs args = {
+        dev, params, keyBlob, keyBlobLength, signedData, signedDataLength, signature,
+        signatureLength,
+    };
+    return run_sync(&tee_context(dev)->fastLane, run_verify, &args);
+}
+
+/**
+ * Writes the latency histograms, TEE call counts and pool and cache stats
+ * of an open device to fd. Not part of the keymaster0 interface; debugging
+ * tools find it with dlsym() on the module's dso handle.
+ */
+extern "C" __attribute__ ((visibility ("default")))
+void keymaster_grouper_dump(const keymaster0_device_t* dev, int fd) {
+    if (dev == NULL || dev->context == NULL) {
+        return;
+    }
+
+    TeeContext* context = tee_context(dev);
+    FdStatsSink sink(fd);
+    context->subsessions.dump(&sink);
+    context->keyCache.dump(&sink);
+    context->callStats.dump(&sink);
+}
+
 /* Close an opened OpenSSL instance */
 static int tee_close(hw_device_t *dev) {
     keymaster0_device_t *keymaster_dev = (keymaster0_device_t *) dev;
     if (keymaster_dev != NULL) {
-        CK_SESSION_HANDLE handle = reinterpret_cast<CK_SESSION_HANDLE>(keymaster_dev->context);
-        if (handle != CK_INVALID_HANDLE) {
-            C_CloseSession(handle);
+        TeeContext* context = tee_context(keymaster_dev);
+        if (context != NULL) {
+            CK_SESSION_HANDLE handle = context->primary;
+            context->keygenLane.stop();
+            context->fastLane.stop();
+            forget_wrap_keys(context);
+
+            LogStatsSink sink;
+            context->subsessions.dump(&sink);
+            context->keyCache.dump(&sink);
+            context->callStats.dump(&sink);
+            delete context->pregenerator;
+            delete context;
+            if (handle != CK_INVALID_HANDLE) {
+                TEE_CALL(C_CloseSession, handle);
+            }
         }
     }
 
@@ -918,7 +4310,7 @@ static int tee_open(const hw_module_t* module, const char* name,
     dev->delete_keypair = tee_delete_keypair;
     dev->sign_data = tee_sign_data;
     dev->verify_data = tee_verify_data;
-    dev->delete_all = NULL;
+    dev->delete_all = tee_delete_all;
 
     CK_RV initializeRV = C_Initialize(NULL);
     if (initializeRV != CKR_OK) {
@@ -941,7 +4333,7 @@ static int tee_open(const hw_module_t* module, const char* name,
 
     CK_SESSION_HANDLE sessionHandle = CK_INVALID_HANDLE;
 
-    CK_RV openSessionRV = C_OpenSession(CKV_TOKEN_USER,
+    CK_RV openSessionRV = TEE_CALL(C_OpenSession, CKV_TOKEN_USER,
             CKF_SERIAL_SESSION | CKF_RW_SESSION,
             NULL,
             NULL,
@@ -956,7 +4348,22 @@ static int tee_open(const hw_module_t* module, const char* name,
     ERR_load_crypto_strings();
     ERR_load_BIO_strings();
 
-    dev->context = reinterpret_cast<void*>(sessionHandle);
+    TeeContext* context = new TeeContext(sessionHandle);
+    context->pregenerator = new KeyPregenerator(sessionHandle, &context->subsessions,
+            &context->callStats);
+
+    if (probe_tee_ec(context)) {
+        dev->flags |= KEYMASTER_SUPPORTS_EC;
+    }
+
+    char pregen[PROPERTY_VALUE_MAX];
+    property_get("persist.keymaster.pregen", pregen, "0");
+    context->pregenerator->start(atoi(pregen));
+
+    context->keygenLane.start();
+    context->fastLane.start();
+
+    dev->context = context;
     *device = reinterpret_cast<hw_device_t*>(dev.release());
 
     return 0;
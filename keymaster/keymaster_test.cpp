@@ -0,0 +1,205 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host stress test for the KeyHandleCache in keystore.grouper. Builds the
+ * HAL into this program on top of the fake token in fake_token.cpp, makes
+ * three times as many keys as the cache has entries and has a number of
+ * threads look them up, store and read back per-entry data, sign with
+ * them and drop them from the cache at random, all at once, so inserts,
+ * hits, evictions and invalidations race each other. Every handle the cache hands out is
+ * checked against the token to still name the key it was asked for, and
+ * at the end every handle the cache opened must have been closed. Exits
+ * non-zero if any check fails.
+ *
+ * usage: keymaster_grouper_test [-t threads] [-n iterations]
+ */
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "keymaster_grouper.cpp"
+
+#include "fake_token.h"
+
+#define TEST_KEYS (3 * KEY_CACHE_SIZE)
+
+struct TestKey {
+    uint8_t* blob;
+    size_t blobLength;
+    uint8_t id[ID_LENGTH];
+};
+
+static keymaster0_device_t* sDevice;
+static TestKey sKeys[TEST_KEYS];
+static size_t sIterations = 50000;
+static int sFailures;
+
+static void fail(const char* what, size_t key) {
+    fprintf(stderr, "FAIL %s, key %zu\n", what, key);
+    __sync_fetch_and_add(&sFailures, 1);
+}
+
+/** One thread's share of the test: random keys through KeyHandles and the cache. */
+static void* stress(void* arg) {
+    unsigned int seed = static_cast<unsigned int>(reinterpret_cast<uintptr_t>(arg));
+    TeeContext* context = tee_context(sDevice);
+
+    for (size_t i = 0; i < sIterations && sFailures == 0; i++) {
+        size_t key = rand_r(&seed) % TEST_KEYS;
+        const TestKey* testKey = &sKeys[key];
+        int action = rand_r(&seed) % 16;
+
+        if (action == 0) {
+            context->keyCache.invalidate(testKey->id);
+            continue;
+        }
+        if (action == 1) {
+            keymaster_ec_sign_params_t params;
+            params.digest_type = DIGEST_NONE;
+            uint8_t* signature;
+            size_t signatureLength;
+            if (sDevice->sign_data(sDevice, &params, testKey->blob, testKey->blobLength,
+                    testKey->id, ID_LENGTH, &signature, &signatureLength)) {
+                fail("sign_data", key);
+            } else {
+                free(signature);
+            }
+            continue;
+        }
+
+        CryptoSession session(context->primary, &context->subsessions);
+        KeyHandles handles(context, &session);
+        if (handles.restore(testKey->blob, testKey->blobLength)) {
+            fail("restore", key);
+            continue;
+        }
+        // Checked only now and then, as it serializes on the token and a hit otherwise doesn't.
+        if (action < 4 && (!handle_matches(&session, handles.publicKey(), testKey->id,
+                CKO_PUBLIC_KEY) || !handle_matches(&session, handles.privateKey(), testKey->id,
+                CKO_PRIVATE_KEY))) {
+            fail("handles name another key", key);
+        }
+
+        // The ID stands in for the public key DER, so a mix-up between entries shows.
+        uint8_t* der;
+        size_t derLength;
+        if (handles.copyPublicDer(&der, &derLength)) {
+            if (derLength != ID_LENGTH || memcmp(der, testKey->id, ID_LENGTH) != 0) {
+                fail("public key DER of another key", key);
+            }
+            free(der);
+        } else {
+            handles.setPublicDer(testKey->id, ID_LENGTH);
+        }
+    }
+    return NULL;
+}
+
+static void usage(const char* name) {
+    fprintf(stderr, "usage: %s [-t threads] [-n iterations]\n", name);
+    exit(2);
+}
+
+int main(int argc, char** argv) {
+    size_t threadCount = 8;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:n:")) != -1) {
+        switch (opt) {
+        case 't':
+            threadCount = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            sIterations = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (threadCount == 0 || sIterations == 0) {
+        usage(argv[0]);
+    }
+
+    const hw_module_t* module = &HAL_MODULE_INFO_SYM.common;
+    hw_device_t* device;
+    int rc = module->methods->open(module, KEYSTORE_KEYMASTER, &device);
+    if (rc != 0) {
+        fprintf(stderr, "couldn't open %s: %d\n", module->name, rc);
+        return 1;
+    }
+    sDevice = reinterpret_cast<keymaster0_device_t*>(device);
+    TeeContext* context = tee_context(sDevice);
+    size_t baseline = fake_token_open_handles();
+
+    keymaster_ec_keygen_params_t ecParams;
+    ecParams.field_size = 256;
+    for (size_t i = 0; i < TEST_KEYS; i++) {
+        TestKey* testKey = &sKeys[i];
+        KeyBlob blob;
+        if (sDevice->generate_keypair(sDevice, TYPE_EC, &ecParams, &testKey->blob,
+                &testKey->blobLength)
+                || keyblob_parse(testKey->blob, testKey->blobLength, &blob)) {
+            fprintf(stderr, "couldn't make key %zu\n", i);
+            return 1;
+        }
+        memcpy(testKey->id, blob.id, ID_LENGTH);
+    }
+
+    /*
+     * Closing the handles the new keys were cached with also makes the
+     * hints in their blobs stale for good, as the fake token bumps a
+     * handle's generation whenever it is reused, so every handle from here
+     * on is one the cache opened and has to close.
+     */
+    context->keyCache.invalidateAll();
+
+    pthread_t* threads = new pthread_t[threadCount];
+    for (size_t i = 0; i < threadCount; i++) {
+        if (pthread_create(&threads[i], NULL, stress, reinterpret_cast<void*>(i + 1))) {
+            fprintf(stderr, "couldn't start thread %zu\n", i);
+            return 1;
+        }
+    }
+    for (size_t i = 0; i < threadCount; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    delete[] threads;
+
+    keymaster_grouper_dump(sDevice, STDOUT_FILENO);
+    context->keyCache.invalidateAll();
+    size_t leaked = fake_token_open_handles() - baseline;
+    if (leaked != 0) {
+        fprintf(stderr, "FAIL %zu object handles left open\n", leaked);
+        sFailures++;
+    }
+
+    for (size_t i = 0; i < TEST_KEYS; i++) {
+        if (sDevice->delete_keypair(sDevice, sKeys[i].blob, sKeys[i].blobLength)) {
+            fprintf(stderr, "FAIL delete_keypair, key %zu\n", i);
+            sFailures++;
+        }
+        free(sKeys[i].blob);
+    }
+    sDevice->common.close(&sDevice->common);
+
+    if (sFailures != 0) {
+        fprintf(stderr, "%d checks failed\n", sFailures);
+        return 1;
+    }
+    printf("%zu threads, %zu iterations each: all checks passed\n", threadCount, sIterations);
+    return 0;
+}
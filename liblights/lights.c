@@ -18,8 +18,15 @@
 #define LOGE ALOGE
 
 #include <cutils/log.h>
+#include <cutils/properties.h>
 
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
@@ -31,12 +38,40 @@
 #include <hardware/lights.h>
 #include <hardware/hardware.h>
 
+#define BACKLIGHT_PATH "/sys/class/backlight/pwm-backlight/brightness"
+#define BACKLIGHT_RAMP_PROP "ro.lights.backlight_ramp"
+#define BACKLIGHT_CURVE_PATH "/system/etc/backlight_curve.conf"
+#define SMARTDIMMER_ENABLE "/sys/class/graphics/fb0/device/smartdimmer/enable"
+#define SMARTDIMMER_AGGRESSIVENESS "/sys/class/graphics/fb0/device/smartdimmer/aggressiveness"
+#define DIDIM_ENABLE_PROP "persist.tegra.didim.enable"
+/* Rough full-scale LED string current of the panel, for the estimates */
+#define BACKLIGHT_FULL_SCALE_MA 300
+#define AMBIENT_PROP "persist.lights.ambient"
+#define AMBIENT_LUX_PATH "/sys/devices/platform/tegra-i2c.2/i2c-2/2-001c/lux"
+#define AMBIENT_POLL_MS 1000
+#define AMBIENT_EMA_DIV 4
+/* One panel refresh at 60Hz; the worker writes at most once per frame */
+#define FRAME_USEC 16667
+/* The device is never closed, so the counters are logged every this many writes */
+#define BACKLIGHT_STATS_WRITES 500
+
 static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/*
+ * The backlight node is kept open and the last value written is cached,
+ * so repeated requests for the same level (auto-brightness settles on a
+ * value and keeps resending it every frame) never reach sysfs. All of
+ * this is protected by g_lock, except backlight_calls, which is counted
+ * per framework request before the worker coalesces them.
+ */
+static int backlight_fd = -1;
+static int last_brightness = -1;
+static atomic_ulong backlight_calls = ATOMIC_VAR_INIT(0);
+static unsigned long backlight_writes;
+
 static int write_int(char const *path, int value)
 {
 	int fd;
-	static int already_warned = -1;
 	fd = open(path, O_RDWR);
 	if (fd >= 0) {
 		char buffer[20];
@@ -44,13 +79,328 @@ static int write_int(char const *path, int value)
 		int amt = write(fd, buffer, bytes);
 		close(fd);
 		return amt == -1 ? -errno : 0;
-	} else {
-		if (already_warned == -1) {
-			LOGE("write_int failed to open %s\n", path);
-			already_warned = 1;
+	}
+	return -errno;
+}
+
+/*
+ * SmartDimmer (PRISM) lowers the backlight and boosts pixel values to
+ * compensate, so the same perceived brightness costs less LED current.
+ * It is only managed when persist.tegra.didim.enable is set. For UI,
+ * aggressiveness rises with the backlight level: low levels leave little
+ * to save and show the compensation most. Nothing on this device tells
+ * the HAL when video is playing, so the level follows the backlight only.
+ * Called with g_lock held whenever the backlight level changes.
+ */
+static int last_aggressiveness = -1;
+static int smartdimmer_saved_ma;
+
+static int smartdimmer_aggressiveness(int brightness)
+{
+	if (brightness <= 40)
+		return 0;
+	if (brightness <= 120)
+		return 1;
+	if (brightness <= 200)
+		return 2;
+	return 3;
+}
+
+static void update_smartdimmer(int brightness)
+{
+	char value[PROPERTY_VALUE_MAX];
+	int aggressiveness;
+
+	property_get(DIDIM_ENABLE_PROP, value, "0");
+	if (atoi(value) == 0) {
+		if (last_aggressiveness > 0)
+			write_int(SMARTDIMMER_ENABLE, 0);
+		last_aggressiveness = -1;
+		smartdimmer_saved_ma = 0;
+		return;
+	}
+
+	aggressiveness = smartdimmer_aggressiveness(brightness);
+	if (aggressiveness == last_aggressiveness)
+		return;
+
+	if (aggressiveness > 0) {
+		write_int(SMARTDIMMER_AGGRESSIVENESS, aggressiveness);
+		if (last_aggressiveness <= 0)
+			write_int(SMARTDIMMER_ENABLE, 1);
+	} else if (last_aggressiveness > 0) {
+		write_int(SMARTDIMMER_ENABLE, 0);
+	}
+	last_aggressiveness = aggressiveness;
+
+	/*
+	 * Estimate only: LED current is taken as linear in PWM duty and each
+	 * aggressiveness step as trimming up to 5% of it.
+	 */
+	smartdimmer_saved_ma = BACKLIGHT_FULL_SCALE_MA * brightness / 255 *
+			5 * aggressiveness / 100;
+}
+
+static void log_backlight_stats(void)
+{
+	ALOGD("backlight: %lu requests, %lu sysfs writes, smartdimmer "
+	      "aggressiveness %d saving up to ~%d mA (estimate)\n",
+	      atomic_load(&backlight_calls), backlight_writes,
+	      last_aggressiveness, smartdimmer_saved_ma);
+}
+
+static int write_backlight(int value)
+{
+	static int already_warned = -1;
+	char buffer[20];
+	int bytes, amt;
+
+	if (value == last_brightness)
+		return 0;
+
+	if (backlight_fd < 0) {
+		backlight_fd = open(BACKLIGHT_PATH, O_RDWR);
+		if (backlight_fd < 0) {
+			if (already_warned == -1) {
+				LOGE("write_backlight failed to open %s\n", BACKLIGHT_PATH);
+				already_warned = 1;
+			}
+			return -errno;
 		}
+	}
+
+	bytes = sprintf(buffer, "%d\n", value);
+	amt = pwrite(backlight_fd, buffer, bytes, 0);
+	if (amt == -1)
 		return -errno;
+
+	backlight_writes++;
+	if (backlight_writes % BACKLIGHT_STATS_WRITES == 0)
+		log_backlight_stats();
+	last_brightness = value;
+	update_smartdimmer(value);
+	return 0;
+}
+
+/*
+ * Power save curve: levels 160-255 are compressed linearly into 160-182,
+ * everything below is passed through. The table is expanded by the
+ * preprocessor so set_light_backlight() only does a lookup.
+ */
+#define PS(b) ((b) < 160 ? (b) : 160 + (182 - 160) * ((b) - 160) / (255 - 160))
+#define PS4(b) PS(b), PS((b) + 1), PS((b) + 2), PS((b) + 3)
+#define PS16(b) PS4(b), PS4((b) + 4), PS4((b) + 8), PS4((b) + 12)
+#define PS64(b) PS16(b), PS16((b) + 16), PS16((b) + 32), PS16((b) + 48)
+
+static uint8_t brightness_curve[256] = {
+	PS64(0), PS64(64), PS64(128), PS64(192),
+};
+
+/*
+ * Replace the compiled-in curve with one from BACKLIGHT_CURVE_PATH, if
+ * present. The file lists "input output" control points, one pair per
+ * line, with inputs increasing from 0 to 255; '#' starts a comment.
+ * Values between points are interpolated linearly.
+ */
+static void load_brightness_curve(void)
+{
+	FILE *fp;
+	char line[64];
+	int in[256], out[256];
+	int points = 0;
+	int i, p;
+
+	fp = fopen(BACKLIGHT_CURVE_PATH, "r");
+	if (!fp)
+		return;
+
+	while (points < 256 && fgets(line, sizeof(line), fp)) {
+		if (line[0] == '#')
+			continue;
+		if (sscanf(line, "%d %d", &in[points], &out[points]) != 2)
+			continue;
+		if (in[points] < 0 || in[points] > 255 ||
+		    out[points] < 0 || out[points] > 255 ||
+		    (points > 0 && in[points] <= in[points - 1])) {
+			LOGE("Bad control point in %s: %s", BACKLIGHT_CURVE_PATH, line);
+			fclose(fp);
+			return;
+		}
+		points++;
 	}
+	fclose(fp);
+
+	if (points < 2 || in[0] != 0 || in[points - 1] != 255) {
+		LOGE("%s must cover inputs 0 to 255\n", BACKLIGHT_CURVE_PATH);
+		return;
+	}
+
+	for (i = 0, p = 0; i < 256; i++) {
+		while (i > in[p + 1])
+			p++;
+		brightness_curve[i] = out[p] + (out[p + 1] - out[p]) *
+				(i - in[p]) / (in[p + 1] - in[p]);
+	}
+	ALOGI("Loaded %d point backlight curve from %s\n", points,
+	      BACKLIGHT_CURVE_PATH);
+}
+
+/*
+ * Optional in-HAL ambient adaptation, enabled with persist.lights.ambient.
+ * While the panel is on the worker reads the AL3010 lux value once per
+ * AMBIENT_POLL_MS, smooths it with an exponential moving average
+ * (alpha = 1/AMBIENT_EMA_DIV) and maps it through lux_points and the
+ * panel curve itself, so the framework doesn't have to wake up to run
+ * auto-brightness. Framework requests then only turn the panel on or off.
+ */
+static const struct {
+	int lux;
+	int level;
+} lux_points[] = {
+	{ 0, 10 }, { 10, 30 }, { 40, 60 }, { 100, 90 }, { 300, 130 },
+	{ 1000, 180 }, { 3000, 230 }, { 10000, 255 },
+};
+#define NUM_LUX_POINTS (int)(sizeof(lux_points) / sizeof(lux_points[0]))
+
+static bool ambient_mode;
+static int smoothed_lux = -1;
+
+static int read_lux(void)
+{
+	char buffer[20];
+	int fd, amt;
+
+	fd = open(AMBIENT_LUX_PATH, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	amt = read(fd, buffer, sizeof(buffer) - 1);
+	close(fd);
+	if (amt <= 0)
+		return -EIO;
+	buffer[amt] = '\0';
+	return atoi(buffer);
+}
+
+static int ambient_brightness(void)
+{
+	int lux = read_lux();
+	int i;
+
+	if (lux >= 0) {
+		if (smoothed_lux < 0)
+			smoothed_lux = lux;
+		else
+			smoothed_lux += (lux - smoothed_lux) / AMBIENT_EMA_DIV;
+	} else if (smoothed_lux < 0) {
+		return -1;
+	}
+
+	for (i = 1; i < NUM_LUX_POINTS - 1; i++)
+		if (smoothed_lux < lux_points[i].lux)
+			break;
+	if (smoothed_lux >= lux_points[i].lux)
+		return brightness_curve[lux_points[i].level];
+
+	return brightness_curve[lux_points[i - 1].level +
+			(lux_points[i].level - lux_points[i - 1].level) *
+			(smoothed_lux - lux_points[i - 1].lux) /
+			(lux_points[i].lux - lux_points[i - 1].lux)];
+}
+
+/*
+ * set_light_backlight() only publishes the requested level in
+ * requested_brightness and wakes the worker, so the framework thread
+ * never waits on sysfs. The worker takes the latest value, dropping any
+ * that were overwritten in between, and applies at most one write per
+ * frame. With ro.lights.backlight_ramp set to N > 0 it moves toward the
+ * target by at most N PWM steps per frame instead of jumping. Turning
+ * the panel off is always applied immediately. The worker's last write
+ * result is kept in backlight_error and returned by later requests, so a
+ * broken node is still reported to the framework.
+ */
+static atomic_int requested_brightness = ATOMIC_VAR_INIT(-1);
+static atomic_int backlight_error = ATOMIC_VAR_INIT(0);
+static pthread_mutex_t worker_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t worker_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t lighting_poll_thread;
+static bool worker_running;
+static bool worker_exit;
+static int ramp_step;
+
+static void *backlight_worker(void *arg __unused)
+{
+	int target = -1;
+	int current = -1;
+	int next, requested, level;
+	int ambient_target = -1;
+	bool panel_on = false;
+	bool sample_due;
+	struct timespec deadline;
+
+	for (;;) {
+		sample_due = false;
+		pthread_mutex_lock(&worker_lock);
+		while (!worker_exit && current == target &&
+		       atomic_load(&requested_brightness) < 0) {
+			if (!ambient_mode || !panel_on) {
+				pthread_cond_wait(&worker_cond, &worker_lock);
+				continue;
+			}
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += AMBIENT_POLL_MS / 1000;
+			deadline.tv_nsec += (AMBIENT_POLL_MS % 1000) * 1000000L;
+			if (deadline.tv_nsec >= 1000000000L) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000L;
+			}
+			if (pthread_cond_timedwait(&worker_cond, &worker_lock,
+						   &deadline) == ETIMEDOUT) {
+				sample_due = true;
+				break;
+			}
+		}
+		if (worker_exit) {
+			pthread_mutex_unlock(&worker_lock);
+			break;
+		}
+		pthread_mutex_unlock(&worker_lock);
+
+		requested = atomic_exchange(&requested_brightness, -1);
+		if (requested >= 0) {
+			target = requested;
+			if (panel_on != (requested > 0))
+				sample_due = true;
+			panel_on = requested > 0;
+			if (!panel_on) {
+				smoothed_lux = -1;
+				ambient_target = -1;
+			} else if (ambient_mode && ambient_target > 0) {
+				target = ambient_target;
+			}
+		}
+
+		if (ambient_mode && panel_on && sample_due) {
+			level = ambient_brightness();
+			if (level > 0)
+				target = ambient_target = level;
+		}
+
+		next = target;
+		if (ramp_step > 0 && current > 0 && target > 0) {
+			if (target > current + ramp_step)
+				next = current + ramp_step;
+			else if (target < current - ramp_step)
+				next = current - ramp_step;
+		}
+
+		pthread_mutex_lock(&g_lock);
+		atomic_store(&backlight_error, write_backlight(next));
+		pthread_mutex_unlock(&g_lock);
+		current = next;
+
+		usleep(FRAME_USEC);
+	}
+	return NULL;
 }
 
 static int rgb_to_brightness(struct light_state_t const *state)
@@ -65,43 +415,45 @@ static int set_light_backlight(struct light_device_t *dev,
 			       struct light_state_t const *state)
 {
 	int err = 0;
-	int brightness = rgb_to_brightness(state);
-	//+++ power save
-	int range_num = 1;
-	int old_brightness_range_indexs[] = {160,255};
-	int new_brightness_range_indexs[] = {160,182};
-	int old_brightness = brightness;
-	int i=0;
-	int old_brightness_in_range = -1;// 0:1~10 , 1:10~102 , 2:102~255
-	for(i=0;i<range_num;i++){
-		int t_range_min = old_brightness_range_indexs[i];
-		int t_range_max = old_brightness_range_indexs[i+1];
-		if( brightness>=t_range_min && brightness<=t_range_max){
-			old_brightness_in_range = i;
-			break;
-		}
-	}
-	if(old_brightness_in_range>=0){
-		int old_br_min = old_brightness_range_indexs[old_brightness_in_range];
-		int olb_br_max = old_brightness_range_indexs[old_brightness_in_range+1];
-		int new_br_min = new_brightness_range_indexs[old_brightness_in_range];
-		int new_br_max = new_brightness_range_indexs[old_brightness_in_range+1];
-		int new_brightness = new_br_min +
-				(new_br_max-new_br_min)*(old_brightness-old_br_min)/(olb_br_max-old_br_min);
-		brightness = new_brightness;
+	int brightness = brightness_curve[rgb_to_brightness(state)];
+
+	atomic_fetch_add(&backlight_calls, 1);
+	if (!worker_running) {
+		pthread_mutex_lock(&g_lock);
+		err = write_backlight(brightness);
+		pthread_mutex_unlock(&g_lock);
+		return err;
 	}
-	//---
-	pthread_mutex_lock(&g_lock);
-	err = write_int("/sys/class/backlight/pwm-backlight/brightness",
-			brightness);
-	pthread_mutex_unlock(&g_lock);
 
-	return err;
+	atomic_store(&requested_brightness, brightness);
+	pthread_mutex_lock(&worker_lock);
+	pthread_cond_signal(&worker_cond);
+	pthread_mutex_unlock(&worker_lock);
+
+	return atomic_load(&backlight_error);
 }
 
 /** Close the lights device */
 static int close_lights(struct light_device_t *dev)
 {
+	if (worker_running) {
+		pthread_mutex_lock(&worker_lock);
+		worker_exit = true;
+		pthread_cond_signal(&worker_cond);
+		pthread_mutex_unlock(&worker_lock);
+		pthread_join(lighting_poll_thread, NULL);
+		worker_running = false;
+	}
+
+	pthread_mutex_lock(&g_lock);
+	log_backlight_stats();
+	if (backlight_fd >= 0) {
+		close(backlight_fd);
+		backlight_fd = -1;
+	}
+	last_brightness = -1;
+	pthread_mutex_unlock(&g_lock);
+
 	if (dev)
 		free(dev);
 	return 0;
@@ -111,8 +463,7 @@ static int close_lights(struct light_device_t *dev)
 static int open_lights(const struct hw_module_t *module, char const *name,
 		       struct hw_device_t **device)
 {
-	pthread_t lighting_poll_thread;
-
+	char value[PROPERTY_VALUE_MAX];
 	int (*set_light) (struct light_device_t *dev,
 			  struct light_state_t const *state);
 
@@ -123,6 +474,24 @@ static int open_lights(const struct hw_module_t *module, char const *name,
 
 	pthread_mutex_init(&g_lock, NULL);
 
+	load_brightness_curve();
+
+	property_get(BACKLIGHT_RAMP_PROP, value, "0");
+	ramp_step = atoi(value);
+
+	property_get(AMBIENT_PROP, value, "0");
+	ambient_mode = atoi(value) != 0;
+
+	if (!worker_running) {
+		worker_exit = false;
+		atomic_store(&requested_brightness, -1);
+		if (pthread_create(&lighting_poll_thread, NULL,
+				   backlight_worker, NULL) == 0)
+			worker_running = true;
+		else
+			LOGE("Could not start backlight worker, writing inline\n");
+	}
+
 	struct light_device_t *dev = malloc(sizeof(struct light_device_t));
 	memset(dev, 0, sizeof(*dev));
 
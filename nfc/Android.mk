@@ -26,6 +26,7 @@ LOCAL_CFLAGS += -D$(TARGET_DEVICE)
 include $(BUILD_SHARED_LIBRARY)
 
 
+# Kept for NFC stacks that still dlopen() the image; see pn544_fw.bin below.
 include $(CLEAR_VARS)
 
 LOCAL_MODULE := libpn544_fw
@@ -35,3 +36,72 @@ LOCAL_MODULE_TAGS := optional
 LOCAL_CFLAGS := -Wall -Werror
 
 include $(BUILD_SHARED_LIBRARY)
+
+
+# Packs the same image as a raw file that libpn544_fw_loader maps read-only.
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := pn544_fw_pack
+LOCAL_SRC_FILES := pn544_fw_pack.c
+LOCAL_MODULE_TAGS := optional
+LOCAL_CFLAGS := -Wall -Werror
+
+include $(BUILD_HOST_EXECUTABLE)
+
+
+# Validates an image and dumps its segment map; run on every packed image.
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := pn544_fw_check
+LOCAL_SRC_FILES := pn544_fw_check.c pn544_fw_image.c
+LOCAL_STATIC_LIBRARIES := libmincrypt
+LOCAL_MODULE_TAGS := optional
+LOCAL_CFLAGS := -Wall -Werror
+
+include $(BUILD_HOST_EXECUTABLE)
+
+
+# Checks that every delta update of an image flashes what a full one does.
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := pn544_fw_update_test
+LOCAL_SRC_FILES := pn544_fw_update_test.c pn544_fw_loader.c pn544_fw_image.c \
+        pn544_fw_update.c
+LOCAL_STATIC_LIBRARIES := libmincrypt liblog
+LOCAL_MODULE_TAGS := optional
+LOCAL_CFLAGS := -Wall -Werror
+
+include $(BUILD_HOST_EXECUTABLE)
+
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := pn544_fw.bin
+LOCAL_MODULE_CLASS := ETC
+LOCAL_MODULE_PATH := $(TARGET_OUT_VENDOR)/firmware
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_SYSTEM)/base_rules.mk
+
+PN544_FW_PACK := $(HOST_OUT_EXECUTABLES)/pn544_fw_pack$(HOST_EXECUTABLE_SUFFIX)
+PN544_FW_CHECK := $(HOST_OUT_EXECUTABLES)/pn544_fw_check$(HOST_EXECUTABLE_SUFFIX)
+PN544_FW_UPDATE_TEST := $(HOST_OUT_EXECUTABLES)/pn544_fw_update_test$(HOST_EXECUTABLE_SUFFIX)
+$(LOCAL_BUILT_MODULE): $(PN544_FW_PACK) $(PN544_FW_CHECK) $(PN544_FW_UPDATE_TEST)
+	@echo "Pack: $@"
+	@mkdir -p $(dir $@)
+	$(hide) $(PN544_FW_PACK) $@
+	$(hide) $(PN544_FW_CHECK) $@ > $@.map || (rm -f $@; exit 1)
+	$(hide) $(PN544_FW_UPDATE_TEST) $@ > $@.update || (rm -f $@; exit 1)
+
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := libpn544_fw_loader
+LOCAL_SRC_FILES := pn544_fw_loader.c pn544_fw_image.c pn544_fw_update.c
+LOCAL_SHARED_LIBRARIES := liblog
+LOCAL_STATIC_LIBRARIES := libmincrypt
+LOCAL_EXPORT_C_INCLUDE_DIRS := $(LOCAL_PATH)
+LOCAL_MODULE_TAGS := optional
+LOCAL_CFLAGS := -Wall -Werror
+
+include $(BUILD_SHARED_LIBRARY)
@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+/*
+ * Host tool that validates a PN544 firmware image and prints its segment
+ * map. Takes a packed pn544_fw.bin, whose version is checked as well, or
+ * a bare image. Exits non-zero if the image would be rejected.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pn544_fw_image.h"
+#include "pn544_fw_loader.h"
+
+static uint8_t *read_file(const char *path, size_t *length) {
+    FILE *in = fopen(path, "rb");
+    uint8_t *data = NULL;
+    size_t capacity = 0;
+
+    if (in == NULL) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    *length = 0;
+    for (;;) {
+        size_t n;
+        if (*length == capacity) {
+            uint8_t *grown;
+            capacity = capacity ? capacity * 2 : 64 * 1024;
+            grown = realloc(data, capacity);
+            if (grown == NULL) {
+                fprintf(stderr, "%s: out of memory\n", path);
+                free(data);
+                fclose(in);
+                return NULL;
+            }
+            data = grown;
+        }
+        n = fread(data + *length, 1, capacity - *length, in);
+        if (n == 0) {
+            break;
+        }
+        *length += n;
+    }
+
+    if (ferror(in)) {
+        fprintf(stderr, "%s: read failed\n", path);
+        free(data);
+        data = NULL;
+    }
+    fclose(in);
+    return data;
+}
+
+static const char *cmd_name(uint8_t cmd) {
+    return cmd == PN544_FW_CMD_SECURE_WRITE ? "secure" : "write";
+}
+
+int main(int argc, char **argv) {
+    struct pn544_fw_info info;
+    const uint8_t *version = NULL;
+    size_t length, image_length, i;
+    uint8_t *data;
+    int result = 0;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <pn544_fw.bin | image>\n", argv[0]);
+        return 2;
+    }
+
+    data = read_file(argv[1], &length);
+    if (data == NULL) {
+        return 1;
+    }
+
+    image_length = length;
+    if (length > PN544_FW_TRAILER_LENGTH && memcmp(data + length - PN544_FW_MAGIC_LENGTH,
+            PN544_FW_MAGIC, PN544_FW_MAGIC_LENGTH) == 0) {
+        const uint8_t *trailer = data + length - PN544_FW_TRAILER_LENGTH;
+        const uint8_t *le = trailer + PN544_FW_VERSION_LENGTH;
+        image_length = length - PN544_FW_TRAILER_LENGTH;
+        if ((le[0] | (le[1] << 8) | (le[2] << 16) | ((uint32_t) le[3] << 24)) != image_length) {
+            fprintf(stderr, "%s: trailer doesn't match image length %zu\n", argv[1],
+                    image_length);
+            free(data);
+            return 1;
+        }
+        version = trailer;
+    }
+
+    if (pn544_fw_parse(data, image_length, &info)) {
+        fprintf(stderr, "%s: rejected at offset %zu: %s\n", argv[1], info.error_offset,
+                info.error);
+        free(data);
+        return 1;
+    }
+
+    printf("%s: version 0x%08x hw_comp 0x%02x patch 0x%02x, %zu frames, %zu segments\n",
+            argv[1], info.version, info.hw_comp, info.patch, info.frame_count,
+            info.segment_count);
+    printf("  %-6s  %-8s  %6s  %6s  %-10s\n", "cmd", "address", "length", "frames", "crc32");
+    for (i = 0; i < info.segment_count; i++) {
+        const struct pn544_fw_segment *segment = &info.segments[i];
+        printf("  %-6s  0x%06x  %6u  %6zu  0x%08x\n", cmd_name(segment->cmd), segment->address,
+                segment->length, segment->frame_count, segment->crc);
+    }
+
+    if (version != NULL) {
+        if (pn544_fw_check_version(&info, version, PN544_FW_VERSION_LENGTH)) {
+            fprintf(stderr, "%s: image version doesn't match nxp_nfc_full_version\n", argv[1]);
+            result = 1;
+        } else {
+            printf("version matches nxp_nfc_full_version\n");
+        }
+    }
+
+    pn544_fw_info_free(&info);
+    free(data);
+    return result;
+}
@@ -0,0 +1,274 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mincrypt/sha.h"
+
+#include "pn544_fw_image.h"
+
+#define IMAGE_HEADER_LENGTH 12
+#define FIRMWARE_HEADER_MIN_LENGTH 8
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+static void crc_table_init(void) {
+    uint32_t i, bit;
+
+    for (i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ ((crc & 1) ? 0xedb88320 : 0);
+        }
+        crc_table[i] = crc;
+    }
+}
+
+uint32_t pn544_fw_crc32(uint32_t crc, const uint8_t *data, size_t length) {
+    pthread_once(&crc_table_once, crc_table_init);
+
+    crc = ~crc;
+    while (length--) {
+        crc = crc_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static int fail(struct pn544_fw_info *info, const char *error, size_t offset) {
+    info->error = error;
+    info->error_offset = offset;
+    return -1;
+}
+
+static int is_write(uint8_t cmd) {
+    return cmd == PN544_FW_CMD_WRITE || cmd == PN544_FW_CMD_SECURE_WRITE;
+}
+
+/* Splits the records into frames; counts them first if frames is NULL. */
+static int parse_records(const uint8_t *image, size_t offset, size_t length,
+        struct pn544_fw_info *info, struct pn544_fw_frame *frames, size_t *count) {
+    size_t n = 0;
+
+    while (offset < length) {
+        size_t header_length = image[offset];
+        size_t frame_offset = offset + header_length;
+        size_t payload_length;
+
+        if (header_length < PN544_FW_RECORD_HEADER_LENGTH) {
+            return fail(info, "bad record header length", offset);
+        }
+        if (frame_offset + PN544_FW_FRAME_HEADER_LENGTH > length) {
+            return fail(info, "truncated record header", offset);
+        }
+        payload_length = (image[frame_offset + 1] << 8) | image[frame_offset + 2];
+        if (frame_offset + PN544_FW_FRAME_HEADER_LENGTH + payload_length > length) {
+            return fail(info, "truncated frame", offset);
+        }
+
+        if (frames != NULL) {
+            struct pn544_fw_frame *frame = &frames[n];
+            memset(frame, 0, sizeof(*frame));
+            frame->frame = image + frame_offset;
+            frame->frame_length = PN544_FW_FRAME_HEADER_LENGTH + payload_length;
+            frame->timeout = (image[offset + 6] << 8) | image[offset + 7];
+            frame->cmd = image[frame_offset];
+        }
+        n++;
+        offset = frame_offset + PN544_FW_FRAME_HEADER_LENGTH + payload_length;
+    }
+
+    *count = n;
+    return 0;
+}
+
+/* Fills in the write fields and checks each write's data fits its frame. */
+static int parse_writes(const uint8_t *image, struct pn544_fw_info *info) {
+    size_t i;
+
+    for (i = 0; i < info->frame_count; i++) {
+        struct pn544_fw_frame *frame = &info->frames[i];
+        const uint8_t *payload = frame->frame + PN544_FW_FRAME_HEADER_LENGTH;
+        size_t payload_length = frame->frame_length - PN544_FW_FRAME_HEADER_LENGTH;
+        size_t offset = frame->frame - image;
+        size_t trailer_length;
+
+        if (!is_write(frame->cmd)) {
+            continue;
+        }
+        if (payload_length < PN544_FW_WRITE_HEADER_LENGTH) {
+            return fail(info, "short write frame", offset);
+        }
+
+        frame->address = (payload[0] << 16) | (payload[1] << 8) | payload[2];
+        frame->data_length = (payload[3] << 8) | payload[4];
+        frame->data = payload + PN544_FW_WRITE_HEADER_LENGTH;
+
+        if (PN544_FW_WRITE_HEADER_LENGTH + frame->data_length > payload_length) {
+            return fail(info, "write data overruns frame", offset);
+        }
+        trailer_length = payload_length - PN544_FW_WRITE_HEADER_LENGTH - frame->data_length;
+
+        if (frame->cmd == PN544_FW_CMD_WRITE) {
+            if (trailer_length != 0) {
+                return fail(info, "write data length doesn't match frame", offset);
+            }
+        } else if (trailer_length == PN544_FW_HASH_LENGTH
+                || trailer_length == PN544_FW_HASH_LENGTH + PN544_FW_SIGNATURE_LENGTH) {
+            frame->hash = frame->data + frame->data_length;
+        } else if (trailer_length != 0) {
+            return fail(info, "secure write trailer has a bad length", offset);
+        }
+    }
+
+    return 0;
+}
+
+/* Each secure write but the last carries the SHA-1 of the next one. */
+static int check_hash_chain(const uint8_t *image, struct pn544_fw_info *info) {
+    const struct pn544_fw_frame *previous = NULL;
+    size_t i;
+
+    for (i = 0; i < info->frame_count; i++) {
+        const struct pn544_fw_frame *frame = &info->frames[i];
+        uint8_t digest[SHA_DIGEST_SIZE];
+
+        if (frame->cmd != PN544_FW_CMD_SECURE_WRITE) {
+            continue;
+        }
+        if (previous != NULL) {
+            if (previous->hash == NULL) {
+                return fail(info, "secure write chain ends early", previous->frame - image);
+            }
+            SHA_hash(frame->frame, frame->frame_length, digest);
+            if (memcmp(previous->hash, digest, PN544_FW_HASH_LENGTH) != 0) {
+                return fail(info, "secure write hash chain broken", frame->frame - image);
+            }
+        }
+        previous = frame;
+    }
+
+    if (previous != NULL && previous->hash != NULL) {
+        return fail(info, "secure write chain has no end", previous->frame - image);
+    }
+    return 0;
+}
+
+static int build_segments(struct pn544_fw_info *info) {
+    size_t i;
+
+    info->segments = calloc(info->frame_count, sizeof(*info->segments));
+    if (info->segments == NULL && info->frame_count != 0) {
+        return fail(info, "out of memory", 0);
+    }
+
+    for (i = 0; i < info->frame_count; i++) {
+        const struct pn544_fw_frame *frame = &info->frames[i];
+        struct pn544_fw_segment *segment = info->segment_count == 0
+                ? NULL : &info->segments[info->segment_count - 1];
+
+        if (!is_write(frame->cmd)) {
+            continue;
+        }
+
+        if (segment == NULL || segment->cmd != frame->cmd
+                || segment->first_frame + segment->frame_count != i
+                || segment->address + segment->length != frame->address) {
+            segment = &info->segments[info->segment_count++];
+            segment->cmd = frame->cmd;
+            segment->address = frame->address;
+            segment->first_frame = i;
+        }
+        segment->length += frame->data_length;
+        segment->frame_count++;
+        segment->crc = pn544_fw_crc32(segment->crc, frame->data, frame->data_length);
+    }
+
+    return 0;
+}
+
+int pn544_fw_parse(const uint8_t *image, size_t length, struct pn544_fw_info *info) {
+    size_t firmware_offset, firmware_length, records_offset;
+    size_t count;
+
+    memset(info, 0, sizeof(*info));
+
+    if (length < IMAGE_HEADER_LENGTH) {
+        return fail(info, "truncated image header", 0);
+    }
+    if (memcmp(image, PN544_FW_MAGIC_NXP, 3) != 0 || image[3] != PN544_FW_FORMAT) {
+        return fail(info, "not a PN544 firmware image", 0);
+    }
+
+    firmware_offset = 4 + image[4];
+    if (firmware_offset < IMAGE_HEADER_LENGTH
+            || firmware_offset + FIRMWARE_HEADER_MIN_LENGTH > length) {
+        return fail(info, "bad firmware header offset", 4);
+    }
+    firmware_length = image[firmware_offset] * 4;
+    records_offset = firmware_offset + firmware_length;
+    if (firmware_length < FIRMWARE_HEADER_MIN_LENGTH || records_offset > length) {
+        return fail(info, "bad firmware header length", firmware_offset);
+    }
+    if (image[firmware_offset + 1] != 0) {
+        return fail(info, "sectioned firmware images are not supported", firmware_offset + 1);
+    }
+
+    info->hw_comp = image[firmware_offset + 2];
+    info->patch = image[firmware_offset + 3];
+    info->version = image[firmware_offset + 4] | (image[firmware_offset + 5] << 8)
+            | (image[firmware_offset + 6] << 16) | ((uint32_t) image[firmware_offset + 7] << 24);
+
+    if (parse_records(image, records_offset, length, info, NULL, &count)) {
+        return -1;
+    }
+    info->frames = calloc(count, sizeof(*info->frames));
+    if (info->frames == NULL && count != 0) {
+        return fail(info, "out of memory", 0);
+    }
+    parse_records(image, records_offset, length, info, info->frames, &info->frame_count);
+
+    if (parse_writes(image, info) || check_hash_chain(image, info) || build_segments(info)) {
+        const char *error = info->error;
+        size_t error_offset = info->error_offset;
+        pn544_fw_info_free(info);
+        return fail(info, error, error_offset);
+    }
+
+    return 0;
+}
+
+void pn544_fw_info_free(struct pn544_fw_info *info) {
+    free(info->frames);
+    free(info->segments);
+    memset(info, 0, sizeof(*info));
+}
+
+int pn544_fw_check_version(const struct pn544_fw_info *info, const uint8_t *full_version,
+        size_t full_version_length) {
+    if (full_version_length < 8) {
+        return -1;
+    }
+    if (full_version[0] != ((info->version >> 16) & 0xff)
+            || full_version[1] != info->hw_comp
+            || full_version[6] != ((info->version >> 8) & 0xff)
+            || full_version[7] != (info->version & 0xff)) {
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#ifndef PN544_FW_IMAGE_H
+#define PN544_FW_IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Layout of the nxp_nfc_fw container. Multi-byte values are big-endian
+ * unless noted.
+ *
+ * Image header:
+ *   uint8_t  magic[3]          "NXP"
+ *   uint8_t  format            0x11
+ *   uint8_t  data_offset       from the end of format to the firmware header
+ *   uint8_t  firmware_count    1
+ *   uint8_t  pad[2]
+ *   uint8_t  compat[4]         hardware compatibility table entry
+ *
+ * Firmware header, at 4 + data_offset:
+ *   uint8_t  header_words      length of this header in 32-bit words
+ *   uint8_t  section_count     0: the firmware is a stream of frames
+ *   uint8_t  hw_comp           hardware compatibility number
+ *   uint8_t  patch
+ *   uint32_t version           little-endian
+ *
+ * Then records up to the end of the image, each a record header followed
+ * by one download mode frame as it is sent to the chip:
+ *   uint8_t  header_length     PN544_FW_RECORD_HEADER_LENGTH
+ *   uint8_t  reserved[5]
+ *   uint16_t timeout           response timeout for the frame
+ *   uint8_t  cmd               PN544_FW_CMD_*
+ *   uint16_t length            of the payload
+ *   uint8_t  payload[length]
+ *
+ * Write payloads are a 24-bit address, a 16-bit data length and the data.
+ * Secure writes follow the data with the SHA-1 of the next secure write
+ * frame, except the last, and the first also with a 128-byte signature.
+ * The chip checks that chain, so the frames are validated the same way.
+ */
+#define PN544_FW_MAGIC_NXP "NXP"
+#define PN544_FW_FORMAT 0x11
+#define PN544_FW_RECORD_HEADER_LENGTH 8
+#define PN544_FW_FRAME_HEADER_LENGTH 3
+#define PN544_FW_WRITE_HEADER_LENGTH 5
+#define PN544_FW_HASH_LENGTH 20
+#define PN544_FW_SIGNATURE_LENGTH 128
+
+#define PN544_FW_CMD_RESET          0x01
+#define PN544_FW_CMD_WRITE          0x08
+#define PN544_FW_CMD_SECURE_WRITE   0x0C
+
+struct pn544_fw_frame {
+    const uint8_t *frame;           // cmd, length and payload
+    size_t frame_length;
+    uint16_t timeout;
+    uint8_t cmd;
+
+    // Write and secure write frames only.
+    uint32_t address;
+    const uint8_t *data;
+    size_t data_length;
+    const uint8_t *hash;            // secure writes other than the last
+};
+
+/* A run of writes of one kind to contiguous addresses. */
+struct pn544_fw_segment {
+    uint8_t cmd;
+    uint32_t address;
+    uint32_t length;
+    size_t first_frame;
+    size_t frame_count;
+    uint32_t crc;                   // pn544_fw_crc32() of the data
+};
+
+struct pn544_fw_info {
+    uint8_t hw_comp;
+    uint8_t patch;
+    uint32_t version;
+
+    struct pn544_fw_frame *frames;
+    size_t frame_count;
+    struct pn544_fw_segment *segments;
+    size_t segment_count;
+
+    // Why and where parsing failed.
+    const char *error;
+    size_t error_offset;
+};
+
+/*
+ * Parses and validates a whole image, so a corrupt or truncated one is
+ * rejected before anything is flashed. Returns 0, or -1 with error and
+ * error_offset set. frames and data point into image.
+ */
+int pn544_fw_parse(const uint8_t *image, size_t length, struct pn544_fw_info *info);
+
+void pn544_fw_info_free(struct pn544_fw_info *info);
+
+/*
+ * Checks the header against nxp_nfc_full_version, which starts with the
+ * ROM code version (version bits 16-23) and hw_comp and has the low 16
+ * bits of the version big-endian at offset 6. Returns 0 on a match.
+ */
+int pn544_fw_check_version(const struct pn544_fw_info *info, const uint8_t *full_version,
+        size_t full_version_length);
+
+/* Table-driven CRC-32 (IEEE 802.3); pass 0 to start. */
+uint32_t pn544_fw_crc32(uint32_t crc, const uint8_t *data, size_t length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PN544_FW_IMAGE_H
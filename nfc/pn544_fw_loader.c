@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#define LOG_TAG "pn544_fw"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <cutils/log.h>
+
+#include "pn544_fw_loader.h"
+
+static uint32_t read_le32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+int pn544_fw_open(const char *path, struct pn544_fw *fw) {
+    struct stat st;
+    const uint8_t *trailer;
+    void *map;
+    int fd;
+
+    memset(fw, 0, sizeof(*fw));
+    if (path == NULL) {
+        path = PN544_FW_PATH;
+    }
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        int err = errno;
+        ALOGE("Error opening %s: %s", path, strerror(err));
+        return -err;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        int err = errno;
+        ALOGE("Error reading size of %s: %s", path, strerror(err));
+        close(fd);
+        return -err;
+    }
+
+    if (st.st_size <= PN544_FW_TRAILER_LENGTH) {
+        ALOGE("%s is too short to hold firmware (%lld bytes)", path, (long long) st.st_size);
+        close(fd);
+        return -EINVAL;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        int err = errno;
+        ALOGE("Error mapping %s: %s", path, strerror(err));
+        return -err;
+    }
+
+    trailer = (const uint8_t *) map + st.st_size - PN544_FW_TRAILER_LENGTH;
+    if (memcmp(trailer + PN544_FW_VERSION_LENGTH + 4, PN544_FW_MAGIC,
+            PN544_FW_MAGIC_LENGTH) != 0
+            || read_le32(trailer + PN544_FW_VERSION_LENGTH)
+                    != (uint64_t) st.st_size - PN544_FW_TRAILER_LENGTH) {
+        ALOGE("%s is not a packed PN544 firmware file", path);
+        munmap(map, st.st_size);
+        return -EINVAL;
+    }
+
+    // Validating reads the image front to back, as does flashing it.
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    if (pn544_fw_parse(map, st.st_size - PN544_FW_TRAILER_LENGTH, &fw->info)) {
+        ALOGE("%s: image rejected at offset %zu: %s", path, fw->info.error_offset,
+                fw->info.error);
+        munmap(map, st.st_size);
+        memset(fw, 0, sizeof(*fw));
+        return -EINVAL;
+    }
+    if (pn544_fw_check_version(&fw->info, trailer, PN544_FW_VERSION_LENGTH)) {
+        ALOGE("%s: image version 0x%08x doesn't match its full version", path,
+                fw->info.version);
+        pn544_fw_info_free(&fw->info);
+        munmap(map, st.st_size);
+        return -EINVAL;
+    }
+
+    fw->map = map;
+    fw->map_length = st.st_size;
+    fw->image = map;
+    fw->image_length = st.st_size - PN544_FW_TRAILER_LENGTH;
+    fw->version = trailer;
+    fw->version_length = PN544_FW_VERSION_LENGTH;
+    return 0;
+}
+
+void pn544_fw_close(struct pn544_fw *fw) {
+    pn544_fw_info_free(&fw->info);
+    if (fw->map != NULL) {
+        munmap(fw->map, fw->map_length);
+    }
+    memset(fw, 0, sizeof(*fw));
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#ifndef PN544_FW_LOADER_H
+#define PN544_FW_LOADER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pn544_fw_image.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * pn544_fw.bin holds the nxp_nfc_fw image byte for byte as pn544_fw.c
+ * has it, followed by a fixed-size trailer:
+ *
+ *   uint8_t  version[PN544_FW_VERSION_LENGTH]  nxp_nfc_full_version
+ *   uint32_t image_length                      little-endian
+ *   char     magic[PN544_FW_MAGIC_LENGTH]      PN544_FW_MAGIC
+ *
+ * It is generated at build time by pn544_fw_pack from pn544_fw.c.
+ */
+#define PN544_FW_PATH "/vendor/firmware/pn544_fw.bin"
+
+#define PN544_FW_VERSION_LENGTH 12
+#define PN544_FW_MAGIC "PN544FW1"
+#define PN544_FW_MAGIC_LENGTH 8
+#define PN544_FW_TRAILER_LENGTH (PN544_FW_VERSION_LENGTH + 4 + PN544_FW_MAGIC_LENGTH)
+
+/*
+ * A firmware file mapped read-only. image, version and everything in info
+ * point into the mapping and stay valid until pn544_fw_close().
+ */
+struct pn544_fw {
+    const uint8_t *image;           // nxp_nfc_fw
+    size_t image_length;
+    const uint8_t *version;         // nxp_nfc_full_version
+    size_t version_length;
+    struct pn544_fw_info info;      // the parsed image
+
+    void *map;
+    size_t map_length;
+};
+
+/*
+ * Maps the firmware file at path, or PN544_FW_PATH if path is NULL, and
+ * parses and validates the image against its version. Returns 0, or a
+ * negative errno value with fw left closed.
+ */
+int pn544_fw_open(const char *path, struct pn544_fw *fw);
+
+void pn544_fw_close(struct pn544_fw *fw);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PN544_FW_LOADER_H
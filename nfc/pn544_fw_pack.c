@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+/*
+ * Host tool that writes the firmware compiled into pn544_fw.c out as the
+ * pn544_fw.bin file described in pn544_fw_loader.h.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "pn544_fw_loader.h"
+
+// Included rather than linked so the array sizes are known here.
+#include "pn544_fw.c"
+
+typedef char version_length_matches[
+        sizeof(nxp_nfc_full_version) == PN544_FW_VERSION_LENGTH ? 1 : -1];
+
+int main(int argc, char **argv) {
+    uint32_t length = sizeof(nxp_nfc_fw);
+    uint8_t length_le[4];
+    FILE *out;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <pn544_fw.bin>\n", argv[0]);
+        return 2;
+    }
+
+    out = fopen(argv[1], "wb");
+    if (out == NULL) {
+        fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+
+    length_le[0] = length;
+    length_le[1] = length >> 8;
+    length_le[2] = length >> 16;
+    length_le[3] = length >> 24;
+
+    if (fwrite(nxp_nfc_fw, 1, sizeof(nxp_nfc_fw), out) != sizeof(nxp_nfc_fw)
+            || fwrite(nxp_nfc_full_version, 1, PN544_FW_VERSION_LENGTH, out)
+                    != PN544_FW_VERSION_LENGTH
+            || fwrite(length_le, 1, sizeof(length_le), out) != sizeof(length_le)
+            || fwrite(PN544_FW_MAGIC, 1, PN544_FW_MAGIC_LENGTH, out) != PN544_FW_MAGIC_LENGTH
+            || fclose(out) != 0) {
+        fprintf(stderr, "%s: write failed: %s\n", argv[1], strerror(errno));
+        remove(argv[1]);
+        return 1;
+    }
+
+    return 0;
+}
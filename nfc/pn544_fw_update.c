@@ -0,0 +1,509 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#define LOG_TAG "pn544_fw"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <cutils/log.h>
+
+#include "pn544_fw_update.h"
+
+/*
+ * Manifest file, all values little-endian:
+ *   char     magic[8]          MANIFEST_MAGIC
+ *   uint8_t  hw_comp
+ *   uint8_t  pad[3]
+ *   uint32_t version
+ *   uint32_t segment_count
+ *   segment_count entries of
+ *     uint8_t  cmd
+ *     uint8_t  pad[3]
+ *     uint32_t address
+ *     uint32_t length
+ *     uint32_t crc
+ *   uint32_t crc               pn544_fw_crc32() of everything before it
+ */
+#define MANIFEST_MAGIC "PN544MF1"
+#define MANIFEST_MAGIC_LENGTH 8
+#define MANIFEST_HEADER_LENGTH 20
+#define MANIFEST_ENTRY_LENGTH 16
+#define MANIFEST_MAX_SEGMENTS 1024
+
+static uint32_t read_le32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void write_le32(uint8_t *p, uint32_t value) {
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+static int sync_parent(const char *path) {
+    char dir[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+    int fd, result = 0;
+
+    if (slash == NULL) {
+        strcpy(dir, ".");
+    } else if (slash == path) {
+        strcpy(dir, "/");
+    } else if ((size_t) (slash - path) < sizeof(dir)) {
+        memcpy(dir, path, slash - path);
+        dir[slash - path] = '\0';
+    } else {
+        return -ENAMETOOLONG;
+    }
+
+    fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return -errno;
+    }
+    if (fsync(fd) < 0) {
+        result = -errno;
+    }
+    close(fd);
+    return result;
+}
+
+int pn544_fw_manifest_load(const char *path, struct pn544_fw_manifest *manifest) {
+    struct stat st;
+    uint8_t *data;
+    size_t length, count, i;
+    ssize_t n;
+    int fd;
+
+    memset(manifest, 0, sizeof(*manifest));
+    if (path == NULL) {
+        path = PN544_FW_MANIFEST_PATH;
+    }
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        int err = errno;
+        if (err != ENOENT) {
+            ALOGE("Error opening %s: %s", path, strerror(err));
+        }
+        return -err;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        int err = errno;
+        ALOGE("Error reading size of %s: %s", path, strerror(err));
+        close(fd);
+        return -err;
+    }
+    if (st.st_size < MANIFEST_HEADER_LENGTH + 4 || st.st_size > MANIFEST_HEADER_LENGTH
+            + MANIFEST_MAX_SEGMENTS * MANIFEST_ENTRY_LENGTH + 4) {
+        ALOGE("%s has a bad size (%lld bytes)", path, (long long) st.st_size);
+        close(fd);
+        return -EINVAL;
+    }
+
+    length = st.st_size;
+    data = malloc(length);
+    if (data == NULL) {
+        close(fd);
+        return -ENOMEM;
+    }
+    n = TEMP_FAILURE_RETRY(read(fd, data, length));
+    close(fd);
+    if (n < 0) {
+        int err = errno;
+        ALOGE("Error reading %s: %s", path, strerror(err));
+        free(data);
+        return -err;
+    }
+
+    count = (size_t) n < MANIFEST_HEADER_LENGTH ? 0 : read_le32(data + 16);
+    if ((size_t) n != length || memcmp(data, MANIFEST_MAGIC, MANIFEST_MAGIC_LENGTH) != 0
+            || count > MANIFEST_MAX_SEGMENTS
+            || length != MANIFEST_HEADER_LENGTH + count * MANIFEST_ENTRY_LENGTH + 4
+            || read_le32(data + length - 4) != pn544_fw_crc32(0, data, length - 4)) {
+        ALOGE("%s is damaged", path);
+        free(data);
+        return -EINVAL;
+    }
+
+    manifest->segments = calloc(count, sizeof(*manifest->segments));
+    if (manifest->segments == NULL && count != 0) {
+        free(data);
+        return -ENOMEM;
+    }
+    manifest->hw_comp = data[8];
+    manifest->version = read_le32(data + 12);
+    manifest->segment_count = count;
+    for (i = 0; i < count; i++) {
+        const uint8_t *entry = data + MANIFEST_HEADER_LENGTH + i * MANIFEST_ENTRY_LENGTH;
+        struct pn544_fw_segment *segment = &manifest->segments[i];
+        segment->cmd = entry[0];
+        segment->address = read_le32(entry + 4);
+        segment->length = read_le32(entry + 8);
+        segment->crc = read_le32(entry + 12);
+    }
+
+    free(data);
+    return 0;
+}
+
+int pn544_fw_manifest_save(const char *path, const struct pn544_fw_info *info) {
+    char temp[PATH_MAX];
+    size_t length, i;
+    uint8_t *data;
+    ssize_t n;
+    int fd, err = 0;
+
+    if (path == NULL) {
+        path = PN544_FW_MANIFEST_PATH;
+    }
+    if (info->segment_count > MANIFEST_MAX_SEGMENTS) {
+        return -EINVAL;
+    }
+    if (snprintf(temp, sizeof(temp), "%s.tmp", path) >= (int) sizeof(temp)) {
+        return -ENAMETOOLONG;
+    }
+
+    length = MANIFEST_HEADER_LENGTH + info->segment_count * MANIFEST_ENTRY_LENGTH + 4;
+    data = calloc(1, length);
+    if (data == NULL) {
+        return -ENOMEM;
+    }
+    memcpy(data, MANIFEST_MAGIC, MANIFEST_MAGIC_LENGTH);
+    data[8] = info->hw_comp;
+    write_le32(data + 12, info->version);
+    write_le32(data + 16, info->segment_count);
+    for (i = 0; i < info->segment_count; i++) {
+        uint8_t *entry = data + MANIFEST_HEADER_LENGTH + i * MANIFEST_ENTRY_LENGTH;
+        const struct pn544_fw_segment *segment = &info->segments[i];
+        entry[0] = segment->cmd;
+        write_le32(entry + 4, segment->address);
+        write_le32(entry + 8, segment->length);
+        write_le32(entry + 12, segment->crc);
+    }
+    write_le32(data + length - 4, pn544_fw_crc32(0, data, length - 4));
+
+    fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        err = errno;
+        ALOGE("Error creating %s: %s", temp, strerror(err));
+        free(data);
+        return -err;
+    }
+    n = TEMP_FAILURE_RETRY(write(fd, data, length));
+    if (n < 0 || (size_t) n != length || fsync(fd) < 0) {
+        err = n < 0 || (size_t) n == length ? errno : EIO;
+    }
+    if (close(fd) < 0 && err == 0) {
+        err = errno;
+    }
+    free(data);
+
+    if (err == 0 && rename(temp, path) < 0) {
+        err = errno;
+    }
+    if (err != 0) {
+        ALOGE("Error writing %s: %s", path, strerror(err));
+        unlink(temp);
+        return -err;
+    }
+    return sync_parent(path);
+}
+
+int pn544_fw_manifest_remove(const char *path) {
+    if (path == NULL) {
+        path = PN544_FW_MANIFEST_PATH;
+    }
+    if (unlink(path) < 0) {
+        int err = errno;
+        if (err == ENOENT) {
+            return 0;
+        }
+        ALOGE("Error removing %s: %s", path, strerror(err));
+        return -err;
+    }
+    // The removal has to be on disk before flashing starts.
+    return sync_parent(path);
+}
+
+void pn544_fw_manifest_free(struct pn544_fw_manifest *manifest) {
+    free(manifest->segments);
+    memset(manifest, 0, sizeof(*manifest));
+}
+
+/*
+ * Whether the image writes the same segments in the same order as the
+ * flashed one did, so that each segment can be compared with the entry
+ * in its place. Otherwise what is left in flash can't be worked out.
+ */
+static int same_layout(const struct pn544_fw_info *info,
+        const struct pn544_fw_manifest *manifest) {
+    size_t i;
+
+    if (manifest->segment_count != info->segment_count) {
+        return 0;
+    }
+    for (i = 0; i < info->segment_count; i++) {
+        const struct pn544_fw_segment *flashed = &manifest->segments[i];
+        const struct pn544_fw_segment *segment = &info->segments[i];
+        if (flashed->cmd != segment->cmd || flashed->address != segment->address
+                || flashed->length != segment->length) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int overlaps(const struct pn544_fw_segment *a, const struct pn544_fw_segment *b) {
+    return a->address < b->address + b->length && b->address < a->address + a->length;
+}
+
+/*
+ * Keeps every segment that has to be sent again because one it depends
+ * on is: a later write over the same range, as the last write is what
+ * stays in flash, and the rest of the secure chain.
+ */
+static void keep_dependents(const struct pn544_fw_info *info, uint8_t *keep) {
+    int changed;
+    size_t i, j;
+
+    do {
+        changed = 0;
+        for (i = 0; i < info->segment_count; i++) {
+            if (!keep[i]) {
+                continue;
+            }
+            for (j = 0; j < info->segment_count; j++) {
+                if (keep[j]) {
+                    continue;
+                }
+                if ((j > i && overlaps(&info->segments[i], &info->segments[j]))
+                        || (info->segments[i].cmd == PN544_FW_CMD_SECURE_WRITE
+                                && info->segments[j].cmd == PN544_FW_CMD_SECURE_WRITE)) {
+                    keep[j] = 1;
+                    changed = 1;
+                }
+            }
+        }
+    } while (changed);
+}
+
+/* Whether the chip is running what the manifest says was flashed. */
+static int manifest_current(const struct pn544_fw_info *info,
+        const struct pn544_fw_manifest *manifest, const uint8_t *chip_version,
+        size_t chip_version_length) {
+    struct pn544_fw_info flashed;
+
+    if (manifest == NULL || chip_version == NULL || manifest->hw_comp != info->hw_comp) {
+        return 0;
+    }
+    memset(&flashed, 0, sizeof(flashed));
+    flashed.hw_comp = manifest->hw_comp;
+    flashed.version = manifest->version;
+    return pn544_fw_check_version(&flashed, chip_version, chip_version_length) == 0;
+}
+
+static void emit(struct pn544_fw_plan *plan, const uint8_t *frame, size_t frame_length,
+        uint16_t timeout) {
+    struct pn544_fw_plan_frame *out = &plan->frames[plan->frame_count++];
+    out->frame = frame;
+    out->frame_length = frame_length;
+    out->timeout = timeout;
+    plan->bytes += frame_length;
+}
+
+/*
+ * Streams the data of consecutive plain writes into frames of up to
+ * capacity data bytes, starting a new frame whenever the address jumps.
+ */
+struct write_packer {
+    struct pn544_fw_plan *plan;
+    size_t capacity;
+    uint8_t *next;                  // free space in plan->buffer
+    uint8_t *frame;                 // frame being filled, or NULL
+    uint32_t end;                   // address after its last byte
+};
+
+static void packer_finish(struct write_packer *packer) {
+    struct pn544_fw_plan_frame *out;
+    size_t data_length;
+
+    if (packer->frame == NULL) {
+        return;
+    }
+    out = &packer->plan->frames[packer->plan->frame_count - 1];
+    data_length = packer->next - packer->frame - PN544_FW_FRAME_HEADER_LENGTH
+            - PN544_FW_WRITE_HEADER_LENGTH;
+    packer->frame[1] = (PN544_FW_WRITE_HEADER_LENGTH + data_length) >> 8;
+    packer->frame[2] = PN544_FW_WRITE_HEADER_LENGTH + data_length;
+    packer->frame[6] = data_length >> 8;
+    packer->frame[7] = data_length;
+    out->frame_length = packer->next - packer->frame;
+    packer->plan->bytes += out->frame_length;
+    packer->frame = NULL;
+}
+
+static void packer_add(struct write_packer *packer, const struct pn544_fw_frame *frame) {
+    const uint8_t *data = frame->data;
+    size_t remaining = frame->data_length;
+    uint32_t address = frame->address;
+
+    if (packer->frame != NULL && packer->end != address) {
+        packer_finish(packer);
+    }
+    while (remaining > 0) {
+        size_t used, chunk;
+
+        if (packer->frame == NULL) {
+            uint8_t *out = packer->next;
+            out[0] = PN544_FW_CMD_WRITE;
+            out[3] = address >> 16;
+            out[4] = address >> 8;
+            out[5] = address;
+            packer->frame = out;
+            packer->next += PN544_FW_FRAME_HEADER_LENGTH + PN544_FW_WRITE_HEADER_LENGTH;
+            emit(packer->plan, out, 0, 0);
+        }
+
+        // Timeouts are per frame, so a merged frame waits for the longest.
+        if (packer->plan->frames[packer->plan->frame_count - 1].timeout < frame->timeout) {
+            packer->plan->frames[packer->plan->frame_count - 1].timeout = frame->timeout;
+        }
+
+        used = packer->next - packer->frame - PN544_FW_FRAME_HEADER_LENGTH
+                - PN544_FW_WRITE_HEADER_LENGTH;
+        chunk = packer->capacity - used;
+        if (chunk > remaining) {
+            chunk = remaining;
+        }
+        memcpy(packer->next, data, chunk);
+        packer->next += chunk;
+        data += chunk;
+        address += chunk;
+        remaining -= chunk;
+
+        if (used + chunk == packer->capacity) {
+            packer_finish(packer);
+        }
+    }
+    packer->end = address;
+}
+
+int pn544_fw_plan_update(const struct pn544_fw_info *info,
+        const struct pn544_fw_manifest *manifest, const uint8_t *chip_version,
+        size_t chip_version_length, size_t max_frame_length, struct pn544_fw_plan *plan) {
+    struct write_packer packer;
+    uint8_t *keep = NULL;
+    size_t write_bytes = 0, write_frames = 0, buffer_length, segment = 0, i;
+    int any_changed = 0;
+
+    memset(plan, 0, sizeof(*plan));
+    if (max_frame_length == 0) {
+        max_frame_length = PN544_FW_MAX_FRAME_LENGTH;
+    }
+    if (max_frame_length <= PN544_FW_FRAME_HEADER_LENGTH + PN544_FW_WRITE_HEADER_LENGTH) {
+        return -1;
+    }
+
+    plan->full = !manifest_current(info, manifest, chip_version, chip_version_length)
+            || !same_layout(info, manifest);
+
+    keep = calloc(info->segment_count, 1);
+    if (keep == NULL && info->segment_count != 0) {
+        return -1;
+    }
+    for (i = 0; i < info->segment_count; i++) {
+        keep[i] = plan->full || manifest->segments[i].crc != info->segments[i].crc;
+        any_changed |= keep[i];
+    }
+    if (!any_changed) {
+        free(keep);
+        return 0;
+    }
+    keep_dependents(info, keep);
+
+    for (i = 0; i < info->segment_count; i++) {
+        const struct pn544_fw_segment *segment = &info->segments[i];
+        if (!keep[i]) {
+            plan->skipped_segments++;
+            plan->skipped_bytes += segment->length;
+        } else if (segment->cmd == PN544_FW_CMD_WRITE) {
+            write_bytes += segment->length;
+            write_frames += segment->frame_count;
+        }
+    }
+
+    // Repacking makes at most one frame more per original frame plus one
+    // per full frame of data, each with a header.
+    packer.capacity = max_frame_length - PN544_FW_FRAME_HEADER_LENGTH
+            - PN544_FW_WRITE_HEADER_LENGTH;
+    write_frames += write_bytes / packer.capacity + 1;
+    buffer_length = write_bytes
+            + write_frames * (PN544_FW_FRAME_HEADER_LENGTH + PN544_FW_WRITE_HEADER_LENGTH);
+    plan->frames = calloc(info->frame_count + write_frames, sizeof(*plan->frames));
+    plan->buffer = malloc(buffer_length);
+    if (plan->frames == NULL || plan->buffer == NULL) {
+        free(keep);
+        pn544_fw_plan_free(plan);
+        return -1;
+    }
+    packer.plan = plan;
+    packer.next = plan->buffer;
+    packer.frame = NULL;
+    packer.end = 0;
+
+    for (i = 0; i < info->frame_count; i++) {
+        const struct pn544_fw_frame *frame = &info->frames[i];
+
+        if (frame->cmd != PN544_FW_CMD_WRITE && frame->cmd != PN544_FW_CMD_SECURE_WRITE) {
+            packer_finish(&packer);
+            emit(plan, frame->frame, frame->frame_length, frame->timeout);
+            continue;
+        }
+
+        // Segments cover the write frames in order.
+        while (info->segments[segment].first_frame + info->segments[segment].frame_count <= i) {
+            segment++;
+        }
+        if (!keep[segment]) {
+            continue;
+        }
+        if (frame->cmd == PN544_FW_CMD_WRITE) {
+            packer_add(&packer, frame);
+        } else {
+            packer_finish(&packer);
+            emit(plan, frame->frame, frame->frame_length, frame->timeout);
+        }
+    }
+    packer_finish(&packer);
+
+    free(keep);
+    return 0;
+}
+
+void pn544_fw_plan_free(struct pn544_fw_plan *plan) {
+    free(plan->frames);
+    free(plan->buffer);
+    memset(plan, 0, sizeof(*plan));
+}
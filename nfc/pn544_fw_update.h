@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#ifndef PN544_FW_UPDATE_H
+#define PN544_FW_UPDATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pn544_fw_image.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The chip can't report what is in its flash beyond the version, so the
+ * segments of the last image flashed are recorded here once the flash
+ * completes. The sequence for an update is:
+ *
+ *   pn544_fw_manifest_load()       -ENOENT forces a full update
+ *   pn544_fw_plan_update()
+ *   pn544_fw_manifest_remove()     before the first frame is sent
+ *   send plan.frames in order
+ *   pn544_fw_manifest_save()       only if every frame succeeded
+ */
+#define PN544_FW_MANIFEST_PATH "/data/nfc/pn544_fw.manifest"
+
+/* Largest frame the pn544 driver takes in one i2c transfer. */
+#define PN544_FW_MAX_FRAME_LENGTH 512
+
+struct pn544_fw_manifest {
+    uint8_t hw_comp;
+    uint32_t version;
+    struct pn544_fw_segment *segments;  // first_frame and frame_count unused
+    size_t segment_count;
+};
+
+/*
+ * Reads the manifest at path, or PN544_FW_MANIFEST_PATH if path is NULL.
+ * Returns 0, or a negative errno value with manifest empty; -EINVAL if
+ * the file is damaged.
+ */
+int pn544_fw_manifest_load(const char *path, struct pn544_fw_manifest *manifest);
+
+/* Records the segments of info as flashed; written atomically. */
+int pn544_fw_manifest_save(const char *path, const struct pn544_fw_info *info);
+
+/* Forgets what is flashed, so an interrupted update isn't trusted. */
+int pn544_fw_manifest_remove(const char *path);
+
+void pn544_fw_manifest_free(struct pn544_fw_manifest *manifest);
+
+struct pn544_fw_plan_frame {
+    const uint8_t *frame;           // cmd, length and payload
+    size_t frame_length;
+    uint16_t timeout;
+};
+
+struct pn544_fw_plan {
+    struct pn544_fw_plan_frame *frames;
+    size_t frame_count;
+    size_t bytes;                   // sum of frame_length
+
+    int full;                       // nothing on the chip could be reused
+    size_t skipped_segments;
+    size_t skipped_bytes;           // write data not sent again
+
+    uint8_t *buffer;                // backs the merged write frames
+};
+
+/*
+ * Works out which frames of info need sending to bring the chip up to
+ * date. manifest may be NULL, and chip_version is the full version the
+ * chip reports; unless it matches the manifest everything is sent.
+ *
+ * Segments are compared with the manifest entry in the same place, and
+ * everything is sent unless the image has the same segment layout. A
+ * segment that changed is sent along with every later one that writes
+ * over the same range. The secure writes form one hash chain that the
+ * chip checks from the start, so they are sent all together or not at
+ * all. Other frames are always kept, in order.
+ *
+ * Runs of plain writes to contiguous addresses are repacked into frames
+ * of up to max_frame_length bytes, or PN544_FW_MAX_FRAME_LENGTH if it is
+ * 0, to save round trips.
+ *
+ * An empty plan means the chip is up to date. Returns 0, or -1 if out of
+ * memory. Frames point into info's image or plan->buffer.
+ */
+int pn544_fw_plan_update(const struct pn544_fw_info *info,
+        const struct pn544_fw_manifest *manifest, const uint8_t *chip_version,
+        size_t chip_version_length, size_t max_frame_length, struct pn544_fw_plan *plan);
+
+void pn544_fw_plan_free(struct pn544_fw_plan *plan);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PN544_FW_UPDATE_H
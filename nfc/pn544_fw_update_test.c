@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+/*
+ * Host check that a delta update leaves the chip's flash as a full flash
+ * would. For each segment of a packed pn544_fw.bin it simulates a chip
+ * flashed with an image that differs only in that segment, applies the
+ * planned update, and compares the result with a full flash. Exits
+ * non-zero on any difference.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pn544_fw_loader.h"
+#include "pn544_fw_update.h"
+
+// Write addresses are 24 bits.
+#define FLASH_SIZE (1 << 24)
+
+static void write_frame(uint8_t *flash, const uint8_t *frame, size_t frame_length) {
+    uint32_t address;
+    size_t length;
+
+    if (frame[0] != PN544_FW_CMD_WRITE && frame[0] != PN544_FW_CMD_SECURE_WRITE) {
+        return;
+    }
+    if (frame_length < PN544_FW_FRAME_HEADER_LENGTH + PN544_FW_WRITE_HEADER_LENGTH) {
+        return;
+    }
+    address = (frame[3] << 16) | (frame[4] << 8) | frame[5];
+    length = (frame[6] << 8) | frame[7];
+    memcpy(flash + address, frame + PN544_FW_FRAME_HEADER_LENGTH
+            + PN544_FW_WRITE_HEADER_LENGTH, length);
+}
+
+/* Flashes every frame, with the data of segment stale inverted if set. */
+static void flash_full(uint8_t *flash, const struct pn544_fw_info *info,
+        const struct pn544_fw_segment *stale) {
+    size_t i, j;
+
+    memset(flash, 0xff, FLASH_SIZE);
+    for (i = 0; i < info->frame_count; i++) {
+        const struct pn544_fw_frame *frame = &info->frames[i];
+        write_frame(flash, frame->frame, frame->frame_length);
+        if (stale != NULL && i >= stale->first_frame
+                && i < stale->first_frame + stale->frame_count) {
+            for (j = 0; j < frame->data_length; j++) {
+                flash[frame->address + j] = ~frame->data[j];
+            }
+        }
+    }
+}
+
+static int check_segment(const struct pn544_fw *fw, size_t index, uint8_t *chip,
+        const uint8_t *expected) {
+    const struct pn544_fw_info *info = &fw->info;
+    struct pn544_fw_manifest manifest;
+    struct pn544_fw_plan plan;
+    size_t i;
+    int result = 0;
+
+    manifest.hw_comp = info->hw_comp;
+    manifest.version = info->version;
+    manifest.segment_count = info->segment_count;
+    manifest.segments = malloc(info->segment_count * sizeof(*manifest.segments));
+    if (manifest.segments == NULL) {
+        return -1;
+    }
+    memcpy(manifest.segments, info->segments, info->segment_count * sizeof(*info->segments));
+    manifest.segments[index].crc = ~manifest.segments[index].crc;
+
+    if (pn544_fw_plan_update(info, &manifest, fw->version, fw->version_length, 0, &plan)) {
+        fprintf(stderr, "segment %zu: planning failed\n", index);
+        free(manifest.segments);
+        return -1;
+    }
+
+    flash_full(chip, info, &info->segments[index]);
+    for (i = 0; i < plan.frame_count; i++) {
+        write_frame(chip, plan.frames[i].frame, plan.frames[i].frame_length);
+    }
+    if (plan.full || memcmp(chip, expected, FLASH_SIZE) != 0) {
+        fprintf(stderr, "segment %zu at 0x%06x: delta update differs from a full flash\n",
+                index, info->segments[index].address);
+        result = -1;
+    } else {
+        printf("  segment %2zu at 0x%06x: %3zu frames, %5zu bytes, %2zu segments skipped\n",
+                index, info->segments[index].address, plan.frame_count, plan.bytes,
+                plan.skipped_segments);
+    }
+
+    pn544_fw_plan_free(&plan);
+    free(manifest.segments);
+    return result;
+}
+
+int main(int argc, char **argv) {
+    struct pn544_fw fw;
+    struct pn544_fw_plan plan;
+    uint8_t *chip, *expected;
+    size_t i;
+    int result = 0;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <pn544_fw.bin>\n", argv[0]);
+        return 2;
+    }
+    if (pn544_fw_open(argv[1], &fw)) {
+        return 1;
+    }
+
+    chip = malloc(FLASH_SIZE);
+    expected = malloc(FLASH_SIZE);
+    if (chip == NULL || expected == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    flash_full(expected, &fw.info, NULL);
+
+    // With no manifest, everything goes and the result is the same.
+    if (pn544_fw_plan_update(&fw.info, NULL, fw.version, fw.version_length, 0, &plan)) {
+        fprintf(stderr, "planning failed\n");
+        return 1;
+    }
+    memset(chip, 0xff, FLASH_SIZE);
+    for (i = 0; i < plan.frame_count; i++) {
+        write_frame(chip, plan.frames[i].frame, plan.frames[i].frame_length);
+    }
+    if (!plan.full || memcmp(chip, expected, FLASH_SIZE) != 0) {
+        fprintf(stderr, "full update differs from the image\n");
+        result = 1;
+    }
+    printf("%s: full update %zu frames, %zu bytes\n", argv[1], plan.frame_count, plan.bytes);
+    pn544_fw_plan_free(&plan);
+
+    for (i = 0; i < fw.info.segment_count; i++) {
+        if (check_segment(&fw, i, chip, expected)) {
+            result = 1;
+        }
+    }
+
+    free(chip);
+    free(expected);
+    pn544_fw_close(&fw);
+    return result;
+}
@@ -25,3 +25,16 @@ LOCAL_SRC_FILES := power.c
 LOCAL_MODULE := power.grouper
 LOCAL_MODULE_TAGS := optional
 include $(BUILD_SHARED_LIBRARY)
+
+# Host test bench: runs the HAL against a scratch sysfs tree and a fake
+# uevent source, checks the result and times hint-to-write latency.
+ifeq ($(HOST_OS),linux)
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := power_test.c
+LOCAL_MODULE := power_test
+LOCAL_MODULE_TAGS := optional
+LOCAL_STATIC_LIBRARIES := liblog libcutils
+LOCAL_LDLIBS := -lpthread
+include $(BUILD_HOST_EXECUTABLE)
+endif
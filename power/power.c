@@ -14,7 +14,9 @@
  * limitations under the License.
  */
 #include <errno.h>
+#include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -25,6 +27,8 @@
 #include <linux/netlink.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <limits.h>
+#include <time.h>
 
 #define LOG_TAG "Grouper PowerHAL"
 #include <utils/Log.h>
@@ -42,11 +46,51 @@
 #define LOW_POWER_MAX_FREQ "640000"
 #define LOW_POWER_MIN_FREQ "51000"
 #define NORMAL_MAX_FREQ "1300000"
+#define SUSTAINED_MAX_FREQ "1000000"
+#define SUSTAINED_CORE_COUNT "2"
+/*
+ * The balanced governor drops the core lock once its period runs out, and
+ * writing the trigger starts a new period. Sustained mode re-arms it well
+ * inside the period rather than relying on one long period, which would
+ * lapse after about 35 minutes at the largest value the driver takes.
+ */
+#define SUSTAINED_CORE_LOCK_PERIOD "60000000"
+#define SUSTAINED_RELOCK_MSEC 30000
+#define CPU_USER_CAP "/sys/module/cpu_tegra/parameters/cpu_user_cap"
+#define INTERACTIVE_GO_HISPEED_LOAD "/sys/devices/system/cpu/cpufreq/interactive/go_hispeed_load"
+#define INTERACTIVE_HISPEED_FREQ "/sys/devices/system/cpu/cpufreq/interactive/hispeed_freq"
+#define CPUQUIET_CORE_LOCK_PERIOD "/sys/devices/system/cpu/cpuquiet/balanced/core_lock_period"
+#define CPUQUIET_CORE_LOCK_COUNT "/sys/devices/system/cpu/cpuquiet/balanced/core_lock_count"
 #define UEVENT_STRING "online@/devices/system/cpu/"
+#define CPUQUIET_IDLE_TOP_FREQ "/sys/devices/system/cpu/cpuquiet/tegra_cpuquiet/idle_top_freq"
+#define CPUQUIET_IDLE_BOTTOM_FREQ "/sys/devices/system/cpu/cpuquiet/tegra_cpuquiet/idle_bottom_freq"
+#define PROC_STAT "/proc/stat"
+/* LP cluster frequency window used while the screen is off */
+#define LP_IDLE_TOP_FREQ "475000"
+#define LP_IDLE_BOTTOM_FREQ "340000"
+/* Screen-off load sampling and hysteresis for the LP/G decision */
+#define LP_SAMPLE_USEC 500000
+#define LP_HIGH_LOAD 60
+#define LP_LOW_LOAD 25
+#define LP_UP_SAMPLES 3
+#define LP_DOWN_SAMPLES 6
+
+/* Not defined by the power HAL headers this device builds against */
+#define POWER_HINT_SUSTAINED_PERFORMANCE 0x00000006
 
 static int boost_fd = -1;
 static int boost_warned;
 
+/*
+ * Prefix prepended to every sysfs path and the source of cpu hotplug
+ * uevents. On device these are "" and the kernel netlink socket; a host
+ * harness that #includes this file can point them at a scratch directory
+ * and one end of a socketpair before calling init.
+ */
+static const char *sysfs_root = "";
+static int uevent_open_netlink(void);
+static int (*uevent_open)(void) = uevent_open_netlink;
+
 static struct pollfd pfd;
 static char *cpu_path_min[] = {
     "/sys/devices/system/cpu/cpu0/cpufreq/scaling_min_freq",
@@ -64,11 +108,61 @@ static bool freq_set[TOTAL_CPUS];
 static bool low_power_mode = false;
 static pthread_mutex_t low_power_mode_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/*
+ * Sustained performance mode holds the clock at a level the SoC can keep
+ * without thermal throttling and locks the core count, so long-running
+ * work sees a steady rate instead of bursting to NORMAL_MAX_FREQ and then
+ * being throttled. Protected by low_power_mode_lock, like screen_on.
+ */
+static bool sustained_perf_mode = false;
+static bool screen_on = true;
+static pthread_cond_t sustained_perf_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t sustained_relock_tid;
+/* How often the core lock is re-armed; a host harness can shorten it */
+static unsigned int sustained_relock_msec = SUSTAINED_RELOCK_MSEC;
+
+/*
+ * Light background work (audio playback, sync) with the screen off is
+ * left on the LP companion core. The policy thread samples /proc/stat and
+ * only forces the G cluster after LP_UP_SAMPLES busy samples in a row,
+ * handing back to LP after LP_DOWN_SAMPLES quiet ones, so short bursts
+ * don't bounce the cluster and starve the audio pipeline.
+ */
+static bool light_background = false;
+static bool lp_forced_g = false;
+static char default_idle_top_freq[16];
+static char default_idle_bottom_freq[16];
+static pthread_cond_t light_background_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t lp_policy_tid;
+
+/*
+ * Paces the policy thread between /proc/stat samples. A host harness can
+ * replace it to step the thread through one sample at a time.
+ */
+static void lp_sample_sleep(void)
+{
+    usleep(LP_SAMPLE_USEC);
+}
+static void (*lp_sample_wait)(void) = lp_sample_sleep;
+
 static int sysfs_write(char *path, char *s)
 {
     char buf[80];
+    char full_path[PATH_MAX];
     int len;
-    int fd = open(path, O_WRONLY);
+    int fd;
+
+    /*
+     * A scratch tree holds regular files, which unlike sysfs attributes
+     * keep the tail of a longer earlier value, so truncate those.
+     */
+    if (sysfs_root[0]) {
+        snprintf(full_path, sizeof(full_path), "%s%s", sysfs_root, path);
+        path = full_path;
+        fd = open(path, O_WRONLY | O_TRUNC);
+    } else {
+        fd = open(path, O_WRONLY);
+    }
 
     if (fd < 0) {
         strerror_r(errno, buf, sizeof(buf));
@@ -87,21 +181,41 @@ static int sysfs_write(char *path, char *s)
     return 0;
 }
 
-static int uevent_event()
+static int sysfs_read(char *path, char *s, int num_bytes)
 {
-    char msg[UEVENT_MSG_LEN];
-    char *cp;
-    int n, cpu, ret, retry = RETRY_TIME_CHANGING_FREQ;
+    char buf[80];
+    char full_path[PATH_MAX];
+    int count;
+    int fd;
 
-    n = recv(pfd.fd, msg, UEVENT_MSG_LEN, MSG_DONTWAIT);
-    if (n <= 0) {
+    if (sysfs_root[0]) {
+        snprintf(full_path, sizeof(full_path), "%s%s", sysfs_root, path);
+        path = full_path;
+    }
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        strerror_r(errno, buf, sizeof(buf));
+        ALOGE("Error opening %s: %s\n", path, buf);
         return -1;
     }
-    if (n >= UEVENT_MSG_LEN) {   /* overflow -- discard */
+
+    count = read(fd, s, num_bytes - 1);
+    if (count < 0) {
+        strerror_r(errno, buf, sizeof(buf));
+        ALOGE("Error reading %s: %s\n", path, buf);
+        close(fd);
         return -1;
     }
+    s[count] = '\0';
 
-    cp = msg;
+    close(fd);
+    return 0;
+}
+
+static int uevent_handle(const char *cp)
+{
+    int n, cpu, ret, retry = RETRY_TIME_CHANGING_FREQ;
 
     if (strstr(cp, UEVENT_STRING)) {
         n = strlen(cp);
@@ -140,6 +254,23 @@ static int uevent_event()
     return 0;
 }
 
+static int uevent_event()
+{
+    char msg[UEVENT_MSG_LEN];
+    int n;
+
+    n = recv(pfd.fd, msg, UEVENT_MSG_LEN, MSG_DONTWAIT);
+    if (n <= 0) {
+        return -1;
+    }
+    if (n >= UEVENT_MSG_LEN) {   /* overflow -- discard */
+        return -1;
+    }
+    msg[n] = '\0';
+
+    return uevent_handle(msg);
+}
+
 void *thread_uevent(__attribute__((unused)) void *x)
 {
     while (1) {
@@ -161,26 +292,160 @@ void *thread_uevent(__attribute__((unused)) void *x)
 }
 
 
-static void uevent_init()
+static int uevent_open_netlink(void)
 {
     struct sockaddr_nl client;
-    pthread_t tid;
-    pfd.fd = socket(PF_NETLINK, SOCK_DGRAM, NETLINK_KOBJECT_UEVENT);
+    int fd = socket(PF_NETLINK, SOCK_DGRAM, NETLINK_KOBJECT_UEVENT);
 
-    if (pfd.fd < 0) {
+    if (fd < 0) {
         ALOGE("%s: failed to open: %s", __func__, strerror(errno));
-        return;
+        return -1;
     }
     memset(&client, 0, sizeof(struct sockaddr_nl));
-    pthread_create(&tid, NULL, thread_uevent, NULL);
     client.nl_family = AF_NETLINK;
-    client.nl_pid = tid;
+    client.nl_pid = 0;
     client.nl_groups = -1;
+    if (bind(fd, (void *)&client, sizeof(struct sockaddr_nl)) < 0) {
+        ALOGE("%s: failed to bind: %s", __func__, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void uevent_init()
+{
+    pthread_t tid;
+
+    pfd.fd = uevent_open();
+    if (pfd.fd < 0)
+        return;
+
     pfd.events = POLLIN;
-    bind(pfd.fd, (void *)&client, sizeof(struct sockaddr_nl));
+    pthread_create(&tid, NULL, thread_uevent, NULL);
     return;
 }
 
+/* Returns the busy percentage across all cpus since the previous call */
+static int sample_cpu_load(unsigned long long *prev_busy, unsigned long long *prev_total)
+{
+    char buf[256];
+    unsigned long long user, nice, system, idle, iowait, irq, softirq;
+    unsigned long long busy, total, d_total;
+    int load;
+
+    if (sysfs_read(PROC_STAT, buf, sizeof(buf)) < 0)
+        return -1;
+
+    if (sscanf(buf, "cpu %llu %llu %llu %llu %llu %llu %llu", &user, &nice,
+               &system, &idle, &iowait, &irq, &softirq) != 7)
+        return -1;
+
+    busy = user + nice + system + irq + softirq;
+    total = busy + idle + iowait;
+    d_total = total - *prev_total;
+    load = d_total ? (int)((busy - *prev_busy) * 100 / d_total) : 0;
+
+    *prev_busy = busy;
+    *prev_total = total;
+    return load;
+}
+
+static void set_lp_window(bool light)
+{
+    if (light) {
+        sysfs_write(CPUQUIET_IDLE_TOP_FREQ, LP_IDLE_TOP_FREQ);
+        sysfs_write(CPUQUIET_IDLE_BOTTOM_FREQ, LP_IDLE_BOTTOM_FREQ);
+    } else if (default_idle_top_freq[0] && default_idle_bottom_freq[0]) {
+        sysfs_write(CPUQUIET_IDLE_BOTTOM_FREQ, default_idle_bottom_freq);
+        sysfs_write(CPUQUIET_IDLE_TOP_FREQ, default_idle_top_freq);
+    }
+}
+
+/* Called with low_power_mode_lock held */
+static void set_light_background(bool on)
+{
+    if (on == light_background)
+        return;
+
+    light_background = on;
+    lp_forced_g = false;
+    set_lp_window(on);
+    if (on)
+        pthread_cond_signal(&light_background_cond);
+}
+
+void *thread_lp_policy(__attribute__((unused)) void *x)
+{
+    unsigned long long prev_busy = 0, prev_total = 0;
+    int busy_samples = 0, quiet_samples = 0;
+    int load;
+
+    while (1) {
+        pthread_mutex_lock(&low_power_mode_lock);
+        while (!light_background) {
+            pthread_cond_wait(&light_background_cond, &low_power_mode_lock);
+            busy_samples = quiet_samples = 0;
+            sample_cpu_load(&prev_busy, &prev_total);
+        }
+        pthread_mutex_unlock(&low_power_mode_lock);
+
+        lp_sample_wait();
+
+        load = sample_cpu_load(&prev_busy, &prev_total);
+        if (load < 0)
+            continue;
+
+        if (load >= LP_HIGH_LOAD) {
+            busy_samples++;
+            quiet_samples = 0;
+        } else if (load <= LP_LOW_LOAD) {
+            quiet_samples++;
+            busy_samples = 0;
+        } else {
+            busy_samples = quiet_samples = 0;
+        }
+
+        pthread_mutex_lock(&low_power_mode_lock);
+        if (light_background) {
+            if (!lp_forced_g && busy_samples >= LP_UP_SAMPLES) {
+                sysfs_write(CPUQUIET_DISABLE_LP_CLUSTER, "1");
+                lp_forced_g = true;
+            } else if (lp_forced_g && quiet_samples >= LP_DOWN_SAMPLES) {
+                sysfs_write(CPUQUIET_DISABLE_LP_CLUSTER, "0");
+                lp_forced_g = false;
+            }
+        }
+        pthread_mutex_unlock(&low_power_mode_lock);
+    }
+    return NULL;
+}
+
+void *thread_sustained_relock(__attribute__((unused)) void *x)
+{
+    struct timespec deadline;
+
+    pthread_mutex_lock(&low_power_mode_lock);
+    while (1) {
+        while (!sustained_perf_mode)
+            pthread_cond_wait(&sustained_perf_cond, &low_power_mode_lock);
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += sustained_relock_msec / 1000;
+        deadline.tv_nsec += (sustained_relock_msec % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        /* Toggling the mode signals the cond and restarts the interval */
+        if (pthread_cond_timedwait(&sustained_perf_cond, &low_power_mode_lock,
+                                   &deadline) == ETIMEDOUT && sustained_perf_mode)
+            sysfs_write(CPUQUIET_CORE_LOCKER, "1");
+    }
+    return NULL;
+}
+
 static void grouper_power_init( __attribute__((unused)) struct power_module *module)
 {
     /*
@@ -193,11 +458,11 @@ static void grouper_power_init( __attribute__((unused)) struct power_module *mod
                 "50000");
     sysfs_write("/sys/devices/system/cpu/cpufreq/interactive/min_sample_time",
                 "500000");
-    sysfs_write("/sys/devices/system/cpu/cpufreq/interactive/go_hispeed_load",
+    sysfs_write(INTERACTIVE_GO_HISPEED_LOAD,
                 "75");
     sysfs_write("/sys/devices/system/cpu/cpufreq/interactive/above_hispeed_delay",
                 "20000");
-    sysfs_write("/sys/devices/system/cpu/cpufreq/interactive/hispeed_freq",
+    sysfs_write(INTERACTIVE_HISPEED_FREQ,
                 "1300000");
     sysfs_write("/sys/devices/system/cpu/cpufreq/interactive/target_loads",
                 "45 1000000:65 1100000:75");
@@ -205,11 +470,11 @@ static void grouper_power_init( __attribute__((unused)) struct power_module *mod
                 "1");
     sysfs_write("/sys/devices/system/cpu/cpuquiet/tegra_cpuquiet/enable",
                 "1");
-    sysfs_write("/sys/devices/system/cpu/cpuquiet/balanced/core_lock_period",
+    sysfs_write(CPUQUIET_CORE_LOCK_PERIOD,
                 "3000000");
-    sysfs_write("/sys/devices/system/cpu/cpuquiet/balanced/core_lock_count",
+    sysfs_write(CPUQUIET_CORE_LOCK_COUNT,
                 "2");
-    sysfs_write("/sys/devices/system/cpu/cpuquiet/balanced/core_lock_trigger",
+    sysfs_write(CPUQUIET_CORE_LOCKER,
                 "1");
     sysfs_write(CPUQUIET_DISABLE_LP_CLUSTER,
                 "0");
@@ -220,34 +485,88 @@ static void grouper_power_init( __attribute__((unused)) struct power_module *mod
     sysfs_write("/sys/module/cpuidle_t3/parameters/lp2_n_in_idle",
                 "1");
     uevent_init();
+
+    /* Remember the kernel's window so it can be restored with the screen on */
+    if (sysfs_read(CPUQUIET_IDLE_TOP_FREQ, default_idle_top_freq,
+                   sizeof(default_idle_top_freq)) < 0 ||
+        sysfs_read(CPUQUIET_IDLE_BOTTOM_FREQ, default_idle_bottom_freq,
+                   sizeof(default_idle_bottom_freq)) < 0) {
+        default_idle_top_freq[0] = default_idle_bottom_freq[0] = '\0';
+    }
+    pthread_create(&lp_policy_tid, NULL, thread_lp_policy, NULL);
+    pthread_create(&sustained_relock_tid, NULL, thread_sustained_relock, NULL);
 }
 
-static void grouper_power_set_interactive(struct power_module *module __unused, int on)
+static void set_interactive_tunables(bool on)
 {
 	if (on) {
 		sysfs_write(CPUQUIET_CORE_LOCKER, "1");
 		sysfs_write(CPUQUIET_DISABLE_LP_CLUSTER, "1");
-		sysfs_write("/sys/devices/system/cpu/cpufreq/interactive/go_hispeed_load", "75");
-		sysfs_write("/sys/devices/system/cpu/cpuquiet/balanced/core_lock_period", "3000000");
-		sysfs_write("/sys/devices/system/cpu/cpuquiet/balanced/core_lock_count", "2");
+		sysfs_write(INTERACTIVE_GO_HISPEED_LOAD, "75");
+		sysfs_write(CPUQUIET_CORE_LOCK_PERIOD, "3000000");
+		sysfs_write(CPUQUIET_CORE_LOCK_COUNT, "2");
 	} else {
 		sysfs_write(CPUQUIET_CORE_LOCKER, "0");
 		sysfs_write(CPUQUIET_DISABLE_LP_CLUSTER, "0");
-		sysfs_write("/sys/devices/system/cpu/cpufreq/interactive/go_hispeed_load", "85");
-		sysfs_write("/sys/devices/system/cpu/cpuquiet/balanced/core_lock_period", "200000");
-		sysfs_write("/sys/devices/system/cpu/cpuquiet/balanced/core_lock_count", "0");
+		sysfs_write(INTERACTIVE_GO_HISPEED_LOAD, "85");
+		sysfs_write(CPUQUIET_CORE_LOCK_PERIOD, "200000");
+		sysfs_write(CPUQUIET_CORE_LOCK_COUNT, "0");
 	}
 }
 
+static void grouper_power_set_interactive(struct power_module *module __unused, int on)
+{
+	pthread_mutex_lock(&low_power_mode_lock);
+	screen_on = on;
+	/* Sustained mode owns the core lock and hispeed tunables while active */
+	if (!sustained_perf_mode) {
+		set_interactive_tunables(on);
+		set_light_background(!on);
+	}
+	pthread_mutex_unlock(&low_power_mode_lock);
+}
+
+static void set_sustained_perf_mode(bool on)
+{
+    if (on == sustained_perf_mode)
+        return;
+
+    sustained_perf_mode = on;
+    pthread_cond_signal(&sustained_perf_cond);
+    set_light_background(!on && !screen_on);
+    if (on) {
+        /*
+         * cpu_user_cap survives cpu hotplug, unlike scaling_max_freq, so
+         * it needs no help from the uevent thread. Raising go_hispeed_load
+         * to 100 and hispeed_freq to the cap removes the hispeed jump.
+         */
+        sysfs_write(CPU_USER_CAP, SUSTAINED_MAX_FREQ);
+        sysfs_write(INTERACTIVE_HISPEED_FREQ, SUSTAINED_MAX_FREQ);
+        sysfs_write(INTERACTIVE_GO_HISPEED_LOAD, "100");
+        sysfs_write(CPUQUIET_DISABLE_LP_CLUSTER, "1");
+        sysfs_write(CPUQUIET_CORE_LOCK_COUNT, SUSTAINED_CORE_COUNT);
+        sysfs_write(CPUQUIET_CORE_LOCK_PERIOD, SUSTAINED_CORE_LOCK_PERIOD);
+        sysfs_write(CPUQUIET_CORE_LOCKER, "1");
+    } else {
+        sysfs_write(CPU_USER_CAP, "0");
+        sysfs_write(INTERACTIVE_HISPEED_FREQ, NORMAL_MAX_FREQ);
+        set_interactive_tunables(screen_on);
+    }
+}
+
 static void grouper_power_hint(__attribute__((unused)) struct power_module *module, power_hint_t hint,
                             void *data)
 {
     char buf[80];
     int len, cpu, ret;
 
-    switch (hint) {
+    switch ((int) hint) {
     case POWER_HINT_INTERACTION:
-        sysfs_write(CPUFREQ_BOOSTPULSE, "1");
+        /* Held across the boost so it can't land after sustained mode caps the CPU */
+        pthread_mutex_lock(&low_power_mode_lock);
+        if (!sustained_perf_mode)
+            sysfs_write(CPUFREQ_BOOSTPULSE, "1");
+        pthread_mutex_unlock(&low_power_mode_lock);
         break;
     case POWER_HINT_LOW_POWER:
         pthread_mutex_lock(&low_power_mode_lock);
@@ -273,6 +592,11 @@ static void grouper_power_hint(__attribute__((unused)) struct power_module *modu
         }
         pthread_mutex_unlock(&low_power_mode_lock);
         break;
+    case POWER_HINT_SUSTAINED_PERFORMANCE:
+        pthread_mutex_lock(&low_power_mode_lock);
+        set_sustained_perf_mode(data != NULL);
+        pthread_mutex_unlock(&low_power_mode_lock);
+        break;
     default:
             break;
     }
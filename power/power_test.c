@@ -0,0 +1,424 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host test bench for power.grouper. Builds the HAL into this program,
+ * points it at a scratch sysfs tree and a socketpair standing in for the
+ * uevent socket, drives init, setInteractive and powerHint sequences
+ * through the module's entry points and checks the files they leave
+ * behind. Ends with the latency from a hint to its sysfs write. Exits
+ * non-zero if any check fails.
+ */
+/* For nftw() and the FTW_* flags */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifndef __unused
+#define __unused __attribute__((unused))
+#endif
+
+#include "power.c"
+
+#define BENCH_ITERATIONS 10000
+
+static const char *const sysfs_files[] = {
+    "/sys/devices/system/cpu/cpufreq/interactive/timer_rate",
+    "/sys/devices/system/cpu/cpufreq/interactive/min_sample_time",
+    "/sys/devices/system/cpu/cpufreq/interactive/go_hispeed_load",
+    "/sys/devices/system/cpu/cpufreq/interactive/above_hispeed_delay",
+    "/sys/devices/system/cpu/cpufreq/interactive/hispeed_freq",
+    "/sys/devices/system/cpu/cpufreq/interactive/target_loads",
+    "/sys/devices/system/cpu/cpufreq/interactive/boostpulse",
+    "/sys/devices/system/cpu/cpufreq/cpuload/enable",
+    "/sys/devices/system/cpu/cpuquiet/tegra_cpuquiet/enable",
+    "/sys/devices/system/cpu/cpuquiet/tegra_cpuquiet/no_lp",
+    "/sys/devices/system/cpu/cpuquiet/balanced/core_lock_period",
+    "/sys/devices/system/cpu/cpuquiet/balanced/core_lock_count",
+    "/sys/devices/system/cpu/cpuquiet/balanced/core_lock_trigger",
+    "/sys/module/cpuidle/parameters/power_down_in_idle",
+    "/sys/module/cpuidle_t3/parameters/lp2_0_in_idle",
+    "/sys/module/cpuidle_t3/parameters/lp2_n_in_idle",
+    "/sys/module/cpu_tegra/parameters/cpu_user_cap",
+    "/sys/devices/system/cpu/cpu0/cpufreq/scaling_min_freq",
+    "/sys/devices/system/cpu/cpu1/cpufreq/scaling_min_freq",
+    "/sys/devices/system/cpu/cpu2/cpufreq/scaling_min_freq",
+    "/sys/devices/system/cpu/cpu3/cpufreq/scaling_min_freq",
+    "/sys/devices/system/cpu/cpu0/cpufreq/scaling_max_freq",
+    "/sys/devices/system/cpu/cpu1/cpufreq/scaling_max_freq",
+    "/sys/devices/system/cpu/cpu2/cpufreq/scaling_max_freq",
+    "/sys/devices/system/cpu/cpu3/cpufreq/scaling_max_freq",
+};
+
+/* Kernel defaults that init reads back */
+#define DEFAULT_IDLE_TOP_FREQ "612000"
+#define DEFAULT_IDLE_BOTTOM_FREQ "204000"
+
+static char root[PATH_MAX];
+static int uevent_peer = -1;
+static int failures;
+
+/* The LP policy thread parks between samples until lp_sample() releases it */
+static int lp_ready[2], lp_go[2];
+static unsigned long long stat_busy = 200, stat_idle = 10000;
+
+static int fake_uevent_open(void)
+{
+    int fds[2];
+
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) < 0) {
+        fprintf(stderr, "socketpair: %s\n", strerror(errno));
+        return -1;
+    }
+    uevent_peer = fds[1];
+    return fds[0];
+}
+
+static void fake_lp_sample_wait(void)
+{
+    char c = 0;
+
+    if (write(lp_ready[1], &c, 1) != 1 || read(lp_go[0], &c, 1) != 1)
+        usleep(LP_SAMPLE_USEC);
+}
+
+static void lp_wait_parked(void)
+{
+    char c;
+
+    if (read(lp_ready[0], &c, 1) != 1) {
+        fprintf(stderr, "lp_ready: %s\n", strerror(errno));
+        exit(1);
+    }
+}
+
+static void make_file(const char *path, const char *value);
+
+/* Advances /proc/stat by busy and idle ticks and lets the thread act on one sample */
+static void lp_sample(int busy, int idle)
+{
+    char stat[80], c = 0;
+
+    stat_busy += busy;
+    stat_idle += idle;
+    snprintf(stat, sizeof(stat), "cpu  %llu 0 0 %llu 0 0 0 0 0 0\n", stat_busy, stat_idle);
+    make_file(PROC_STAT, stat);
+    if (write(lp_go[1], &c, 1) != 1) {
+        fprintf(stderr, "lp_go: %s\n", strerror(errno));
+        exit(1);
+    }
+    lp_wait_parked();
+}
+
+static void lp_samples(int n, int busy, int idle)
+{
+    while (n--)
+        lp_sample(busy, idle);
+}
+
+static void make_file(const char *path, const char *value)
+{
+    char full_path[PATH_MAX];
+    char *slash;
+    FILE *f;
+
+    snprintf(full_path, sizeof(full_path), "%s%s", root, path);
+    for (slash = strchr(full_path + strlen(root) + 1, '/'); slash;
+         slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(full_path, 0755);
+        *slash = '/';
+    }
+
+    f = fopen(full_path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "%s: %s\n", full_path, strerror(errno));
+        exit(1);
+    }
+    fputs(value, f);
+    fclose(f);
+}
+
+static void remove_file(const char *path)
+{
+    char full_path[PATH_MAX];
+
+    snprintf(full_path, sizeof(full_path), "%s%s", root, path);
+    unlink(full_path);
+}
+
+static void read_file(const char *path, char *value, size_t size)
+{
+    char full_path[PATH_MAX];
+    FILE *f;
+    size_t n = 0;
+
+    snprintf(full_path, sizeof(full_path), "%s%s", root, path);
+    f = fopen(full_path, "r");
+    if (f != NULL) {
+        n = fread(value, 1, size - 1, f);
+        fclose(f);
+    }
+    value[n] = '\0';
+}
+
+static void expect(const char *step, const char *path, const char *expected)
+{
+    char value[80];
+
+    read_file(path, value, sizeof(value));
+    if (strcmp(value, expected) != 0) {
+        fprintf(stderr, "FAIL %s: %s is \"%s\", expected \"%s\"\n", step, path, value,
+                expected);
+        failures++;
+    }
+}
+
+/* The uevent thread writes asynchronously; give it up to a second */
+static void expect_eventually(const char *step, const char *path, const char *expected)
+{
+    char value[80];
+    int i;
+
+    for (i = 0; i < 100; i++) {
+        read_file(path, value, sizeof(value));
+        if (strcmp(value, expected) == 0)
+            return;
+        usleep(10000);
+    }
+    expect(step, path, expected);
+}
+
+static void expect_cpus(const char *step, const char *min, const char *max)
+{
+    int cpu;
+
+    for (cpu = 0; cpu < TOTAL_CPUS; cpu++) {
+        if (min)
+            expect(step, cpu_path_min[cpu], min);
+        expect(step, cpu_path_max[cpu], max);
+    }
+}
+
+static void expect_interactive(const char *step, bool on)
+{
+    expect(step, CPUQUIET_CORE_LOCKER, on ? "1" : "0");
+    expect(step, CPUQUIET_DISABLE_LP_CLUSTER, on ? "1" : "0");
+    expect(step, INTERACTIVE_GO_HISPEED_LOAD, on ? "75" : "85");
+    expect(step, CPUQUIET_CORE_LOCK_PERIOD, on ? "3000000" : "200000");
+    expect(step, CPUQUIET_CORE_LOCK_COUNT, on ? "2" : "0");
+    expect(step, CPUQUIET_IDLE_TOP_FREQ, on ? DEFAULT_IDLE_TOP_FREQ : LP_IDLE_TOP_FREQ);
+    expect(step, CPUQUIET_IDLE_BOTTOM_FREQ,
+           on ? DEFAULT_IDLE_BOTTOM_FREQ : LP_IDLE_BOTTOM_FREQ);
+}
+
+static int remove_entry(const char *path, __unused const struct stat *st, __unused int type,
+                        __unused struct FTW *ftw)
+{
+    return remove(path);
+}
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int compare_ns(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Times hint() from the call to the write landing in the scratch file */
+static void bench(const char *name, void (*hint)(int), const char *path)
+{
+    static long long samples[BENCH_ITERATIONS];
+    long long total = 0;
+    char value[80];
+    int i;
+
+    for (i = 0; i < BENCH_ITERATIONS; i++) {
+        long long start;
+
+        make_file(path, "");
+        start = now_ns();
+        hint(i);
+        samples[i] = now_ns() - start;
+        total += samples[i];
+
+        read_file(path, value, sizeof(value));
+        if (!value[0]) {
+            fprintf(stderr, "FAIL bench %s: no write to %s\n", name, path);
+            failures++;
+            return;
+        }
+    }
+
+    qsort(samples, BENCH_ITERATIONS, sizeof(samples[0]), compare_ns);
+    printf("%-24s mean %7lld ns  p50 %7lld ns  p99 %7lld ns  max %7lld ns\n", name,
+           total / BENCH_ITERATIONS, samples[BENCH_ITERATIONS / 2],
+           samples[BENCH_ITERATIONS * 99 / 100], samples[BENCH_ITERATIONS - 1]);
+}
+
+static void hint_interaction(__unused int i)
+{
+    HAL_MODULE_INFO_SYM.powerHint(&HAL_MODULE_INFO_SYM, POWER_HINT_INTERACTION, NULL);
+}
+
+static void hint_set_interactive(int i)
+{
+    HAL_MODULE_INFO_SYM.setInteractive(&HAL_MODULE_INFO_SYM, i & 1);
+}
+
+int main(void)
+{
+    struct power_module *module = &HAL_MODULE_INFO_SYM;
+    const char *tmp = getenv("TMPDIR");
+    static const char online_cpu2[] = "online@/devices/system/cpu/cpu2";
+    size_t i;
+
+    snprintf(root, sizeof(root), "%s/power_test.XXXXXX", tmp ? tmp : "/tmp");
+    if (mkdtemp(root) == NULL) {
+        fprintf(stderr, "mkdtemp: %s\n", strerror(errno));
+        return 1;
+    }
+    for (i = 0; i < sizeof(sysfs_files) / sizeof(sysfs_files[0]); i++)
+        make_file(sysfs_files[i], "");
+    make_file(CPUQUIET_IDLE_TOP_FREQ, DEFAULT_IDLE_TOP_FREQ);
+    make_file(CPUQUIET_IDLE_BOTTOM_FREQ, DEFAULT_IDLE_BOTTOM_FREQ);
+    make_file(PROC_STAT, "cpu  100 0 100 10000 0 0 0 0 0 0\n");
+
+    sysfs_root = root;
+    uevent_open = fake_uevent_open;
+    if (pipe(lp_ready) < 0 || pipe(lp_go) < 0) {
+        fprintf(stderr, "pipe: %s\n", strerror(errno));
+        return 1;
+    }
+    lp_sample_wait = fake_lp_sample_wait;
+
+    module->init(module);
+    expect("init", "/sys/devices/system/cpu/cpufreq/interactive/timer_rate", "50000");
+    expect("init", "/sys/devices/system/cpu/cpufreq/interactive/target_loads",
+           "45 1000000:65 1100000:75");
+    expect("init", INTERACTIVE_HISPEED_FREQ, NORMAL_MAX_FREQ);
+    expect("init", CPUQUIET_CORE_LOCKER, "1");
+    expect("init", CPUQUIET_DISABLE_LP_CLUSTER, "0");
+    expect("init", "/sys/module/cpuidle_t3/parameters/lp2_n_in_idle", "1");
+    if (uevent_peer < 0) {
+        fprintf(stderr, "FAIL init: uevent source not opened\n");
+        return 1;
+    }
+
+    module->setInteractive(module, 0);
+    expect_interactive("screen off", false);
+    module->setInteractive(module, 1);
+    expect_interactive("screen on", true);
+
+    /* cpu2 is offline, so its limits can't be set until it comes back */
+    remove_file(cpu_path_max[2]);
+    module->powerHint(module, POWER_HINT_LOW_POWER, (void *)1);
+    expect("low power", CPUQUIET_CORE_LOCKER, "0");
+    expect("low power", cpu_path_max[0], LOW_POWER_MAX_FREQ);
+    expect("low power", cpu_path_min[3], LOW_POWER_MIN_FREQ);
+    make_file(cpu_path_max[2], NORMAL_MAX_FREQ);
+    send(uevent_peer, online_cpu2, strlen(online_cpu2), 0);
+    expect_eventually("cpu2 online", cpu_path_max[2], LOW_POWER_MAX_FREQ);
+    expect_cpus("cpu2 online", LOW_POWER_MIN_FREQ, LOW_POWER_MAX_FREQ);
+
+    module->powerHint(module, POWER_HINT_LOW_POWER, NULL);
+    expect("normal power", CPUQUIET_CORE_LOCKER, "1");
+    expect_cpus("normal power", NULL, NORMAL_MAX_FREQ);
+
+    /* Re-arm the core lock quickly enough to see it happen */
+    sustained_relock_msec = 20;
+    module->powerHint(module, POWER_HINT_SUSTAINED_PERFORMANCE, (void *)1);
+    expect("sustained", CPU_USER_CAP, SUSTAINED_MAX_FREQ);
+    expect("sustained", INTERACTIVE_HISPEED_FREQ, SUSTAINED_MAX_FREQ);
+    expect("sustained", INTERACTIVE_GO_HISPEED_LOAD, "100");
+    expect("sustained", CPUQUIET_CORE_LOCK_COUNT, SUSTAINED_CORE_COUNT);
+    expect("sustained", CPUQUIET_CORE_LOCK_PERIOD, SUSTAINED_CORE_LOCK_PERIOD);
+    make_file(CPUQUIET_CORE_LOCKER, "");
+    expect_eventually("sustained relock", CPUQUIET_CORE_LOCKER, "1");
+    make_file(CPUFREQ_BOOSTPULSE, "");
+    module->powerHint(module, POWER_HINT_INTERACTION, NULL);
+    expect("sustained interaction", CPUFREQ_BOOSTPULSE, "");
+
+    /* The screen going off under sustained mode must not undo it */
+    module->setInteractive(module, 0);
+    expect("sustained screen off", INTERACTIVE_GO_HISPEED_LOAD, "100");
+    expect("sustained screen off", CPUQUIET_CORE_LOCK_COUNT, SUSTAINED_CORE_COUNT);
+    module->powerHint(module, POWER_HINT_SUSTAINED_PERFORMANCE, NULL);
+    expect("sustained off", CPU_USER_CAP, "0");
+    expect("sustained off", INTERACTIVE_HISPEED_FREQ, NORMAL_MAX_FREQ);
+    expect_interactive("sustained off", false);
+    module->setInteractive(module, 1);
+    expect_interactive("screen on again", true);
+
+    module->powerHint(module, POWER_HINT_INTERACTION, NULL);
+    expect("interaction", CPUFREQ_BOOSTPULSE, "1");
+
+    /*
+     * Screen off: LP_UP_SAMPLES busy samples in a row force the G cluster
+     * and LP_DOWN_SAMPLES quiet ones hand back to LP. A sample in between
+     * the two thresholds starts either count over.
+     */
+    module->setInteractive(module, 0);
+    lp_wait_parked();
+    lp_samples(LP_UP_SAMPLES - 1, 80, 20);
+    expect("lp short burst", CPUQUIET_DISABLE_LP_CLUSTER, "0");
+    lp_sample(40, 60);
+    lp_samples(LP_UP_SAMPLES - 1, 80, 20);
+    expect("lp burst after mid load", CPUQUIET_DISABLE_LP_CLUSTER, "0");
+    lp_sample(80, 20);
+    expect("lp busy", CPUQUIET_DISABLE_LP_CLUSTER, "1");
+    lp_samples(LP_DOWN_SAMPLES - 1, 10, 90);
+    expect("lp short lull", CPUQUIET_DISABLE_LP_CLUSTER, "1");
+    lp_sample(80, 20);
+    lp_samples(LP_DOWN_SAMPLES - 1, 10, 90);
+    expect("lp lull after busy", CPUQUIET_DISABLE_LP_CLUSTER, "1");
+    lp_sample(10, 90);
+    expect("lp quiet", CPUQUIET_DISABLE_LP_CLUSTER, "0");
+    lp_samples(LP_UP_SAMPLES, 80, 20);
+    expect("lp busy again", CPUQUIET_DISABLE_LP_CLUSTER, "1");
+    module->setInteractive(module, 1);
+    expect_interactive("lp screen on", true);
+
+    bench("interaction boost", hint_interaction, CPUFREQ_BOOSTPULSE);
+    bench("setInteractive", hint_set_interactive, CPUQUIET_CORE_LOCK_COUNT);
+
+    if (failures) {
+        fprintf(stderr, "%d check(s) failed; sysfs tree left in %s\n", failures, root);
+        return 1;
+    }
+    nftw(root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    printf("all checks passed\n");
+    return 0;
+}